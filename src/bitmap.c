@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include "frame_arena.h"
 #include "bitmap.h"
 
 #pragma pack(push,1)
@@ -72,7 +73,7 @@ bool bmWriteBitmap(FILE *fp, uint32_t width, uint32_t height, uint8_t bytesPerPi
 
     // Allocate pixel buffer
     size_t output_bytes = height * stride;
-    uint8_t *p_pix = (uint8_t*) malloc(output_bytes);
+    uint8_t *p_pix = (uint8_t*) fa_scratch(output_bytes);
 
     if (!p_pix) {
         perror("Can't allocate memory for image file buffer");
@@ -155,7 +156,7 @@ bool bmWriteBitmap(FILE *fp, uint32_t width, uint32_t height, uint8_t bytesPerPi
 
     // Free pixel data
     if (p_pix) {
-        free(p_pix);
+        fa_release(p_pix);
         p_pix = NULL;
     }
 
@@ -193,7 +194,7 @@ bool bmWriteBitmapWithColorTable(FILE *fp, uint32_t width, uint32_t height, rgbC
 
     // Allocate pixel buffer
     size_t output_bytes = height * stride;
-    uint8_t *p_pix = (uint8_t*) malloc(output_bytes);
+    uint8_t *p_pix = (uint8_t*) fa_scratch(output_bytes);
 
     if (!p_pix) {
         perror("Can't allocate memory for image file buffer");
@@ -246,7 +247,7 @@ bool bmWriteBitmapWithColorTable(FILE *fp, uint32_t width, uint32_t height, rgbC
 
     // Free pixel data
     if (p_pix) {
-        free(p_pix);
+        fa_release(p_pix);
         p_pix = NULL;
     }
 
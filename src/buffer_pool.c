@@ -0,0 +1,100 @@
+//
+// Pre-faulted, locked memory pool for capture and processing buffers
+//
+// Frames are large and touched sequentially every capture, so 4 KB pages cost a
+// TLB miss every few rows and a page fault on the first frame. The pool is mapped
+// once at startup from huge pages, faulted in and locked, then carved up with a
+// bump allocator.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "buffer_pool.h"
+
+bool bp_init(bp_pool_t *p_pool, size_t size) {
+    void *p_base;
+
+    if (!p_pool || size == 0) {
+        return false;
+    }
+
+    memset(p_pool, 0, sizeof(bp_pool_t));
+
+    size = (size + BP_HUGE_PAGE_SIZE - 1) & ~((size_t) BP_HUGE_PAGE_SIZE - 1);
+
+    p_base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+
+    if (p_base != MAP_FAILED) {
+        p_pool->b_hugetlb = true;
+    } else {
+        /* No reserved huge pages, ask for transparent ones instead */
+        p_base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p_base == MAP_FAILED) {
+            perror("bp_init: mmap");
+            return false;
+        }
+
+        madvise(p_base, size, MADV_HUGEPAGE);
+
+        /* Fault every page in now rather than on the first frame */
+        for (size_t offset=0; offset < size; offset += BP_ALIGN) {
+            ((volatile uint8_t *) p_base)[offset] = 0;
+        }
+    }
+
+    if (mlock(p_base, size) == 0) {
+        p_pool->b_locked = true;
+    } else {
+        perror("bp_init: mlock, pool may be paged out");
+    }
+
+    p_pool->p_base = p_base;
+    p_pool->size = size;
+
+    fprintf(stdout, "%s: %zu KB pool, %s pages%s\n", __func__, size / 1024,
+            p_pool->b_hugetlb ? "huge" : "transparent huge", p_pool->b_locked ? ", locked" : "");
+
+    return true;
+}
+
+void bp_destroy(bp_pool_t *p_pool) {
+    if (!p_pool || !p_pool->p_base) {
+        return;
+    }
+
+    if (p_pool->b_locked) {
+        munlock(p_pool->p_base, p_pool->size);
+    }
+
+    munmap(p_pool->p_base, p_pool->size);
+    memset(p_pool, 0, sizeof(bp_pool_t));
+}
+
+void *bp_alloc(bp_pool_t *p_pool, size_t size) {
+    void *p_ptr;
+
+    if (!p_pool || !p_pool->p_base) {
+        return NULL;
+    }
+
+    size = (size + BP_ALIGN - 1) & ~((size_t) BP_ALIGN - 1);
+
+    if (size > p_pool->size - p_pool->used) {
+        return NULL;
+    }
+
+    p_ptr = p_pool->p_base + p_pool->used;
+    p_pool->used += size;
+
+    return p_ptr;
+}
+
+bool bp_contains(const bp_pool_t *p_pool, const void *p_ptr) {
+    if (!p_pool || !p_pool->p_base) {
+        return false;
+    }
+
+    return ((const uint8_t *) p_ptr >= p_pool->p_base && (const uint8_t *) p_ptr < p_pool->p_base + p_pool->size);
+}
@@ -0,0 +1,62 @@
+//
+// Pre-faulted, locked memory pool for capture and processing buffers
+//
+
+#ifndef _BUFFER_POOL_H
+#define _BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Pool size is rounded up to whole huge pages */
+#define BP_HUGE_PAGE_SIZE                           (2 * 1024 * 1024)
+
+/* Alignment of every allocation, capture buffers must start on a page */
+#define BP_ALIGN                                    (4096)
+
+typedef struct {
+    uint8_t *p_base;
+    size_t size;
+    size_t used;
+
+    /* How the pool ended up being backed */
+    bool b_hugetlb;
+    bool b_locked;
+} bp_pool_t;
+
+/**
+ * @func bp_init
+ * @param p_pool Pool to initialize
+ * @param size Bytes needed, rounded up to BP_HUGE_PAGE_SIZE
+ * @return True if the pool was mapped
+ *
+ * Explicit huge pages are tried first, then transparent huge pages. Every page is
+ * faulted in and the pool is locked in memory, a failure to lock is only reported.
+ */
+bool bp_init(bp_pool_t *p_pool, size_t size);
+
+/**
+ * @func bp_destroy
+ * @param p_pool Pool to unmap, every allocation from it becomes invalid
+ */
+void bp_destroy(bp_pool_t *p_pool);
+
+/**
+ * @func bp_alloc
+ * @param p_pool Pool to allocate from
+ * @param size Bytes needed
+ * @return BP_ALIGN aligned memory, NULL if the pool is exhausted. Allocations are only
+ *         released with the whole pool.
+ */
+void *bp_alloc(bp_pool_t *p_pool, size_t size);
+
+/**
+ * @func bp_contains
+ * @param p_pool Pool
+ * @param p_ptr Any pointer
+ * @return True if p_ptr was allocated from the pool, and must not be passed to free()
+ */
+bool bp_contains(const bp_pool_t *p_pool, const void *p_ptr);
+
+#endif //_BUFFER_POOL_H
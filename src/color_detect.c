@@ -2,20 +2,22 @@
 // Created by rsnook on 5/28/20.
 //
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "bitmap.h"
+#include "histogram.h"
+#include "frame_arena.h"
+#include "frame_meta.h"
 #include "color_detect.h"
 
 #define MIN_HORIZ_PIXELS_FOR_FEATURE_LINE   (3)
 #define MIN_BLOB_PIXELS                     (50)
 
-#define BLOB_ALLOWED_ROW_MISS_PERCENT       (0.05f)
-#define BLOB_ALLOWED_COLUMN_MISS_PERCENT    (0.05f)
-
 #define WHITE_COLOR_TABLE_INDEX             (3)
 #define BLACK_COLOR_TABLE_INDEX             (2)
 #define GREEN_COLOR_TABLE_INDEX             (4)
@@ -25,22 +27,103 @@
 
 #define NO_DETECT_COLOR_TABLE_INDEX         (BLACK_COLOR_TABLE_INDEX)
 
-#define MAX_DETECT_COLORS                   (2)
+// Detect color n is drawn with color table entry DETECT_COLOR_TABLE_BASE + n, set from the color itself, and its
+// blobs' boxes with DETECT_BOX_TABLE_BASE + n, the color inverted so the box stands out from the blob
+#define DETECT_COLOR_TABLE_BASE             (16)
+#define DETECT_BOX_TABLE_BASE               (DETECT_COLOR_TABLE_BASE + MAX_DETECT_COLORS)
+
+// Fixed margin in pixels predicted windows are expanded by
+#define DETECT_TRACK_MARGIN                 (16)
+
+// Coarse-to-fine falls back to a full scan past this many candidate windows, and stops growing windows after this
+// many refinement passes
+#define COARSE_MAX_WINDOWS                  (64)
+#define COARSE_MAX_PASSES                   (8)
+
+// Strips of fewer rows cost more to hand out and join than they save
+#define DETECT_MIN_STRIP_ROWS               (16)
 
-#define BLOB_STRING_MAX_LENGTH              (1024)
+// RGB classification table, indexed by the top COLOR_LUT_BITS of each channel
+#define COLOR_LUT_BITS                      (6)
+#define COLOR_LUT_SHIFT                     (8 - COLOR_LUT_BITS)
+#define COLOR_LUT_SIZE                      (1 << (3 * COLOR_LUT_BITS))
+
+// YUV classification table, a UV plane for each of 2^YUV_LUT_Y_BITS luma bands
+#define YUV_LUT_Y_BITS                      (4)
+#define YUV_LUT_UV_BITS                     (6)
+#define YUV_LUT_SIZE                        (1 << (YUV_LUT_Y_BITS + 2 * YUV_LUT_UV_BITS))
 
-static uint32_t detect_color_table[MAX_DETECT_COLORS] = { PURPLE_COLOR_TABLE_INDEX, YELLOW_COLOR_TABLE_INDEX };
-static uint32_t draw_color_table[MAX_DETECT_COLORS] = { ORANGE_COLOR_TABLE_INDEX, GREEN_COLOR_TABLE_INDEX };
 static detect_color_t detect_colors[MAX_DETECT_COLORS] = { 0 };
 
+// A horizontal run of one detect color, x_max is exclusive
+typedef struct {
+    uint32_t x_min;
+    uint32_t x_max;
+    uint32_t y;
+    uint32_t color_index;
+
+    // union-find parent, and the component of the run once labeled
+    uint32_t parent;
+    uint32_t label;
+} run_t;
+
+// Columns [x_min, x_max) of a row
+typedef struct {
+    int x_min;
+    int x_max;
+} row_span_t;
+
+// A stretch of classified pixels and the colors found in it
+typedef struct {
+    int x_min;
+    int x_max;
+    detect_mask_t mask;
+} row_segment_t;
+
+// Runs collected by one labeler, with its scratch for row segments
+typedef struct {
+    run_t *p_runs;
+    size_t num_runs;
+    size_t runs_capacity;
+
+    row_segment_t *p_segments;
+    size_t segments_capacity;
+} run_list_t;
+
+// A connected component with its first moments, so centroids survive combining
+typedef struct {
+    blob_t blob;
+    uint64_t sum_x;
+    uint64_t sum_y;
+} component_t;
+
 // internal type to hold detections and associated data
 typedef struct {
-    blob_t blobs[COLOR_DETECT_NUM_BLOBS_MAX];
+    component_t *p_components;
     size_t num_blobs;
+    size_t components_capacity;
+
+    run_list_t runs;
 } detections_t;
 
 static rgbColorTableEntry colorDetectColorTable[256] = { 0 };
 
+// The detection image shows detect color index in the color itself, and boxes its blobs in the inverted color
+static void set_detect_color_table(uint32_t index) {
+    rgbColorTableEntry *p_entry = &colorDetectColorTable[DETECT_COLOR_TABLE_BASE + index];
+    rgbColorTableEntry *p_box = &colorDetectColorTable[DETECT_BOX_TABLE_BASE + index];
+
+    p_entry->red = (uint8_t) detect_colors[index].red;
+    p_entry->green = (uint8_t) detect_colors[index].green;
+    p_entry->blue = (uint8_t) detect_colors[index].blue;
+    p_entry->reserved = 0;
+
+    p_box->red = 255 - p_entry->red;
+    p_box->green = 255 - p_entry->green;
+    p_box->blue = 255 - p_entry->blue;
+    p_box->reserved = 0;
+}
+
 void colorDetectInit(void) {
     // build color-detect color-table
     for (uint32_t i=0; i < 256; ++i) {
@@ -80,11 +163,30 @@ void colorDetectInit(void) {
     colorDetectColorTable[ORANGE_COLOR_TABLE_INDEX].green = 165;
     colorDetectColorTable[ORANGE_COLOR_TABLE_INDEX].red = 255;
     colorDetectColorTable[ORANGE_COLOR_TABLE_INDEX].reserved = 0;
+
+    // detect colors set before init
+    for (uint32_t i=0; i < MAX_DETECT_COLORS; ++i) {
+        set_detect_color_table(i);
+    }
 }
 
 // the detections data structure
 static detections_t detections;
 
+// Detection parameters a classification table was built for
+typedef struct {
+    detect_color_t colors[MAX_DETECT_COLORS];
+    int color_count;
+    float tolerance;
+} lut_params_t;
+
+// Mask of the detect colors matching every quantized RGB and YUV cell
+static detect_mask_t color_lut[COLOR_LUT_SIZE];
+static lut_params_t color_lut_params = { .color_count = -1 };
+
+static detect_mask_t yuv_lut[YUV_LUT_SIZE];
+static lut_params_t yuv_lut_params = { .color_count = -1 };
+
 bool calcNorms(detect_color_t* p_detect_color) {
 
     // avoid divide by zeroes
@@ -117,6 +219,7 @@ bool calcNorms(detect_color_t* p_detect_color) {
 void setDetectColor(detect_color_t* p_detect_color, uint32_t index) {
     if (index < MAX_DETECT_COLORS) {
         memcpy(&detect_colors[index], p_detect_color, sizeof(detect_color_t));
+        set_detect_color_table(index);
     }
 }
 
@@ -151,102 +254,280 @@ bool rgb_match(detect_color_t *p_detect_color, uint8_t red, uint8_t green, uint8
     return false;
 }
 
-static void clear_blobs(void) {
-    detections.num_blobs = 0;
+static inline uint32_t color_lut_index(uint8_t red, uint8_t green, uint8_t blue) {
+    return ((uint32_t) (red >> COLOR_LUT_SHIFT) << (2 * COLOR_LUT_BITS)) |
+           ((uint32_t) (green >> COLOR_LUT_SHIFT) << COLOR_LUT_BITS) |
+           (uint32_t) (blue >> COLOR_LUT_SHIFT);
+}
+
+static bool lut_params_match(const lut_params_t *p_lut_params, const detect_params_t *p_detect_params) {
+    if (p_detect_params->color_count != p_lut_params->color_count || p_detect_params->tolerance != p_lut_params->tolerance) {
+        return false;
+    }
+
+    for (int dci=0; dci < p_lut_params->color_count && dci < MAX_DETECT_COLORS; ++dci) {
+        const detect_color_t *p_color = &p_detect_params->p_detect_colors[dci];
+
+        if (p_color->red != p_lut_params->colors[dci].red || p_color->green != p_lut_params->colors[dci].green ||
+                p_color->blue != p_lut_params->colors[dci].blue) {
+            return false;
+        }
+    }
+
+    return true;
+}
 
-    for (size_t i=0; i < COLOR_DETECT_NUM_BLOBS_MAX; ++i) {
-        memset(&detections.blobs[i], 0, sizeof(blob_t));
+static void lut_params_store(lut_params_t *p_lut_params, const detect_params_t *p_detect_params) {
+    for (int dci=0; dci < p_detect_params->color_count && dci < MAX_DETECT_COLORS; ++dci) {
+        p_lut_params->colors[dci] = p_detect_params->p_detect_colors[dci];
     }
+    p_lut_params->color_count = p_detect_params->color_count;
+    p_lut_params->tolerance = p_detect_params->tolerance;
 }
 
-static int find_containing_blob(int w_min, int w_max, int h_last, int image_width, int image_height, int detect_color_index) {
-    int allowed_row_miss = (int)(BLOB_ALLOWED_ROW_MISS_PERCENT * ((float)image_height));
-    int allowed_column_miss = (int)(BLOB_ALLOWED_COLUMN_MISS_PERCENT * ((float)image_width));
+// Bit n is set when the pixel matches detect color n
+static detect_mask_t classify_rgb(const detect_params_t *p_detect_params, uint8_t red, uint8_t green, uint8_t blue) {
+    detect_mask_t mask = 0;
+
+    for (int dci=0; dci < p_detect_params->color_count && dci < MAX_DETECT_COLORS; ++dci) {
+        if (rgb_match(&p_detect_params->p_detect_colors[dci], red, green, blue, p_detect_params->tolerance)) {
+            mask |= (detect_mask_t) 1 << dci;
+        }
+    }
 
-    for (size_t i=0; i < COLOR_DETECT_NUM_BLOBS_MAX; ++i) {
-        blob_t *p_blob = &detections.blobs[i];
+    return mask;
+}
 
-        if (p_blob->valid) {
-            // check that the detect color matches
-            if (detect_color_index == p_blob->color_index) {
-                int x_min = (p_blob->bb_x_min - allowed_column_miss < 0) ? 0 : p_blob->bb_x_min - allowed_column_miss;
-                int x_max = (p_blob->bb_x_max + allowed_column_miss > image_width) ? image_width : p_blob->bb_x_max +
-                                                                                                   allowed_column_miss;
-                int y_max = (p_blob->bb_y_max + allowed_row_miss > image_height) ? image_height : p_blob->bb_y_max +
-                                                                                                  allowed_row_miss;
+// Classify the center of every quantized cell with rgb_match(), so per pixel classification is a single load
+// whatever the number of colors.
+static void build_color_lut(const detect_params_t *p_detect_params) {
+    const uint32_t half_step = (1 << COLOR_LUT_SHIFT) / 2;
 
-                // if this blob is in progress...i.e. the last line added to it
-                if (y_max >= h_last) {
-                    //Iterate over segment
-                    for (size_t j = w_min; j < w_max; ++j) {
-                        // If any point is within the x bounding-box of the blob, it belongs to that blob
-                        if (j >= x_min && j <= x_max) {
-                            return i;
-                        }
-                    }
-                }
+    for (uint32_t r=0; r < (1 << COLOR_LUT_BITS); ++r) {
+        for (uint32_t g=0; g < (1 << COLOR_LUT_BITS); ++g) {
+            for (uint32_t b=0; b < (1 << COLOR_LUT_BITS); ++b) {
+                uint8_t red = (r << COLOR_LUT_SHIFT) + half_step;
+                uint8_t green = (g << COLOR_LUT_SHIFT) + half_step;
+                uint8_t blue = (b << COLOR_LUT_SHIFT) + half_step;
+
+                color_lut[color_lut_index(red, green, blue)] = classify_rgb(p_detect_params, red, green, blue);
             }
         }
     }
-    return -1;
+
+    lut_params_store(&color_lut_params, p_detect_params);
 }
 
-static void append_blob(int w_min, int w_max, int h_last, int index, uint32_t detect_color_index) {
+static inline uint32_t yuv_lut_index(uint8_t y, uint8_t u, uint8_t v) {
+    return ((uint32_t) (y >> (8 - YUV_LUT_Y_BITS)) << (2 * YUV_LUT_UV_BITS)) |
+           ((uint32_t) (u >> (8 - YUV_LUT_UV_BITS)) << YUV_LUT_UV_BITS) |
+           (uint32_t) (v >> (8 - YUV_LUT_UV_BITS));
+}
 
-    if (w_min < 0 || w_max < 0 || index < 0 || index > COLOR_DETECT_NUM_BLOBS_MAX) {
-        perror("Invalid blob or segment");
-        return;
+static inline uint8_t clamp_channel(int value) {
+    return (value > 255) ? 255 : ((value < 0) ? 0 : value);
+}
+
+// Each cell center is converted to RGB with the same integer transform compress_yuyv_to_jpeg() uses and classified
+// with rgb_match(), so both paths agree within quantization. The luma bands gate the chroma match: a UV cell can
+// match in bright bands and not in dark ones, where the channel ratios fall apart.
+static void build_yuv_lut(const detect_params_t *p_detect_params) {
+    const uint32_t y_half_step = (1 << (8 - YUV_LUT_Y_BITS)) / 2;
+    const uint32_t uv_half_step = (1 << (8 - YUV_LUT_UV_BITS)) / 2;
+
+    for (uint32_t yb=0; yb < (1 << YUV_LUT_Y_BITS); ++yb) {
+        for (uint32_t ub=0; ub < (1 << YUV_LUT_UV_BITS); ++ub) {
+            for (uint32_t vb=0; vb < (1 << YUV_LUT_UV_BITS); ++vb) {
+                int y = (yb << (8 - YUV_LUT_Y_BITS)) + y_half_step;
+                int u = (int) ((ub << (8 - YUV_LUT_UV_BITS)) + uv_half_step) - 128;
+                int v = (int) ((vb << (8 - YUV_LUT_UV_BITS)) + uv_half_step) - 128;
+
+                uint8_t red = clamp_channel(((y << 8) + (359 * v)) >> 8);
+                uint8_t green = clamp_channel(((y << 8) - (88 * u) - (183 * v)) >> 8);
+                uint8_t blue = clamp_channel(((y << 8) + (454 * u)) >> 8);
+
+                yuv_lut[yuv_lut_index(y, u + 128, v + 128)] = classify_rgb(p_detect_params, red, green, blue);
+            }
+        }
     }
-    blob_t *p_blob = &detections.blobs[index];
 
-    if (detect_color_index != p_blob->color_index) {
-        return;
+    lut_params_store(&yuv_lut_params, p_detect_params);
+}
+
+// Grow p_array to hold at least count elements, keeping its contents
+static bool reserve_elements(void **pp_array, size_t *p_capacity, size_t count, size_t element_size) {
+    if (count <= *p_capacity) {
+        return true;
     }
 
-    p_blob->bb_y_max = h_last;
+    size_t capacity = (*p_capacity == 0) ? 1024 : *p_capacity;
 
-    if (w_min < p_blob->bb_x_min) {
-        p_blob->bb_x_min = w_min;
+    while (capacity < count) {
+        capacity *= 2;
     }
 
-    if (w_max > p_blob->bb_x_max) {
-        p_blob->bb_x_max = w_max;
+    void *p_array = realloc(*pp_array, capacity * element_size);
+
+    if (!p_array) {
+        perror("reserve_elements: realloc");
+        return false;
     }
 
-    // update pixel count
-    p_blob->num_pixels += w_max - w_min;
+    *pp_array = p_array;
+    *p_capacity = capacity;
 
-    // blob has at least two rows, it is complete
-    p_blob->complete = true;
+    return true;
 }
 
-static int new_blob(int w_min, int w_max, int h, uint32_t detect_color_index) {
-    for (size_t i=0; i < COLOR_DETECT_NUM_BLOBS_MAX; ++i) {
-        blob_t *p_blob = &detections.blobs[i];
-        if (!p_blob->valid) {
-            // found empty blob
-            p_blob->bb_y_min = h;
-            p_blob->bb_y_max = h;
-            p_blob->bb_x_min = w_min;
-            p_blob->bb_x_max = w_max;
-            p_blob->num_pixels = w_max - w_min;
-            p_blob->color_index = detect_color_index;
-            p_blob->complete = false;
-            p_blob->valid = true;
-            detections.num_blobs++;
-            return i;
+static uint32_t find_root(run_t *p_runs, uint32_t index) {
+    // path halving
+    while (p_runs[index].parent != index) {
+        p_runs[index].parent = p_runs[p_runs[index].parent].parent;
+        index = p_runs[index].parent;
+    }
+
+    return index;
+}
+
+static void union_runs(run_t *p_runs, uint32_t a, uint32_t b) {
+    uint32_t root_a = find_root(p_runs, a);
+    uint32_t root_b = find_root(p_runs, b);
+
+    // the earliest run stays the root, so labels come out in scan order
+    if (root_a < root_b) {
+        p_runs[root_b].parent = root_a;
+    } else if (root_b < root_a) {
+        p_runs[root_a].parent = root_b;
+    }
+}
+
+// Append the runs of each detect color over the spans of one row of class masks, ordered by color then x as
+// join_rows() expects. Pixels matching no color are skipped once for all colors, so each further color only costs
+// a pass over the segments that contain it. Runs shorter than MIN_HORIZ_PIXELS_FOR_FEATURE_LINE are noise.
+static bool add_row_runs(run_list_t *p_list, const detect_mask_t *p_row, const row_span_t *p_spans, int num_spans,
+                         int color_count, uint32_t y) {
+    size_t num_segments = 0;
+    detect_mask_t row_mask = 0;
+
+    for (int i = 0; i < num_spans; ++i) {
+        int w = p_spans[i].x_min;
+
+        while (w < p_spans[i].x_max) {
+            if (p_row[w] == 0) {
+                ++w;
+                continue;
+            }
+
+            int x_min = w;
+            detect_mask_t mask = 0;
+
+            while (w < p_spans[i].x_max && p_row[w] != 0) {
+                mask |= p_row[w++];
+            }
+
+            if (w - x_min < MIN_HORIZ_PIXELS_FOR_FEATURE_LINE) {
+                continue;
+            }
+
+            if (!reserve_elements((void **) &p_list->p_segments, &p_list->segments_capacity, num_segments + 1,
+                                  sizeof(row_segment_t))) {
+                return false;
+            }
+
+            row_segment_t *p_segments = p_list->p_segments;
+
+            p_segments[num_segments].x_min = x_min;
+            p_segments[num_segments].x_max = w;
+            p_segments[num_segments].mask = mask;
+            num_segments++;
+
+            row_mask |= mask;
+        }
+    }
+
+    for (int color_index = 0; color_index < color_count && color_index < MAX_DETECT_COLORS; ++color_index) {
+        detect_mask_t bit = (detect_mask_t) 1 << color_index;
+
+        if (!(row_mask & bit)) {
+            continue;
+        }
+
+        const row_segment_t *p_segments = p_list->p_segments;
+
+        for (size_t i = 0; i < num_segments; ++i) {
+            if (!(p_segments[i].mask & bit)) {
+                continue;
+            }
+
+            int w = p_segments[i].x_min;
+
+            while (w < p_segments[i].x_max) {
+                if (!(p_row[w] & bit)) {
+                    ++w;
+                    continue;
+                }
+
+                int x_min = w;
+
+                while (w < p_segments[i].x_max && (p_row[w] & bit)) {
+                    ++w;
+                }
+
+                if (w - x_min < MIN_HORIZ_PIXELS_FOR_FEATURE_LINE) {
+                    continue;
+                }
+
+                if (!reserve_elements((void **) &p_list->p_runs, &p_list->runs_capacity, p_list->num_runs + 1,
+                                      sizeof(run_t))) {
+                    return false;
+                }
+
+                run_t *p_run = &p_list->p_runs[p_list->num_runs];
+
+                p_run->x_min = x_min;
+                p_run->x_max = w;
+                p_run->y = y;
+                p_run->color_index = color_index;
+                p_run->parent = p_list->num_runs;
+
+                p_list->num_runs++;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Union each run of the current row with the 8-connected runs of the same color on the row above. Both rows are
+// sorted by color then x, so one sweep visits each overlapping pair once.
+static void join_rows(run_t *p_runs, size_t prev_start, size_t row_start, size_t row_end) {
+    size_t prev = prev_start;
+
+    for (size_t r = row_start; r < row_end; ++r) {
+        run_t *p_run = &p_runs[r];
+
+        while (prev < row_start && (p_runs[prev].color_index < p_run->color_index ||
+                                    (p_runs[prev].color_index == p_run->color_index && p_runs[prev].x_max < p_run->x_min))) {
+            ++prev;
+        }
+
+        for (size_t q = prev; q < row_start && p_runs[q].color_index == p_run->color_index &&
+                              p_runs[q].x_min <= p_run->x_max; ++q) {
+            union_runs(p_runs, q, r);
         }
     }
+}
 
-    return -1;
+static void clear_blobs(void) {
+    detections.num_blobs = 0;
 }
 
 static int find_largest_blob(uint32_t detect_color_index) {
-    int largest_pixel_size = 0;
+    uint32_t largest_pixel_size = 0;
     int largest_blob_index = -1;
 
-    for (size_t i=0; i < COLOR_DETECT_NUM_BLOBS_MAX; ++i) {
-        blob_t *p_blob = &detections.blobs[i];
+    for (size_t i=0; i < detections.num_blobs; ++i) {
+        blob_t *p_blob = &detections.p_components[i].blob;
 
         if (detect_color_index != p_blob->color_index) {
             continue;
@@ -277,26 +558,31 @@ static bool bb_overlap(blob_t* p_blob1, blob_t* p_blob2) {
     return true;
 }
 
-static void bb_combine(blob_t* p_into, blob_t* p_from) {
-    if (p_into->bb_x_min > p_from->bb_x_min) {
-        p_into->bb_x_min = p_from->bb_x_min;
+static void bb_combine(component_t* p_into, component_t* p_from) {
+    blob_t *p_into_blob = &p_into->blob;
+    blob_t *p_from_blob = &p_from->blob;
+
+    if (p_into_blob->bb_x_min > p_from_blob->bb_x_min) {
+        p_into_blob->bb_x_min = p_from_blob->bb_x_min;
     }
 
-    if (p_into->bb_x_max < p_from->bb_x_max) {
-        p_into->bb_x_max = p_from->bb_x_max;
+    if (p_into_blob->bb_x_max < p_from_blob->bb_x_max) {
+        p_into_blob->bb_x_max = p_from_blob->bb_x_max;
     }
 
-    if (p_into->bb_y_min > p_from->bb_y_min) {
-        p_into->bb_y_min = p_from->bb_y_min;
+    if (p_into_blob->bb_y_min > p_from_blob->bb_y_min) {
+        p_into_blob->bb_y_min = p_from_blob->bb_y_min;
     }
 
-    if (p_into->bb_y_max < p_from->bb_y_max) {
-        p_into->bb_y_max = p_from->bb_y_max;
+    if (p_into_blob->bb_y_max < p_from_blob->bb_y_max) {
+        p_into_blob->bb_y_max = p_from_blob->bb_y_max;
     }
 
-    p_into->num_pixels += p_from->num_pixels;
+    p_into_blob->num_pixels += p_from_blob->num_pixels;
+    p_into->sum_x += p_from->sum_x;
+    p_into->sum_y += p_from->sum_y;
 
-    memset(p_from, 0, sizeof(blob_t));
+    memset(p_from, 0, sizeof(component_t));
 }
 
 static void combine_blobs_from_largest(uint32_t detect_color_count) {
@@ -304,18 +590,18 @@ static void combine_blobs_from_largest(uint32_t detect_color_count) {
         int largest_blob_index = find_largest_blob(color_index);
 
         if (largest_blob_index >= 0) {
-            blob_t *p_largest = &detections.blobs[largest_blob_index];
+            component_t *p_largest = &detections.p_components[largest_blob_index];
 
-            for (size_t i = 0; i < COLOR_DETECT_NUM_BLOBS_MAX; ++i) {
+            for (size_t i = 0; i < detections.num_blobs; ++i) {
                 // for every blob but the largest
                 if (i != largest_blob_index) {
-                    blob_t *p_blob = &detections.blobs[i];
+                    component_t *p_component = &detections.p_components[i];
 
-                    if (p_blob->valid && p_blob->complete) {
+                    if (p_component->blob.valid && p_component->blob.complete) {
                         // check overlap
-                        if (bb_overlap(p_largest, p_blob)) {
+                        if (bb_overlap(&p_largest->blob, &p_component->blob)) {
                             // combine blobs into largest
-                            bb_combine(p_largest, p_blob);
+                            bb_combine(p_largest, p_component);
                         }
                     }
                 }
@@ -339,107 +625,130 @@ static bool blob_area_over_threshold(blob_t* p_blob, int image_width, int image_
     return (blob_bb_area > min_blob_pixels);
 }
 
-static void cull_blobs(int curr_height, int image_width, int image_height, int min_detect_conf) {
+// Drop invalidated components, and those too small or a single row high, so noise is never combined into a blob
+static void cull_blobs(int image_width, int image_height, int min_detect_conf) {
+    size_t kept = 0;
 
-    for (size_t i=0; i < COLOR_DETECT_NUM_BLOBS_MAX; ++i) {
-        blob_t* p_curr = &detections.blobs[i];
+    for (size_t i=0; i < detections.num_blobs; ++i) {
+        component_t *p_component = &detections.p_components[i];
+        blob_t *p_blob = &p_component->blob;
 
-        if (!p_curr->valid) {
+        if (!p_blob->valid || !p_blob->complete || p_blob->num_pixels < MIN_BLOB_PIXELS ||
+                !blob_area_over_threshold(p_blob, image_width, image_height, min_detect_conf)) {
             continue;
         }
 
-        float allowed_row_miss = BLOB_ALLOWED_ROW_MISS_PERCENT * ((float)image_height);
-
-        // last allowed row able to be added to the current blob
-        int last_allowed_row = p_curr->bb_y_max  + (int)allowed_row_miss > image_height ? image_height :  (int)(p_curr->bb_y_max  + (int)allowed_row_miss);
-
-        if (last_allowed_row < curr_height) {
-            if (!blob_area_over_threshold(p_curr, image_width, image_height, min_detect_conf) || p_curr->num_pixels < MIN_BLOB_PIXELS || !p_curr->complete) {
-                memset((void*)&detections.blobs[i], 0, sizeof(blob_t));
-                detections.num_blobs--;
-            }
-        }
+        detections.p_components[kept++] = *p_component;
     }
-}
 
-static void new_or_append_blob(int line_min, int line_max, int h, int image_width, int image_height, uint32_t detect_color_index) {
+    detections.num_blobs = kept;
+}
 
-    // validate feature horiz size
-    if (line_max - line_min < MIN_HORIZ_PIXELS_FOR_FEATURE_LINE) {
-        return;
-    }
+// Drop the components combined into others and give the rest their centroids
+static void finish_blobs(void) {
+    size_t kept = 0;
 
-    int index = find_containing_blob(line_min, line_max, h, image_width, image_height, detect_color_index);
+    for (size_t i=0; i < detections.num_blobs; ++i) {
+        component_t *p_component = &detections.p_components[i];
+        blob_t *p_blob = &p_component->blob;
 
-    if (index < 0) {
-        if (detections.num_blobs < COLOR_DETECT_NUM_BLOBS_MAX) {
-            // new blob
-            new_blob(line_min, line_max, h, detect_color_index);
+        if (!p_blob->valid) {
+            continue;
         }
-    } else {
-        append_blob(line_min, line_max, h, index, detect_color_index);
+
+        // sum_x holds twice the first x moment, see label_components()
+        p_blob->cent_x = p_component->sum_x / (2 * (uint64_t) p_blob->num_pixels);
+        p_blob->cent_y = p_component->sum_y / p_blob->num_pixels;
+
+        detections.p_components[kept++] = *p_component;
     }
+
+    detections.num_blobs = kept;
 }
 
-static int detect_blobs(uint8_t* p_image, int width, int height, int detect_color_count, int min_detect_conf) {
+static int compare_blob_size(const void *p_a, const void *p_b) {
+    uint32_t a = ((const component_t *) p_a)->blob.num_pixels;
+    uint32_t b = ((const component_t *) p_b)->blob.num_pixels;
 
-    uint8_t *p_curr = p_image;
-    int line_min = 0;
-    int line_max = 0;
-    bool b_in_line = false;
-    uint32_t line_color_index = 0;
+    return (a < b) - (a > b);
+}
 
-    if (p_curr == NULL || width <= 0 || height <= 0) {
-        return -1;
-    }
+// Give every run the component of its root and accumulate the component's bounding box and moments
+static bool label_components(run_t *p_runs, size_t num_runs) {
+    for (size_t r = 0; r < num_runs; ++r) {
+        run_t *p_run = &p_runs[r];
+        uint32_t root = find_root(p_runs, r);
+        component_t *p_component;
+
+        if (root == r) {
+            if (!reserve_elements((void **) &detections.p_components, &detections.components_capacity,
+                                  detections.num_blobs + 1, sizeof(component_t))) {
+                return false;
+            }
 
-    // clear out blobs
-    clear_blobs();
+            p_run->label = detections.num_blobs++;
+            p_component = &detections.p_components[p_run->label];
+            memset(p_component, 0, sizeof(component_t));
+
+            p_component->blob.valid = true;
+            p_component->blob.color_index = p_run->color_index;
+            p_component->blob.bb_x_min = p_run->x_min;
+            p_component->blob.bb_x_max = p_run->x_max - 1;
+            p_component->blob.bb_y_min = p_run->y;
+            p_component->blob.bb_y_max = p_run->y;
+        } else {
+            // the root precedes every run it owns, so it is already labeled
+            p_run->label = p_runs[root].label;
+            p_component = &detections.p_components[p_run->label];
+        }
 
-    // Iterate over input image
-    for (size_t h=0; h < height; ++h) {
-        for (size_t w=0; w < width; ++w) {
-            uint8_t curr_color_index = *p_curr++;
+        blob_t *p_blob = &p_component->blob;
+        uint32_t length = p_run->x_max - p_run->x_min;
 
-            if (curr_color_index == NO_DETECT_COLOR_TABLE_INDEX) {
-                if (b_in_line) {
-                    b_in_line = false;
-                    new_or_append_blob(line_min, line_max, h, width, height, line_color_index);
-                }
-            } else {
-                if (b_in_line) {
-                    if (curr_color_index == line_color_index) {
-                        line_max = w;
-                    } else {
-                        // not background, but not current line color, end current line and start new line
-                        new_or_append_blob(line_min, line_max, h, width, height, line_color_index);
-
-                        // start new line
-                        b_in_line = true;
-                        line_min = w;
-                        line_max = w;
-                        line_color_index = curr_color_index;
-                    }
-                } else {
-                    // start new line
-                    b_in_line = true;
-                    line_min = w;
-                    line_max = w;
-                    line_color_index = curr_color_index;
-                }
-            }
+        if (p_run->x_min < p_blob->bb_x_min) {
+            p_blob->bb_x_min = p_run->x_min;
         }
-        if (b_in_line) {
-            b_in_line = false;
-            new_or_append_blob(line_min, line_max, h, width, height, line_color_index);
+
+        if (p_run->x_max - 1 > p_blob->bb_x_max) {
+            p_blob->bb_x_max = p_run->x_max - 1;
+        }
+
+        if (p_run->y > p_blob->bb_y_max) {
+            p_blob->bb_y_max = p_run->y;
+
+            // blob has at least two rows, it is complete
+            p_blob->complete = true;
         }
-        cull_blobs(h, width, height, min_detect_conf);
+
+        p_blob->num_pixels += length;
+
+        // x sum of the run is length * (x_min + x_max - 1) / 2, kept doubled to stay exact
+        p_component->sum_x += (uint64_t) length * (p_run->x_min + p_run->x_max - 1);
+        p_component->sum_y += (uint64_t) length * p_run->y;
+    }
+
+    return true;
+}
+
+// Run-length connected-component labeling: runs are unioned with 8-connected runs of the same color on the row
+// above as rows arrive, then each union-find root becomes a component. Linear in the number of runs, with no limit
+// on components. This labels, combines and culls the blobs of num_runs collected runs.
+static int blobs_from_runs(int width, int height, int detect_color_count, int min_detect_conf) {
+    if (!label_components(detections.runs.p_runs, detections.runs.num_runs)) {
+        clear_blobs();
+        return -1;
     }
-    // No b_in_line check needed here, since the end of the image is also a row end
+
+    cull_blobs(width, height, min_detect_conf);
 
     // largest blob subsumes all overlapping blobs
     combine_blobs_from_largest(detect_color_count);
 
+    finish_blobs();
+
+    // largest first, so a truncated result string keeps the biggest blobs
+    qsort(detections.p_components, detections.num_blobs, sizeof(component_t), compare_blob_size);
+
     return 0;
 }
 
@@ -449,7 +758,7 @@ void draw_blob(uint8_t* p_pix, int width, int height, blob_t* p_blob) {
     int line_width = p_blob->bb_x_max - p_blob->bb_x_min;
     int line_height = p_blob->bb_y_max - p_blob->bb_y_min;
 
-    uint8_t draw_color = draw_color_table[p_blob->color_index % 2];
+    uint8_t draw_color = DETECT_BOX_TABLE_BASE + (p_blob->color_index % MAX_DETECT_COLORS);
 
     // horizontal
     for (size_t i=0; i < line_width; ++i) {
@@ -471,12 +780,12 @@ void draw_blobs(uint8_t *p_pix, int width, int height, bool b_largest_only, uint
             int largest_blob_index = find_largest_blob(i);
 
             if (largest_blob_index >= 0) {
-                draw_blob(p_pix, width, height, &detections.blobs[largest_blob_index]);
+                draw_blob(p_pix, width, height, &detections.p_components[largest_blob_index].blob);
             }
         }
     } else {
-        for (size_t i = 0; i < COLOR_DETECT_NUM_BLOBS_MAX; ++i) {
-            blob_t *p_blob = &detections.blobs[i];
+        for (size_t i = 0; i < detections.num_blobs; ++i) {
+            blob_t *p_blob = &detections.p_components[i].blob;
 
             if (p_blob->valid && p_blob->complete) {
                 draw_blob(p_pix, width, height, p_blob);
@@ -488,8 +797,8 @@ void draw_blobs(uint8_t *p_pix, int width, int height, bool b_largest_only, uint
 static int num_complete_blobs(void) {
     int num_blobs = 0;
 
-    for (size_t i=0; i < COLOR_DETECT_NUM_BLOBS_MAX; ++i) {
-        blob_t *p_blob = &detections.blobs[i];
+    for (size_t i=0; i < detections.num_blobs; ++i) {
+        blob_t *p_blob = &detections.p_components[i].blob;
         if (p_blob->valid && p_blob->complete) {
             num_blobs++;
         }
@@ -499,29 +808,23 @@ static int num_complete_blobs(void) {
 
 const char* get_blob_data_string() {
     static char blobs_string[BLOB_STRING_MAX_LENGTH];
+    char blobs_body[BLOB_STRING_MAX_LENGTH] = { 0 };
 
     memset(blobs_string, 0, BLOB_STRING_MAX_LENGTH);
 
     // only write complete blobs, check if there are any to write
-    int num_blobs = num_complete_blobs();
-
-    if (num_blobs == 0) {
+    if (num_complete_blobs() == 0) {
         return NULL;
     }
 
-    // keep track of remaining space in first image line
-    int blob_string_remaining = BLOB_STRING_MAX_LENGTH;
-
-    // write num blobs first
-    int num_blob_string_len = snprintf(blobs_string, blob_string_remaining, "%d", num_blobs);
-
-    blob_string_remaining -= num_blob_string_len;
+    // room for the count (10 characters) and line-feed ahead of and after the blobs
+    int blob_string_remaining = BLOB_STRING_MAX_LENGTH - 12;
 
     int blob_index = 0;
 
-    // add each complete and valid blob to string
-    for (size_t i = 0; i < COLOR_DETECT_NUM_BLOBS_MAX; ++i) {
-        blob_t *p_blob = &detections.blobs[i];
+    // add each complete and valid blob to string, largest first
+    for (size_t i = 0; i < detections.num_blobs; ++i) {
+        blob_t *p_blob = &detections.p_components[i].blob;
 
         // validate blob
         if (p_blob->valid && p_blob->complete && p_blob->num_pixels != 0) {
@@ -530,23 +833,21 @@ const char* get_blob_data_string() {
             int blob_string_len = snprintf(blob_string, 128, ",%d,%d,%d,%d,%d,%d,%d", blob_index, p_blob->bb_x_min, p_blob->bb_x_max,
                                            p_blob->bb_y_min, p_blob->bb_y_max, p_blob->color_index, p_blob->num_pixels);
 
-            // ensure room to append in p_line_buf
-            if (blob_string_remaining < blob_string_len) {
+            // ensure room to append, the count then only covers blobs written
+            if (blob_string_remaining <= blob_string_len) {
                 break;
             }
 
             // write blob string
-            strcat(blobs_string, blob_string);
+            strcat(blobs_body, blob_string);
 
             blob_string_remaining -= blob_string_len;
             blob_index++;
         }
     }
 
-    if (blob_string_remaining > 0) {
-        // append a line-feed
-        strcat(blobs_string, "\n");
-    }
+    // write num blobs first, then the blobs and a line-feed
+    snprintf(blobs_string, BLOB_STRING_MAX_LENGTH, "%d%s\n", blob_index, blobs_body);
 
     return blobs_string;
 }
@@ -559,11 +860,12 @@ bool write_single_blob_data_to_image(blob_t* p_blob, uint8_t* p_image, uint32_t
     }
 
     // Allocate a buffer equal to the size of the first row
-    char *p_line_buf = (char*)calloc(stride , 1);
+    char *p_line_buf = (char*)fa_scratch(stride);
 
     if (!p_line_buf) {
         return false;
     }
+    memset(p_line_buf, 0, stride);
 
     // validate blob
     if (!p_blob->valid || !p_blob->complete || p_blob->num_pixels == 0) {
@@ -577,7 +879,7 @@ bool write_single_blob_data_to_image(blob_t* p_blob, uint8_t* p_image, uint32_t
     memcpy(p_image, p_line_buf, stride);
 
     _cleanUp:
-    free(p_line_buf);
+    fa_release(p_line_buf);
     return retVal;
 }
 
@@ -599,59 +901,93 @@ void build_detect_params(detect_params_t *p_params,
     p_params->min_detect_conf = min_detect_conf;
     p_params->b_write_image = b_write_image;
     p_params->b_write_detection = b_write_detection;
+    p_params->b_tracking = false;
+    p_params->full_scan_interval = 0;
+    p_params->coarse_decimation = 0;
+    p_params->num_threads = 1;
+    p_params->p_tracker = NULL;
     memset(p_params->detection_image_file_name, 0, 256);
     snprintf(p_params->detection_image_file_name, 256, "%s/%s", color_detect_image_path, color_detect_image_name);
 }
 
+void set_detect_coarse(detect_params_t *p_params, int decimation) {
+    if (!p_params) {
+        return;
+    }
 
-// assumes pixels packed RGBRGBRGB...3 bytes per pixel
-const char * rgb_color_detection(uint8_t *p_pix, int width, int height, detect_params_t *p_detect_params) {
+    p_params->coarse_decimation = (decimation == 2 || decimation == 4 || decimation == 8) ? decimation : 0;
+}
 
-    if (!p_detect_params) {
-        return NULL;
+void set_detect_threads(detect_params_t *p_params, int num_threads) {
+    if (!p_params) {
+        return;
     }
 
-    size_t detect_image_size = width * height;
+    if (num_threads < 1) {
+        num_threads = 1;
+    } else if (num_threads > DETECT_MAX_THREADS) {
+        num_threads = DETECT_MAX_THREADS;
+    }
+
+    p_params->num_threads = num_threads;
+}
+
+void init_detect_tracker(detect_tracker_t *p_tracker) {
+    if (!p_tracker) {
+        return;
+    }
 
-    static uint8_t *p_detect_image_start = NULL;
+    memset(p_tracker, 0, sizeof(detect_tracker_t));
+    p_tracker->b_full_scan_pending = true;
+}
 
-    if (p_detect_image_start == NULL) {
-        p_detect_image_start = (uint8_t *) malloc(detect_image_size);
+void set_detect_tracking(detect_params_t *p_params, bool b_tracking, int full_scan_interval) {
+    if (!p_params) {
+        return;
     }
 
-    uint8_t *p_detect_image = p_detect_image_start;
+    p_params->b_tracking = b_tracking;
+    p_params->full_scan_interval = full_scan_interval;
+}
+
 
-    // iterate over input image buffer and write 0 if specified color not detected, 1 if detected
-    uint8_t *p_input = p_pix;
+// Grow the static detect image of count class masks, contents are not kept
+static detect_mask_t *detect_image_buffer(size_t count) {
+    static detect_mask_t *p_detect_image = NULL;
+    static size_t detect_image_count = 0;
 
-    for (uint32_t h = 0; h < height; ++h) {
-        for (uint32_t w = 0; w < width; ++w) {
-            // decode one pixel
-            uint8_t red = *p_input++;
-            uint8_t green = *p_input++;
-            uint8_t blue = *p_input++;
+    if (count > detect_image_count) {
+        free(p_detect_image);
+        p_detect_image = (detect_mask_t *) malloc(count * sizeof(detect_mask_t));
+        detect_image_count = count;
+    }
 
-            bool b_set = false;
+    return p_detect_image;
+}
 
-            for (uint32_t dci=0; dci < p_detect_params->color_count; ++dci) {
-                detect_color_t* p_detect_color = &p_detect_params->p_detect_colors[dci];
-                if (rgb_match(p_detect_color, red, green, blue, p_detect_params->tolerance)) {
-                    *p_detect_image++ = detect_color_table[dci];
-                    b_set = true;
-                    break;
-                }
-            }
+// Turn a detect image of class masks into color table indices in place, the lowest matching color is shown
+static uint8_t *detect_image_to_color_table(detect_mask_t *p_masks, size_t count) {
+    uint8_t *p_image = (uint8_t *) p_masks;
 
-            if (!b_set) {
-                *p_detect_image++ = NO_DETECT_COLOR_TABLE_INDEX;
-            }
-        }
+    // index i is written after mask i is read and never past it, so narrowing in place is safe
+    for (size_t i = 0; i < count; ++i) {
+        detect_mask_t mask = p_masks[i];
+
+        p_image[i] = (mask == 0) ? NO_DETECT_COLOR_TABLE_INDEX : DETECT_COLOR_TABLE_BASE + __builtin_ctz(mask);
     }
 
-    detect_blobs(p_detect_image_start, width, height, p_detect_params->color_count, p_detect_params->min_detect_conf);
+    return p_image;
+}
+
+// Draw and write out the detect image if requested, and return the detections
+static const char *publish_color_detection(detect_mask_t *p_detect_masks, int width, int height,
+                                           detect_params_t *p_detect_params) {
+    size_t detect_image_size = width * height;
+    uint8_t *p_detect_image = NULL;
 
     if (p_detect_params->b_write_image) {
-        draw_blobs(p_detect_image_start, width, height, false, p_detect_params->color_count);
+        p_detect_image = detect_image_to_color_table(p_detect_masks, detect_image_size);
+        draw_blobs(p_detect_image, width, height, false, p_detect_params->color_count);
     }
 
     if (p_detect_params->b_write_image) {
@@ -669,7 +1005,7 @@ const char * rgb_color_detection(uint8_t *p_pix, int width, int height, detect_p
 
             // write image
             bmWriteBitmapWithColorTable(p_file, width, height, colorDetectColorTable, sizeof(colorDetectColorTable),
-                                        p_detect_image_start, detect_image_size);
+                                        p_detect_image, detect_image_size);
 
             fflush(p_file);
             fclose(p_file);
@@ -679,8 +1015,923 @@ const char * rgb_color_detection(uint8_t *p_pix, int width, int height, detect_p
         }
     }
 
-    //free(p_detect_image_start);
-    //p_detect_image_start = NULL;
-
     return get_blob_data_string();
 }
+
+// Classify width pixels of packed 4:2:2, each pixel pair once on its mean luma
+static void classify_yuv422_row(const uint8_t *p_input, detect_mask_t *p_output, int width, bool b_uyvy) {
+    // Byte offsets of Y0, U, Y1 and V within a pair
+    const int y0 = b_uyvy ? 1 : 0;
+    const int u = b_uyvy ? 0 : 1;
+    const int y1 = b_uyvy ? 3 : 2;
+    const int v = b_uyvy ? 2 : 3;
+    int w;
+
+    for (w = 0; w + 1 < width; w += 2, p_input += 4) {
+        uint8_t luma = (p_input[y0] + p_input[y1] + 1) >> 1;
+        detect_mask_t value = yuv_lut[yuv_lut_index(luma, p_input[u], p_input[v])];
+
+        p_output[w] = value;
+        p_output[w + 1] = value;
+    }
+
+    // An odd last pixel has no pair
+    if (w < width) {
+        p_output[w] = yuv_lut[yuv_lut_index(p_input[y0], p_input[u], p_input[v])];
+    }
+}
+
+// Classify width pixels packed RGBRGBRGB...
+static void classify_rgb_row(const uint8_t *p_input, detect_mask_t *p_output, int width) {
+    for (int w = 0; w < width; ++w, p_input += 3) {
+        p_output[w] = color_lut[color_lut_index(p_input[0], p_input[1], p_input[2])];
+    }
+}
+
+// Classified window, x_max and y_max are exclusive
+typedef struct {
+    int x_min;
+    int x_max;
+    int y_min;
+    int y_max;
+} detect_window_t;
+
+// Tracks of callers that don't give their own
+static detect_tracker_t default_tracker = { .b_full_scan_pending = true };
+
+// Windows classified this frame, predicted from the tracks or found by a coarse pass
+static struct {
+    detect_window_t *p_windows;
+    size_t windows_capacity;
+    int num_windows;
+} windows;
+
+static inline int32_t blob_center_x(const blob_t *p_blob) {
+    return ((int32_t) p_blob->bb_x_min + (int32_t) p_blob->bb_x_max) / 2;
+}
+
+static inline int32_t blob_center_y(const blob_t *p_blob) {
+    return ((int32_t) p_blob->bb_y_min + (int32_t) p_blob->bb_y_max) / 2;
+}
+
+static inline int clamp_int(int value, int min, int max) {
+    return (value < min) ? min : ((value > max) ? max : value);
+}
+
+static int compare_window_x(const void *p_a, const void *p_b) {
+    return ((const detect_window_t *) p_a)->x_min - ((const detect_window_t *) p_b)->x_min;
+}
+
+static bool windows_overlap(const detect_window_t *p_a, const detect_window_t *p_b) {
+    // touching windows count, so no run is split between two windows
+    return p_a->x_min <= p_b->x_max && p_b->x_min <= p_a->x_max && p_a->y_min <= p_b->y_max && p_b->y_min <= p_a->y_max;
+}
+
+// Merge overlapping windows, so on any row the windows are disjoint and, sorted by x, yield runs in x order
+static void merge_windows(void) {
+    bool b_merged = true;
+
+    while (b_merged) {
+        b_merged = false;
+
+        for (int a = 0; a < windows.num_windows && !b_merged; ++a) {
+            for (int b = a + 1; b < windows.num_windows && !b_merged; ++b) {
+                detect_window_t *p_a = &windows.p_windows[a];
+                detect_window_t *p_b = &windows.p_windows[b];
+
+                if (windows_overlap(p_a, p_b)) {
+                    p_a->x_min = (p_b->x_min < p_a->x_min) ? p_b->x_min : p_a->x_min;
+                    p_a->x_max = (p_b->x_max > p_a->x_max) ? p_b->x_max : p_a->x_max;
+                    p_a->y_min = (p_b->y_min < p_a->y_min) ? p_b->y_min : p_a->y_min;
+                    p_a->y_max = (p_b->y_max > p_a->y_max) ? p_b->y_max : p_a->y_max;
+
+                    *p_b = windows.p_windows[--windows.num_windows];
+                    b_merged = true;
+                }
+            }
+        }
+    }
+
+    qsort(windows.p_windows, windows.num_windows, sizeof(detect_window_t), compare_window_x);
+}
+
+// Predict each track one frame ahead at constant velocity and expand it by its size and speed
+static bool predict_windows(const detect_tracker_t *p_tracker, int width, int height) {
+    if (!reserve_elements((void **) &windows.p_windows, &windows.windows_capacity, p_tracker->num_tracks,
+                          sizeof(detect_window_t))) {
+        return false;
+    }
+
+    windows.num_windows = 0;
+
+    for (int t = 0; t < p_tracker->num_tracks; ++t) {
+        const track_t *p_track = &p_tracker->tracks[t];
+        const blob_t *p_blob = &p_track->blob;
+        int half_width = (p_blob->bb_x_max - p_blob->bb_x_min) / 2;
+        int half_height = (p_blob->bb_y_max - p_blob->bb_y_min) / 2;
+        int margin_x = half_width / 2 + abs(p_track->velocity_x) + DETECT_TRACK_MARGIN;
+        int margin_y = half_height / 2 + abs(p_track->velocity_y) + DETECT_TRACK_MARGIN;
+        int center_x = blob_center_x(p_blob) + p_track->velocity_x;
+        int center_y = blob_center_y(p_blob) + p_track->velocity_y;
+
+        detect_window_t *p_window = &windows.p_windows[windows.num_windows++];
+
+        // even x_min keeps 4:2:2 pixel pairs together
+        p_window->x_min = clamp_int(center_x - half_width - margin_x, 0, width) & ~1;
+        p_window->x_max = clamp_int(center_x + half_width + margin_x + 1, 0, width);
+        p_window->y_min = clamp_int(center_y - half_height - margin_y, 0, height);
+        p_window->y_max = clamp_int(center_y + half_height + margin_y + 1, 0, height);
+    }
+
+    merge_windows();
+
+    return true;
+}
+
+// Match this frame's blobs to the tracks they were predicted from. Any unmatched track forces a full scan next
+// frame; after a full scan the tracks restart from its largest blobs.
+static void update_tracks(detect_tracker_t *p_tracker, bool b_full_scan) {
+    track_t tracks[DETECT_MAX_TRACKS];
+    int num_tracks = 0;
+
+    // a track continues into at most one blob and a blob continues at most one track
+    bool b_track_used[DETECT_MAX_TRACKS] = { false };
+    size_t claimed[DETECT_MAX_TRACKS];
+
+    if (b_full_scan) {
+        for (size_t i = 0; i < detections.num_blobs && num_tracks < DETECT_MAX_TRACKS; ++i) {
+            const blob_t *p_blob = &detections.p_components[i].blob;
+            const track_t *p_previous = NULL;
+
+            // keep the velocity of a track this blob continues
+            for (int t = 0; t < p_tracker->num_tracks; ++t) {
+                const blob_t *p_tracked = &p_tracker->tracks[t].blob;
+
+                if (!b_track_used[t] && p_tracked->color_index == p_blob->color_index &&
+                        bb_overlap((blob_t *) p_tracked, (blob_t *) p_blob)) {
+                    p_previous = &p_tracker->tracks[t];
+                    b_track_used[t] = true;
+                    break;
+                }
+            }
+
+            tracks[num_tracks].blob = *p_blob;
+            tracks[num_tracks].velocity_x = p_previous ? blob_center_x(p_blob) - blob_center_x(&p_previous->blob) : 0;
+            tracks[num_tracks].velocity_y = p_previous ? blob_center_y(p_blob) - blob_center_y(&p_previous->blob) : 0;
+            num_tracks++;
+        }
+
+        p_tracker->b_full_scan_pending = false;
+    } else {
+        for (int t = 0; t < p_tracker->num_tracks; ++t) {
+            const track_t *p_track = &p_tracker->tracks[t];
+            int32_t predicted_x = blob_center_x(&p_track->blob) + p_track->velocity_x;
+            int32_t predicted_y = blob_center_y(&p_track->blob) + p_track->velocity_y;
+            const blob_t *p_match = NULL;
+            size_t match_index = 0;
+            int64_t match_distance = 0;
+
+            // nearest blob of the same color to the predicted center that no earlier track continues into
+            for (size_t i = 0; i < detections.num_blobs; ++i) {
+                const blob_t *p_blob = &detections.p_components[i].blob;
+                bool b_claimed = false;
+
+                for (int c = 0; c < num_tracks; ++c) {
+                    b_claimed |= (claimed[c] == i);
+                }
+
+                if (b_claimed || p_blob->color_index != p_track->blob.color_index) {
+                    continue;
+                }
+
+                int64_t dx = blob_center_x(p_blob) - predicted_x;
+                int64_t dy = blob_center_y(p_blob) - predicted_y;
+                int64_t distance = dx * dx + dy * dy;
+
+                if (!p_match || distance < match_distance) {
+                    p_match = p_blob;
+                    match_index = i;
+                    match_distance = distance;
+                }
+            }
+
+            if (!p_match) {
+                p_tracker->b_full_scan_pending = true;
+                continue;
+            }
+
+            claimed[num_tracks] = match_index;
+            tracks[num_tracks].blob = *p_match;
+            tracks[num_tracks].velocity_x = blob_center_x(p_match) - blob_center_x(&p_track->blob);
+            tracks[num_tracks].velocity_y = blob_center_y(p_match) - blob_center_y(&p_track->blob);
+            num_tracks++;
+        }
+    }
+
+    memcpy(p_tracker->tracks, tracks, num_tracks * sizeof(track_t));
+    p_tracker->num_tracks = num_tracks;
+
+    if (num_tracks == 0) {
+        p_tracker->b_full_scan_pending = true;
+    }
+}
+
+// State of a row-streamed detection, between color_detect_begin() and color_detect_end()
+static struct {
+    detect_params_t *p_detect_params;
+    int width;
+    int height;
+
+    // first run of the previous row
+    size_t prev_start;
+
+    // tracks of the stream being detected
+    detect_tracker_t *p_tracker;
+
+    // classify only inside the windows, and whether those came from the tracks
+    bool b_windowed;
+    bool b_tracked;
+
+    // tables are checked against the parameters once per frame
+    bool b_rgb_lut_ready;
+    bool b_yuv_lut_ready;
+
+    // whole detect image when it is written out, otherwise a single reused row
+    detect_mask_t *p_detect_image;
+} detect_stream;
+
+bool color_detect_begin(int width, int height, detect_params_t *p_detect_params) {
+    detect_stream.p_detect_params = NULL;
+
+    if (!p_detect_params || width <= 0 || height <= 0) {
+        return false;
+    }
+
+    size_t image_size = p_detect_params->b_write_image ? (size_t) width * height : (size_t) width;
+
+    detect_stream.p_detect_image = detect_image_buffer(image_size);
+
+    if (!detect_stream.p_detect_image) {
+        return false;
+    }
+
+    detect_stream.b_windowed = false;
+    detect_stream.b_tracked = false;
+
+    detect_tracker_t *p_tracker = p_detect_params->p_tracker ? p_detect_params->p_tracker : &default_tracker;
+
+    detect_stream.p_tracker = p_tracker;
+
+    if (p_detect_params->b_tracking) {
+        bool b_full_scan = p_tracker->b_full_scan_pending || p_tracker->num_tracks == 0 ||
+                           (p_detect_params->full_scan_interval > 0 &&
+                            p_tracker->frames_since_full_scan + 1 >= p_detect_params->full_scan_interval);
+
+        if (b_full_scan) {
+            p_tracker->frames_since_full_scan = 0;
+        } else if (predict_windows(p_tracker, width, height)) {
+            p_tracker->frames_since_full_scan++;
+            detect_stream.b_windowed = true;
+            detect_stream.b_tracked = true;
+
+            // pixels outside the windows are never classified
+            if (p_detect_params->b_write_image) {
+                memset(detect_stream.p_detect_image, 0, image_size * sizeof(detect_mask_t));
+            }
+        }
+    } else {
+        p_tracker->num_tracks = 0;
+        p_tracker->b_full_scan_pending = true;
+    }
+
+    clear_blobs();
+
+    detect_stream.p_detect_params = p_detect_params;
+    detect_stream.width = width;
+    detect_stream.height = height;
+    detections.runs.num_runs = 0;
+    detect_stream.prev_start = 0;
+    detect_stream.b_rgb_lut_ready = false;
+    detect_stream.b_yuv_lut_ready = false;
+
+    return true;
+}
+
+// Rebuilt only when the detect colors or tolerance change
+static void prepare_lut(bool b_yuv) {
+    detect_params_t *p_detect_params = detect_stream.p_detect_params;
+
+    if (b_yuv && !detect_stream.b_yuv_lut_ready) {
+        if (!lut_params_match(&yuv_lut_params, p_detect_params)) {
+            build_yuv_lut(p_detect_params);
+        }
+        detect_stream.b_yuv_lut_ready = true;
+    } else if (!b_yuv && !detect_stream.b_rgb_lut_ready) {
+        if (!lut_params_match(&color_lut_params, p_detect_params)) {
+            build_color_lut(p_detect_params);
+        }
+        detect_stream.b_rgb_lut_ready = true;
+    }
+}
+
+// Classify the columns of row y the current frame covers and collect their runs. The classifier is
+// classify_yuv422_row() when b_yuv, classify_rgb_row() otherwise.
+static void detect_row(const uint8_t *p_row, int y, bool b_yuv, bool b_uyvy) {
+    detect_params_t *p_detect_params = detect_stream.p_detect_params;
+
+    if (!p_detect_params || y < 0 || y >= detect_stream.height) {
+        return;
+    }
+
+    prepare_lut(b_yuv);
+
+    static row_span_t *p_spans = NULL;
+    static size_t spans_capacity = 0;
+    detect_mask_t *p_classes = detect_stream.p_detect_image;
+
+    if (p_detect_params->b_write_image) {
+        p_classes += (size_t) y * detect_stream.width;
+    }
+
+    size_t row_start = detections.runs.num_runs;
+    int num_windows = detect_stream.b_windowed ? windows.num_windows : 1;
+    int num_spans = 0;
+
+    if (!reserve_elements((void **) &p_spans, &spans_capacity, num_windows, sizeof(row_span_t))) {
+        return;
+    }
+
+    for (int i = 0; i < num_windows; ++i) {
+        int x_min = 0;
+        int x_max = detect_stream.width;
+
+        if (detect_stream.b_windowed) {
+            const detect_window_t *p_window = &windows.p_windows[i];
+
+            if (y < p_window->y_min || y >= p_window->y_max) {
+                continue;
+            }
+
+            x_min = p_window->x_min;
+            x_max = p_window->x_max;
+        }
+
+        if (b_yuv) {
+            classify_yuv422_row(p_row + (size_t) x_min * 2, p_classes + x_min, x_max - x_min, b_uyvy);
+        } else {
+            classify_rgb_row(p_row + (size_t) x_min * 3, p_classes + x_min, x_max - x_min);
+        }
+
+        p_spans[num_spans].x_min = x_min;
+        p_spans[num_spans].x_max = x_max;
+        num_spans++;
+    }
+
+    if (!add_row_runs(&detections.runs, p_classes, p_spans, num_spans, p_detect_params->color_count, y)) {
+        // out of memory, drop the row's runs and carry on
+        detections.runs.num_runs = row_start;
+    }
+
+    join_rows(detections.runs.p_runs, detect_stream.prev_start, row_start, detections.runs.num_runs);
+
+    detect_stream.prev_start = row_start;
+}
+
+void color_detect_yuv422_row(const uint8_t *p_row, int y, bool b_uyvy) {
+    detect_row(p_row, y, true, b_uyvy);
+}
+
+void color_detect_rgb_row(const uint8_t *p_row, int y) {
+    detect_row(p_row, y, false, false);
+}
+
+const char * color_detect_end(void) {
+    detect_params_t *p_detect_params = detect_stream.p_detect_params;
+
+    if (!p_detect_params) {
+        return NULL;
+    }
+
+    detect_stream.p_detect_params = NULL;
+
+    uint64_t stage_start = fm_monotonic_ns();
+    blobs_from_runs(detect_stream.width, detect_stream.height, p_detect_params->color_count,
+                    p_detect_params->min_detect_conf);
+    hg_stage_end(HG_STAGE_BLOBS, stage_start);
+
+    if (p_detect_params->b_tracking) {
+        update_tracks(detect_stream.p_tracker, !detect_stream.b_tracked);
+    }
+
+    return publish_color_detection(detect_stream.p_detect_image, detect_stream.width, detect_stream.height,
+                                   p_detect_params);
+}
+
+// Classify every decimation-th pixel of every decimation-th row, and make a window of each group of 8-connected
+// hits, expanded by one sample on every side. Returns false when the hits are too scattered to be worth refining.
+static bool coarse_windows(const uint8_t *p_pix, int stride, int width, int height, bool b_yuv, bool b_uyvy,
+                           int decimation) {
+    static run_t *p_coarse_runs = NULL;
+    static size_t coarse_runs_capacity = 0;
+    static uint8_t *p_coarse_row = NULL;
+    static size_t coarse_row_capacity = 0;
+
+    int coarse_width = (width + decimation - 1) / decimation;
+    size_t num_runs = 0;
+    size_t prev_start = 0;
+
+    if (!reserve_elements((void **) &p_coarse_row, &coarse_row_capacity, coarse_width, 1)) {
+        return false;
+    }
+
+    // Byte offsets of Y0, U, Y1 and V within a pair
+    const int y0 = b_uyvy ? 1 : 0;
+    const int u = b_uyvy ? 0 : 1;
+    const int y1 = b_uyvy ? 3 : 2;
+    const int v = b_uyvy ? 2 : 3;
+
+    for (int y = 0, coarse_y = 0; y < height; y += decimation, ++coarse_y) {
+        const uint8_t *p_row = p_pix + (size_t) y * stride;
+        size_t row_start = num_runs;
+
+        for (int coarse_x = 0; coarse_x < coarse_width; ++coarse_x) {
+            int x = coarse_x * decimation;
+            detect_mask_t value;
+
+            // samples are classified exactly as the full resolution pass will classify them
+            if (b_yuv) {
+                const uint8_t *p_pair = p_row + (size_t) (x & ~1) * 2;
+                uint8_t luma = ((x | 1) < width) ? (p_pair[y0] + p_pair[y1] + 1) >> 1 : p_pair[y0];
+
+                value = yuv_lut[yuv_lut_index(luma, p_pair[u], p_pair[v])];
+            } else {
+                const uint8_t *p_rgb = p_row + (size_t) x * 3;
+
+                value = color_lut[color_lut_index(p_rgb[0], p_rgb[1], p_rgb[2])];
+            }
+
+            p_coarse_row[coarse_x] = (value != 0);
+        }
+
+        // runs of hits of any detect color
+        for (int coarse_x = 0; coarse_x < coarse_width; ) {
+            if (!p_coarse_row[coarse_x]) {
+                ++coarse_x;
+                continue;
+            }
+
+            int x_min = coarse_x;
+
+            while (coarse_x < coarse_width && p_coarse_row[coarse_x]) {
+                ++coarse_x;
+            }
+
+            if (!reserve_elements((void **) &p_coarse_runs, &coarse_runs_capacity, num_runs + 1, sizeof(run_t))) {
+                return false;
+            }
+
+            run_t *p_run = &p_coarse_runs[num_runs];
+
+            p_run->x_min = x_min;
+            p_run->x_max = coarse_x;
+            p_run->y = coarse_y;
+            p_run->color_index = 0;
+            p_run->parent = num_runs;
+
+            num_runs++;
+        }
+
+        join_rows(p_coarse_runs, prev_start, row_start, num_runs);
+        prev_start = row_start;
+    }
+
+    // one window per root, grown to cover every run it owns
+    windows.num_windows = 0;
+
+    for (size_t r = 0; r < num_runs; ++r) {
+        run_t *p_run = &p_coarse_runs[r];
+        uint32_t root = find_root(p_coarse_runs, r);
+        detect_window_t *p_window;
+
+        if (root == r) {
+            if (windows.num_windows >= COARSE_MAX_WINDOWS ||
+                    !reserve_elements((void **) &windows.p_windows, &windows.windows_capacity, windows.num_windows + 1,
+                                      sizeof(detect_window_t))) {
+                return false;
+            }
+
+            p_run->label = windows.num_windows++;
+            p_window = &windows.p_windows[p_run->label];
+            p_window->x_min = p_run->x_min;
+            p_window->x_max = p_run->x_max;
+            p_window->y_min = p_run->y;
+            p_window->y_max = p_run->y + 1;
+        } else {
+            p_run->label = p_coarse_runs[root].label;
+            p_window = &windows.p_windows[p_run->label];
+        }
+
+        p_window->x_min = (p_run->x_min < p_window->x_min) ? p_run->x_min : p_window->x_min;
+        p_window->x_max = (p_run->x_max > p_window->x_max) ? p_run->x_max : p_window->x_max;
+        p_window->y_max = (p_run->y + 1 > p_window->y_max) ? p_run->y + 1 : p_window->y_max;
+    }
+
+    // sample units to pixels, one sample of margin on each side
+    for (int i = 0; i < windows.num_windows; ++i) {
+        detect_window_t *p_window = &windows.p_windows[i];
+
+        p_window->x_min = clamp_int((p_window->x_min - 1) * decimation, 0, width) & ~1;
+        p_window->x_max = clamp_int((p_window->x_max + 1) * decimation, 0, width);
+        p_window->y_min = clamp_int((p_window->y_min - 1) * decimation, 0, height);
+        p_window->y_max = clamp_int((p_window->y_max + 1) * decimation, 0, height);
+    }
+
+    merge_windows();
+
+    return true;
+}
+
+// Grow every window a component reaches the inside edge of, by at least its own size on that side. Returns true
+// if any window grew, so the fine pass must run again.
+static bool grow_touched_windows(int width, int height, int decimation) {
+    bool b_grown = false;
+
+    for (size_t i = 0; i < detections.num_blobs; ++i) {
+        const blob_t *p_blob = &detections.p_components[i].blob;
+
+        for (int w = 0; w < windows.num_windows; ++w) {
+            detect_window_t *p_window = &windows.p_windows[w];
+            int grow_x = (p_window->x_max - p_window->x_min > decimation) ? p_window->x_max - p_window->x_min : decimation;
+            int grow_y = (p_window->y_max - p_window->y_min > decimation) ? p_window->y_max - p_window->y_min : decimation;
+
+            if ((int) p_blob->bb_x_min < p_window->x_min || (int) p_blob->bb_x_max >= p_window->x_max ||
+                    (int) p_blob->bb_y_min < p_window->y_min || (int) p_blob->bb_y_max >= p_window->y_max) {
+                continue;
+            }
+
+            if ((int) p_blob->bb_x_min == p_window->x_min && p_window->x_min > 0) {
+                p_window->x_min = clamp_int(p_window->x_min - grow_x, 0, width) & ~1;
+                b_grown = true;
+            }
+
+            if ((int) p_blob->bb_x_max == p_window->x_max - 1 && p_window->x_max < width) {
+                p_window->x_max = clamp_int(p_window->x_max + grow_x, 0, width);
+                b_grown = true;
+            }
+
+            if ((int) p_blob->bb_y_min == p_window->y_min && p_window->y_min > 0) {
+                p_window->y_min = clamp_int(p_window->y_min - grow_y, 0, height);
+                b_grown = true;
+            }
+
+            if ((int) p_blob->bb_y_max == p_window->y_max - 1 && p_window->y_max < height) {
+                p_window->y_max = clamp_int(p_window->y_max + grow_y, 0, height);
+                b_grown = true;
+            }
+
+            break;
+        }
+    }
+
+    if (b_grown) {
+        merge_windows();
+    }
+
+    return b_grown;
+}
+
+// A horizontal band of the frame, classified and labeled on its own. Its runs are numbered from 0 and moved into
+// the frame's run list once every strip is done.
+typedef struct {
+    const uint8_t *p_pix;
+    int stride;
+    int width;
+    int y_min;
+    int y_max;
+    int color_count;
+    bool b_yuv;
+    bool b_uyvy;
+
+    // rows of the detect image when it is written out, otherwise NULL and the strip classifies into p_row
+    detect_mask_t *p_classes;
+    detect_mask_t *p_row;
+    size_t row_capacity;
+
+    run_list_t runs;
+
+    // runs of the first row are [0, first_row_end), runs of the last row [last_row_start, runs.num_runs)
+    size_t first_row_end;
+    size_t last_row_start;
+} detect_strip_t;
+
+// Workers kept for the life of the process, strip 0 is always done by the caller
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    pthread_t threads[DETECT_MAX_THREADS - 1];
+    int num_workers;
+
+    // bumped for every frame handed out, workers with an index below num_strips take a strip
+    uint32_t generation;
+    int num_strips;
+    int pending;
+
+    detect_strip_t strips[DETECT_MAX_THREADS];
+} strip_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .start_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void detect_strip(detect_strip_t *p_strip) {
+    row_span_t span = { 0, p_strip->width };
+    size_t prev_start = 0;
+
+    p_strip->runs.num_runs = 0;
+    p_strip->first_row_end = 0;
+
+    if (!p_strip->p_classes &&
+            !reserve_elements((void **) &p_strip->p_row, &p_strip->row_capacity, p_strip->width, sizeof(detect_mask_t))) {
+        // out of memory, the strip finds nothing
+        p_strip->last_row_start = 0;
+        return;
+    }
+
+    for (int y = p_strip->y_min; y < p_strip->y_max; ++y) {
+        const uint8_t *p_input = p_strip->p_pix + (size_t) y * p_strip->stride;
+        detect_mask_t *p_classes = p_strip->p_classes ?
+                                   p_strip->p_classes + (size_t) (y - p_strip->y_min) * p_strip->width : p_strip->p_row;
+        size_t row_start = p_strip->runs.num_runs;
+
+        if (p_strip->b_yuv) {
+            classify_yuv422_row(p_input, p_classes, p_strip->width, p_strip->b_uyvy);
+        } else {
+            classify_rgb_row(p_input, p_classes, p_strip->width);
+        }
+
+        if (!add_row_runs(&p_strip->runs, p_classes, &span, 1, p_strip->color_count, y)) {
+            p_strip->runs.num_runs = row_start;
+        }
+
+        join_rows(p_strip->runs.p_runs, prev_start, row_start, p_strip->runs.num_runs);
+
+        if (y == p_strip->y_min) {
+            p_strip->first_row_end = p_strip->runs.num_runs;
+        }
+
+        prev_start = row_start;
+    }
+
+    p_strip->last_row_start = prev_start;
+}
+
+static void *detect_strip_worker(void *p_arg) {
+    int index = (int) (intptr_t) p_arg;
+    uint32_t generation = 0;
+
+    pthread_mutex_lock(&strip_pool.mutex);
+
+    for (;;) {
+        while (strip_pool.generation == generation) {
+            pthread_cond_wait(&strip_pool.start_cond, &strip_pool.mutex);
+        }
+        generation = strip_pool.generation;
+
+        if (index >= strip_pool.num_strips) {
+            continue;
+        }
+
+        pthread_mutex_unlock(&strip_pool.mutex);
+        detect_strip(&strip_pool.strips[index]);
+        pthread_mutex_lock(&strip_pool.mutex);
+
+        if (--strip_pool.pending == 0) {
+            pthread_cond_signal(&strip_pool.done_cond);
+        }
+    }
+
+    return NULL;
+}
+
+// Start workers until there are count of them, returns how many there are
+static int start_strip_workers(int count) {
+    sigset_t all_signals;
+    sigset_t old_signals;
+
+    if (count > DETECT_MAX_THREADS - 1) {
+        count = DETECT_MAX_THREADS - 1;
+    }
+
+    // Signals are for the capture loop, workers start with them blocked
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+
+    pthread_mutex_lock(&strip_pool.mutex);
+
+    while (strip_pool.num_workers < count) {
+        int index = strip_pool.num_workers + 1;
+
+        if (pthread_create(&strip_pool.threads[index - 1], NULL, detect_strip_worker, (void *) (intptr_t) index) != 0) {
+            fprintf(stderr, "%s: couldn't start detect worker %d\n", __func__, index);
+            break;
+        }
+
+        strip_pool.num_workers++;
+    }
+
+    count = strip_pool.num_workers;
+
+    pthread_mutex_unlock(&strip_pool.mutex);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+    return count;
+}
+
+// Move the strips' runs into the frame's run list in row order, then join the rows on either side of each seam.
+// The runs end up in the same order the sequential labeler makes them in, so the components are the same.
+static bool merge_strips(int num_strips) {
+    run_list_t *p_runs = &detections.runs;
+    size_t total = 0;
+
+    for (int i = 0; i < num_strips; ++i) {
+        total += strip_pool.strips[i].runs.num_runs;
+    }
+
+    if (!reserve_elements((void **) &p_runs->p_runs, &p_runs->runs_capacity, total, sizeof(run_t))) {
+        return false;
+    }
+
+    size_t prev_last_row_start = 0;
+
+    p_runs->num_runs = 0;
+
+    for (int i = 0; i < num_strips; ++i) {
+        const detect_strip_t *p_strip = &strip_pool.strips[i];
+        size_t base = p_runs->num_runs;
+        run_t *p_dest = &p_runs->p_runs[base];
+
+        memcpy(p_dest, p_strip->runs.p_runs, p_strip->runs.num_runs * sizeof(run_t));
+
+        for (size_t r = 0; r < p_strip->runs.num_runs; ++r) {
+            p_dest[r].parent += base;
+        }
+
+        p_runs->num_runs += p_strip->runs.num_runs;
+
+        if (i > 0) {
+            join_rows(p_runs->p_runs, prev_last_row_start, base, base + p_strip->first_row_end);
+        }
+
+        prev_last_row_start = base + p_strip->last_row_start;
+    }
+
+    return true;
+}
+
+// Classify and label the whole frame in horizontal strips, one per detect thread. Returns false if the frame is
+// not worth splitting or no worker could be started, nothing has been classified then.
+static bool detect_frame_strips(const uint8_t *p_pix, int stride, int width, int height, bool b_yuv, bool b_uyvy) {
+    detect_params_t *p_detect_params = detect_stream.p_detect_params;
+    int num_strips = p_detect_params->num_threads;
+
+    if (num_strips > height / DETECT_MIN_STRIP_ROWS) {
+        num_strips = height / DETECT_MIN_STRIP_ROWS;
+    }
+
+    if (num_strips < 2) {
+        return false;
+    }
+
+    num_strips = start_strip_workers(num_strips - 1) + 1;
+
+    if (num_strips < 2) {
+        return false;
+    }
+
+    prepare_lut(b_yuv);
+
+    for (int i = 0; i < num_strips; ++i) {
+        detect_strip_t *p_strip = &strip_pool.strips[i];
+
+        p_strip->p_pix = p_pix;
+        p_strip->stride = stride;
+        p_strip->width = width;
+        p_strip->y_min = (int) ((int64_t) height * i / num_strips);
+        p_strip->y_max = (int) ((int64_t) height * (i + 1) / num_strips);
+        p_strip->color_count = p_detect_params->color_count;
+        p_strip->b_yuv = b_yuv;
+        p_strip->b_uyvy = b_uyvy;
+        p_strip->p_classes = p_detect_params->b_write_image ?
+                             detect_stream.p_detect_image + (size_t) p_strip->y_min * width : NULL;
+    }
+
+    pthread_mutex_lock(&strip_pool.mutex);
+    strip_pool.num_strips = num_strips;
+    strip_pool.pending = num_strips - 1;
+    strip_pool.generation++;
+    pthread_cond_broadcast(&strip_pool.start_cond);
+    pthread_mutex_unlock(&strip_pool.mutex);
+
+    detect_strip(&strip_pool.strips[0]);
+
+    pthread_mutex_lock(&strip_pool.mutex);
+    while (strip_pool.pending > 0) {
+        pthread_cond_wait(&strip_pool.done_cond, &strip_pool.mutex);
+    }
+    pthread_mutex_unlock(&strip_pool.mutex);
+
+    if (!merge_strips(num_strips)) {
+        // out of memory, the frame finds nothing
+        detections.runs.num_runs = 0;
+    }
+
+    return true;
+}
+
+// Classify a whole frame, coarse to fine when enabled and the frame is not already limited to tracked windows
+static void detect_frame(const uint8_t *p_pix, int stride, int width, int height, bool b_yuv, bool b_uyvy) {
+    detect_params_t *p_detect_params = detect_stream.p_detect_params;
+    int decimation = p_detect_params->coarse_decimation;
+
+    if (decimation > 1 && !detect_stream.b_windowed) {
+        prepare_lut(b_yuv);
+
+        if (coarse_windows(p_pix, stride, width, height, b_yuv, b_uyvy, decimation)) {
+            detect_stream.b_windowed = true;
+
+            // A component cut by a window edge is refined again with that window grown, so extents are exact
+            for (int pass = 0; pass < COARSE_MAX_PASSES; ++pass) {
+                if (p_detect_params->b_write_image) {
+                    memset(detect_stream.p_detect_image, 0, (size_t) width * height * sizeof(detect_mask_t));
+                }
+
+                clear_blobs();
+                detections.runs.num_runs = 0;
+                detect_stream.prev_start = 0;
+
+                for (int h = 0; h < height; ++h) {
+                    detect_row(p_pix + (size_t) h * stride, h, b_yuv, b_uyvy);
+                }
+
+                if (!label_components(detections.runs.p_runs, detections.runs.num_runs) ||
+                        !grow_touched_windows(width, height, decimation)) {
+                    break;
+                }
+            }
+
+            // color_detect_end() labels the runs again
+            clear_blobs();
+            return;
+        }
+    }
+
+    if (!detect_stream.b_windowed && detect_frame_strips(p_pix, stride, width, height, b_yuv, b_uyvy)) {
+        return;
+    }
+
+    for (int h = 0; h < height; ++h) {
+        detect_row(p_pix + (size_t) h * stride, h, b_yuv, b_uyvy);
+    }
+}
+
+// assumes pixels packed RGBRGBRGB...3 bytes per pixel
+const char * rgb_color_detection(uint8_t *p_pix, int width, int height, detect_params_t *p_detect_params) {
+
+    if (!color_detect_begin(width, height, p_detect_params)) {
+        return NULL;
+    }
+
+    uint64_t stage_start = fm_monotonic_ns();
+    detect_frame(p_pix, width * 3, width, height, false, false);
+    hg_stage_end(HG_STAGE_CLASSIFY, stage_start);
+
+    return color_detect_end();
+}
+
+// 4:2:2 packed, YUYV or UYVY. Pixel pairs share chroma, so each pair is classified once on its mean luma.
+const char * yuv422_color_detection(uint8_t *p_pix, int stride, int width, int height, bool b_uyvy,
+                                    detect_params_t *p_detect_params) {
+
+    if (!color_detect_begin(width, height, p_detect_params)) {
+        return NULL;
+    }
+
+    uint64_t stage_start = fm_monotonic_ns();
+    detect_frame(p_pix, stride, width, height, true, b_uyvy);
+    hg_stage_end(HG_STAGE_CLASSIFY, stage_start);
+
+    return color_detect_end();
+}
+
+blob_t* get_blob(size_t index) {
+    if (index >= detections.num_blobs) {
+        return NULL;
+    }
+
+    return &detections.p_components[index].blob;
+}
+
+size_t get_num_blobs(void) {
+    return detections.num_blobs;
+}
@@ -4,11 +4,30 @@
 #ifndef _COLOR_DETECT_H
 #define _COLOR_DETECT_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
-// Maximum number of blobs detected
-#define COLOR_DETECT_NUM_BLOBS_MAX      (10)
+// Most detect colors, 8, 16 or 32. Each pixel is classified into a mask with a bit per color.
+#ifndef MAX_DETECT_COLORS
+#define MAX_DETECT_COLORS               (8)
+#endif
+
+#if MAX_DETECT_COLORS <= 8
+typedef uint8_t detect_mask_t;
+#elif MAX_DETECT_COLORS <= 16
+typedef uint16_t detect_mask_t;
+#elif MAX_DETECT_COLORS <= 32
+typedef uint32_t detect_mask_t;
+#else
+#error "MAX_DETECT_COLORS is at most 32"
+#endif
+
+// Most threads a frame is split across by set_detect_threads()
+#define DETECT_MAX_THREADS              (8)
+
+// Longest string returned by get_blob_data_string()
+#define BLOB_STRING_MAX_LENGTH          (1024)
 
 // Color detection structure
 typedef struct {
@@ -35,7 +54,7 @@ typedef struct {
     uint32_t bb_y_min;
     uint32_t bb_y_max;
 
-    // centroid
+    // centroid, the mean pixel position
     uint32_t cent_x;
     uint32_t cent_y;
 
@@ -49,6 +68,25 @@ typedef struct {
     bool complete;
 } blob_t;
 
+// Most blobs a tracker follows
+#define DETECT_MAX_TRACKS               (8)
+
+// A blob followed across frames, with its bounding box center velocity in pixels per frame
+typedef struct {
+    blob_t blob;
+    int32_t velocity_x;
+    int32_t velocity_y;
+} track_t;
+
+// Tracks of one stream of frames from its last detection, set up with init_detect_tracker()
+typedef struct {
+    track_t tracks[DETECT_MAX_TRACKS];
+    int num_tracks;
+    int frames_since_full_scan;
+
+    // a track was lost, or the last frame was not tracked: scan the whole next frame
+    bool b_full_scan_pending;
+} detect_tracker_t;
 
 typedef struct {
     int color_count;
@@ -58,6 +96,19 @@ typedef struct {
     bool b_write_image;
     char detection_image_file_name[256];
     bool b_write_detection;
+
+    // classify only around tracked blobs, full scan every full_scan_interval frames (0: only when a track is lost)
+    bool b_tracking;
+    int full_scan_interval;
+
+    // tracks of the stream detected with these parameters, NULL shares one tracker between every such caller
+    detect_tracker_t *p_tracker;
+
+    // 2, 4 or 8 to find candidates on a decimated grid first, 0 to classify every pixel
+    int coarse_decimation;
+
+    // threads a full frame is classified and labeled on, in horizontal strips
+    int num_threads;
 } detect_params_t;
 
 void colorDetectInit(void);
@@ -80,10 +131,46 @@ void build_detect_params(detect_params_t *p_params,
                          const char* color_detect_image_path,
                          const char* color_detect_image_name);
 
+// Enable temporal tracking: after a detection, following frames are only classified in windows predicted at
+// constant velocity around each blob. A full frame is scanned when a track is lost and every full_scan_interval
+// frames, so new targets are found. Tracks are kept in p_params->p_tracker, so each stream of frames needs its own
+// parameters and tracker.
+void set_detect_tracking(detect_params_t *p_params, bool b_tracking, int full_scan_interval);
+
+// Start a tracker with no tracks, the next frame detected with it is scanned whole
+void init_detect_tracker(detect_tracker_t *p_tracker);
+
+// Enable coarse-to-fine detection for rgb_color_detection() and yuv422_color_detection(): every decimation-th pixel
+// of every decimation-th row is classified first, then full resolution only around the hits, growing the windows
+// until no blob is cut off. Results match full resolution only for blobs with a solid decimation x decimation core;
+// a blob without one, such as a line narrower than decimation, can fall between samples and be missed whatever its
+// pixel count. Decimation is 2, 4 or 8, anything else disables it.
+void set_detect_coarse(detect_params_t *p_params, int decimation);
+
+// Split full-frame scans of rgb_color_detection() and yuv422_color_detection() into num_threads horizontal strips,
+// classified and labeled in parallel and joined at the seams. Results are the same as on one thread. Windowed scans
+// and row-streamed detection stay on the calling thread. num_threads is clamped to 1..DETECT_MAX_THREADS.
+void set_detect_threads(detect_params_t *p_params, int num_threads);
+
 // assumes pixels packed RGBRGBRGB...3 bytes per pixel
 const char * rgb_color_detection(uint8_t *p_pix, int width, int height, detect_params_t *p_detect_params);
 
-// Retrieve blob by index from detection results
+// Classifies packed 4:2:2 YUYV (or UYVY) directly, without converting to RGB
+const char * yuv422_color_detection(uint8_t *p_pix, int stride, int width, int height, bool b_uyvy,
+                                    detect_params_t *p_detect_params);
+
+// Row-streamed detection of packed 4:2:2 or RGB, for callers that already walk the frame row by row. Rows are passed in
+// order between color_detect_begin() and color_detect_end(), which returns the detections like
+// yuv422_color_detection(). Only one detection can be in progress at a time.
+bool color_detect_begin(int width, int height, detect_params_t *p_detect_params);
+void color_detect_yuv422_row(const uint8_t *p_row, int y, bool b_uyvy);
+void color_detect_rgb_row(const uint8_t *p_row, int y);
+const char * color_detect_end(void);
+
+// Detections of the last run as a comma separated string, NULL if there were none
+const char* get_blob_data_string();
+
+// Retrieve blob by index from detection results, largest first
 blob_t* get_blob(size_t index);
 
 // Get number of blobs from detection results
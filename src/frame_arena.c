@@ -0,0 +1,377 @@
+//
+// Per-worker scratch arena, reset after every frame
+//
+// Scratch memory for one frame comes from a single bump allocator, so a frame
+// only touches memory the previous frame already warmed up. A request that
+// doesn't fit is served from the heap for now and the arena is regrown to the
+// frame's total on reset, so after the first few frames nothing reaches the heap.
+//
+// libjpeg builds and tears down its pools for every encode. fa_jpeg_attach()
+// puts a memory manager in front of it that allocates from the arena, and the
+// whole lot is reclaimed by the arena reset.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <jerror.h>
+
+#include "frame_arena.h"
+
+/* Regrown arenas get some room for frame to frame variation */
+#define FA_GROW_SLACK                               (64 * 1024)
+
+static __thread fa_arena_t *p_current_arena = NULL;
+
+static inline size_t fa_align(size_t size) {
+    return (size + FA_ALIGN - 1) & ~((size_t) FA_ALIGN - 1);
+}
+
+bool fa_init(fa_arena_t *p_arena, size_t size) {
+    if (!p_arena) {
+        return false;
+    }
+
+    memset(p_arena, 0, sizeof(fa_arena_t));
+
+    size = fa_align(size);
+    if (size == 0) {
+        return true;
+    }
+
+    if (posix_memalign((void **) &p_arena->p_base, FA_ALIGN, size) != 0) {
+        p_arena->p_base = NULL;
+        return false;
+    }
+
+    p_arena->size = size;
+
+    return true;
+}
+
+static void fa_free_overflow(fa_arena_t *p_arena) {
+    fa_overflow_t *p_block = p_arena->p_overflow;
+
+    while (p_block) {
+        fa_overflow_t *p_next = p_block->p_next;
+
+        free(p_block);
+        p_block = p_next;
+    }
+
+    p_arena->p_overflow = NULL;
+    p_arena->overflow_bytes = 0;
+}
+
+void fa_destroy(fa_arena_t *p_arena) {
+    if (!p_arena) {
+        return;
+    }
+
+    if (p_current_arena == p_arena) {
+        p_current_arena = NULL;
+    }
+
+    fa_free_overflow(p_arena);
+    free(p_arena->p_base);
+    memset(p_arena, 0, sizeof(fa_arena_t));
+}
+
+void *fa_alloc(fa_arena_t *p_arena, size_t size) {
+    fa_overflow_t *p_block;
+
+    size = fa_align(size ? size : 1);
+
+    if (p_arena->p_base && size <= p_arena->size - p_arena->used) {
+        void *p_ptr = p_arena->p_base + p_arena->used;
+
+        p_arena->used += size;
+        return p_ptr;
+    }
+
+    /* Header, then the data aligned after it */
+    p_block = malloc(fa_align(sizeof(fa_overflow_t)) + size + FA_ALIGN);
+    p_block->p_data = (void *) fa_align((uintptr_t) p_block + sizeof(fa_overflow_t));
+    p_block->size = size;
+    p_block->p_next = p_arena->p_overflow;
+
+    p_arena->p_overflow = p_block;
+    p_arena->overflow_bytes += size;
+
+    return p_block->p_data;
+}
+
+void fa_reset(fa_arena_t *p_arena) {
+    size_t frame_bytes;
+
+    if (!p_arena) {
+        return;
+    }
+
+    frame_bytes = p_arena->used + p_arena->overflow_bytes;
+    if (frame_bytes > p_arena->high_water) {
+        p_arena->high_water = frame_bytes;
+    }
+
+    if (p_arena->p_overflow) {
+        size_t size = fa_align(frame_bytes + FA_GROW_SLACK);
+        uint8_t *p_base = NULL;
+
+        fa_free_overflow(p_arena);
+
+        /* Keep the old arena if a bigger one can't be had, the overflow path still works */
+        if (posix_memalign((void **) &p_base, FA_ALIGN, size) == 0) {
+            free(p_arena->p_base);
+            p_arena->p_base = p_base;
+            p_arena->size = size;
+            p_arena->grows++;
+        }
+    }
+
+    p_arena->used = 0;
+}
+
+void fa_set_current(fa_arena_t *p_arena) {
+    p_current_arena = p_arena;
+}
+
+fa_arena_t *fa_current(void) {
+    return p_current_arena;
+}
+
+void *fa_scratch(size_t size) {
+    if (p_current_arena) {
+        return fa_alloc(p_current_arena, size);
+    }
+
+    return malloc(size);
+}
+
+static bool fa_contains(const fa_arena_t *p_arena, const void *p_ptr) {
+    if (!p_arena) {
+        return false;
+    }
+
+    if (p_arena->p_base && (const uint8_t *) p_ptr >= p_arena->p_base &&
+            (const uint8_t *) p_ptr < p_arena->p_base + p_arena->size) {
+        return true;
+    }
+
+    for (const fa_overflow_t *p_block = p_arena->p_overflow; p_block; p_block = p_block->p_next) {
+        if (p_block->p_data == p_ptr) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void fa_release(void *p_ptr) {
+    if (p_ptr && !fa_contains(p_current_arena, p_ptr)) {
+        free(p_ptr);
+    }
+}
+
+//
+// libjpeg memory manager
+//
+
+struct jvirt_sarray_control {
+    JSAMPARRAY mem_buffer;
+    JDIMENSION rows_in_array;
+    JDIMENSION samplesperrow;
+    boolean pre_zero;
+    struct jvirt_sarray_control *next;
+};
+
+struct jvirt_barray_control {
+    JBLOCKARRAY mem_buffer;
+    JDIMENSION rows_in_array;
+    JDIMENSION blocksperrow;
+    boolean pre_zero;
+    struct jvirt_barray_control *next;
+};
+
+typedef struct {
+    struct jpeg_memory_mgr pub;
+
+    /* The manager libjpeg created, it still owns the object's first allocations */
+    struct jpeg_memory_mgr *p_original;
+    fa_arena_t *p_arena;
+
+    /* Virtual arrays requested per pool and not realized yet */
+    struct jvirt_sarray_control *p_virt_sarrays[JPOOL_NUMPOOLS];
+    struct jvirt_barray_control *p_virt_barrays[JPOOL_NUMPOOLS];
+} fa_jpeg_mgr_t;
+
+static void *fa_jpeg_alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
+    fa_jpeg_mgr_t *p_mgr = (fa_jpeg_mgr_t *) cinfo->mem;
+
+    if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
+        ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+    }
+
+    return fa_alloc(p_mgr->p_arena, sizeofobject);
+}
+
+static JSAMPARRAY fa_jpeg_alloc_sarray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow, JDIMENSION numrows) {
+    size_t row_bytes = fa_align((size_t) samplesperrow * sizeof(JSAMPLE));
+    JSAMPARRAY rows = fa_jpeg_alloc(cinfo, pool_id, (size_t) numrows * sizeof(JSAMPROW));
+    JSAMPLE *p_samples = fa_jpeg_alloc(cinfo, pool_id, (size_t) numrows * row_bytes);
+
+    for (JDIMENSION r=0; r < numrows; ++r) {
+        rows[r] = (JSAMPROW) ((uint8_t *) p_samples + r * row_bytes);
+    }
+
+    return rows;
+}
+
+static JBLOCKARRAY fa_jpeg_alloc_barray(j_common_ptr cinfo, int pool_id, JDIMENSION blocksperrow, JDIMENSION numrows) {
+    size_t row_bytes = (size_t) blocksperrow * sizeof(JBLOCK);
+    JBLOCKARRAY rows = fa_jpeg_alloc(cinfo, pool_id, (size_t) numrows * sizeof(JBLOCKROW));
+    JBLOCK *p_blocks = fa_jpeg_alloc(cinfo, pool_id, (size_t) numrows * row_bytes);
+
+    for (JDIMENSION r=0; r < numrows; ++r) {
+        rows[r] = (JBLOCKROW) ((uint8_t *) p_blocks + r * row_bytes);
+    }
+
+    return rows;
+}
+
+static jvirt_sarray_ptr fa_jpeg_request_virt_sarray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                                                    JDIMENSION samplesperrow, JDIMENSION numrows, JDIMENSION maxaccess) {
+    fa_jpeg_mgr_t *p_mgr = (fa_jpeg_mgr_t *) cinfo->mem;
+    jvirt_sarray_ptr p_array = fa_jpeg_alloc(cinfo, pool_id, sizeof(struct jvirt_sarray_control));
+
+    (void) maxaccess;
+
+    p_array->mem_buffer = NULL;
+    p_array->rows_in_array = numrows;
+    p_array->samplesperrow = samplesperrow;
+    p_array->pre_zero = pre_zero;
+    p_array->next = p_mgr->p_virt_sarrays[pool_id];
+    p_mgr->p_virt_sarrays[pool_id] = p_array;
+
+    return p_array;
+}
+
+static jvirt_barray_ptr fa_jpeg_request_virt_barray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                                                    JDIMENSION blocksperrow, JDIMENSION numrows, JDIMENSION maxaccess) {
+    fa_jpeg_mgr_t *p_mgr = (fa_jpeg_mgr_t *) cinfo->mem;
+    jvirt_barray_ptr p_array = fa_jpeg_alloc(cinfo, pool_id, sizeof(struct jvirt_barray_control));
+
+    (void) maxaccess;
+
+    p_array->mem_buffer = NULL;
+    p_array->rows_in_array = numrows;
+    p_array->blocksperrow = blocksperrow;
+    p_array->pre_zero = pre_zero;
+    p_array->next = p_mgr->p_virt_barrays[pool_id];
+    p_mgr->p_virt_barrays[pool_id] = p_array;
+
+    return p_array;
+}
+
+/* Every virtual array is held whole in memory, there is no backing store */
+static void fa_jpeg_realize_virt_arrays(j_common_ptr cinfo) {
+    fa_jpeg_mgr_t *p_mgr = (fa_jpeg_mgr_t *) cinfo->mem;
+
+    for (int pool=0; pool < JPOOL_NUMPOOLS; ++pool) {
+        for (jvirt_sarray_ptr p_array = p_mgr->p_virt_sarrays[pool]; p_array; p_array = p_array->next) {
+            if (p_array->mem_buffer) {
+                continue;
+            }
+
+            p_array->mem_buffer = fa_jpeg_alloc_sarray(cinfo, pool, p_array->samplesperrow, p_array->rows_in_array);
+            if (p_array->pre_zero) {
+                for (JDIMENSION r=0; r < p_array->rows_in_array; ++r) {
+                    memset(p_array->mem_buffer[r], 0, (size_t) p_array->samplesperrow * sizeof(JSAMPLE));
+                }
+            }
+        }
+
+        for (jvirt_barray_ptr p_array = p_mgr->p_virt_barrays[pool]; p_array; p_array = p_array->next) {
+            if (p_array->mem_buffer) {
+                continue;
+            }
+
+            p_array->mem_buffer = fa_jpeg_alloc_barray(cinfo, pool, p_array->blocksperrow, p_array->rows_in_array);
+            if (p_array->pre_zero) {
+                for (JDIMENSION r=0; r < p_array->rows_in_array; ++r) {
+                    memset(p_array->mem_buffer[r], 0, (size_t) p_array->blocksperrow * sizeof(JBLOCK));
+                }
+            }
+        }
+    }
+}
+
+static JSAMPARRAY fa_jpeg_access_virt_sarray(j_common_ptr cinfo, jvirt_sarray_ptr ptr, JDIMENSION start_row,
+                                             JDIMENSION num_rows, boolean writable) {
+    (void) writable;
+
+    if (!ptr->mem_buffer || start_row + num_rows > ptr->rows_in_array) {
+        ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+    }
+
+    return ptr->mem_buffer + start_row;
+}
+
+static JBLOCKARRAY fa_jpeg_access_virt_barray(j_common_ptr cinfo, jvirt_barray_ptr ptr, JDIMENSION start_row,
+                                              JDIMENSION num_rows, boolean writable) {
+    (void) writable;
+
+    if (!ptr->mem_buffer || start_row + num_rows > ptr->rows_in_array) {
+        ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+    }
+
+    return ptr->mem_buffer + start_row;
+}
+
+/* Memory comes back when the arena is reset, only forget the pool's virtual arrays */
+static void fa_jpeg_free_pool(j_common_ptr cinfo, int pool_id) {
+    fa_jpeg_mgr_t *p_mgr = (fa_jpeg_mgr_t *) cinfo->mem;
+
+    if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
+        ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+    }
+
+    p_mgr->p_virt_sarrays[pool_id] = NULL;
+    p_mgr->p_virt_barrays[pool_id] = NULL;
+}
+
+static void fa_jpeg_self_destruct(j_common_ptr cinfo) {
+    fa_jpeg_mgr_t *p_mgr = (fa_jpeg_mgr_t *) cinfo->mem;
+
+    /* The original manager frees what libjpeg allocated before we took over */
+    cinfo->mem = p_mgr->p_original;
+    (*cinfo->mem->self_destruct)(cinfo);
+}
+
+void fa_jpeg_attach(j_common_ptr cinfo) {
+    fa_arena_t *p_arena = p_current_arena;
+    fa_jpeg_mgr_t *p_mgr;
+
+    if (!cinfo || !cinfo->mem || !p_arena) {
+        return;
+    }
+
+    p_mgr = fa_alloc(p_arena, sizeof(fa_jpeg_mgr_t));
+    memset(p_mgr, 0, sizeof(fa_jpeg_mgr_t));
+
+    p_mgr->p_original = cinfo->mem;
+    p_mgr->p_arena = p_arena;
+
+    p_mgr->pub.alloc_small = fa_jpeg_alloc;
+    p_mgr->pub.alloc_large = fa_jpeg_alloc;
+    p_mgr->pub.alloc_sarray = fa_jpeg_alloc_sarray;
+    p_mgr->pub.alloc_barray = fa_jpeg_alloc_barray;
+    p_mgr->pub.request_virt_sarray = fa_jpeg_request_virt_sarray;
+    p_mgr->pub.request_virt_barray = fa_jpeg_request_virt_barray;
+    p_mgr->pub.realize_virt_arrays = fa_jpeg_realize_virt_arrays;
+    p_mgr->pub.access_virt_sarray = fa_jpeg_access_virt_sarray;
+    p_mgr->pub.access_virt_barray = fa_jpeg_access_virt_barray;
+    p_mgr->pub.free_pool = fa_jpeg_free_pool;
+    p_mgr->pub.self_destruct = fa_jpeg_self_destruct;
+    p_mgr->pub.max_memory_to_use = cinfo->mem->max_memory_to_use;
+    p_mgr->pub.max_alloc_chunk = cinfo->mem->max_alloc_chunk;
+
+    cinfo->mem = &p_mgr->pub;
+}
@@ -0,0 +1,103 @@
+//
+// Per-worker scratch arena, reset after every frame
+//
+
+#ifndef _FRAME_ARENA_H
+#define _FRAME_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <jpeglib.h>
+
+/* Cache line alignment, also enough for libjpeg's SIMD row buffers */
+#define FA_ALIGN                                    (64)
+
+typedef struct fa_overflow {
+    struct fa_overflow *p_next;
+    void *p_data;
+    size_t size;
+} fa_overflow_t;
+
+typedef struct {
+    uint8_t *p_base;
+    size_t size;
+    size_t used;
+
+    /* Requests the arena couldn't hold this frame, freed and folded in on reset */
+    fa_overflow_t *p_overflow;
+    size_t overflow_bytes;
+
+    /* Monitoring */
+    size_t high_water;
+    uint64_t grows;
+} fa_arena_t;
+
+/**
+ * @func fa_init
+ * @param p_arena Arena to initialize
+ * @param size Initial size, the arena grows to the largest frame seen
+ * @return True if the arena was allocated
+ */
+bool fa_init(fa_arena_t *p_arena, size_t size);
+
+/**
+ * @func fa_destroy
+ * @param p_arena Arena to release
+ */
+void fa_destroy(fa_arena_t *p_arena);
+
+/**
+ * @func fa_alloc
+ * @param p_arena Arena
+ * @param size Bytes wanted
+ * @return FA_ALIGN aligned memory valid until fa_reset(). Never NULL; a request
+ *         the arena can't hold comes from the heap and the arena grows on reset.
+ */
+void *fa_alloc(fa_arena_t *p_arena, size_t size);
+
+/**
+ * @func fa_reset
+ * @param p_arena Arena, everything allocated from it is released
+ */
+void fa_reset(fa_arena_t *p_arena);
+
+/**
+ * @func fa_set_current
+ * @param p_arena Arena the calling thread's scratch allocations come from, NULL for the heap
+ */
+void fa_set_current(fa_arena_t *p_arena);
+
+/**
+ * @func fa_current
+ * @return The calling thread's arena, NULL if it has none
+ */
+fa_arena_t *fa_current(void);
+
+/**
+ * @func fa_scratch
+ * @param size Bytes wanted
+ * @return Memory from the calling thread's arena, or from the heap when it has none.
+ *         Pass to fa_release() when done.
+ */
+void *fa_scratch(size_t size);
+
+/**
+ * @func fa_release
+ * @param p_ptr Memory from fa_scratch(), freed only if it came from the heap
+ */
+void fa_release(void *p_ptr);
+
+/**
+ * @func fa_jpeg_attach
+ * @param cinfo Freshly created libjpeg object
+ *
+ * Replaces the object's memory manager with one that allocates from the calling
+ * thread's arena, including virtual arrays, which are always kept in memory.
+ * Nothing is freed until the arena is reset, so the object must be destroyed
+ * before then. Does nothing if the thread has no arena.
+ */
+void fa_jpeg_attach(j_common_ptr cinfo);
+
+#endif //_FRAME_ARENA_H
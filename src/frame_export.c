@@ -0,0 +1,295 @@
+//
+// Zero-copy frame sharing with local processes over DMABUF
+//
+// Everything runs on the capture thread without blocking: new subscribers and
+// release messages are picked up by fe_poll() once per frame, and frames are sent
+// with MSG_DONTWAIT. A subscriber whose socket is full simply misses the frame.
+//
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "frame_export.h"
+
+static void fe_drop_subscriber(fe_state_t *p_state, fe_subscriber_t *p_sub) {
+    for (unsigned int i=0; i < p_state->num_buffers; ++i) {
+        if (!(p_sub->held & (1u << i))) {
+            continue;
+        }
+
+        if (--p_state->refcount[i] == 0) {
+            p_state->released |= 1u << i;
+        }
+    }
+
+    close(p_sub->fd);
+    p_sub->fd = -1;
+    p_sub->held = 0;
+    p_sub->fds_sent = 0;
+}
+
+bool fe_init(fe_state_t *p_state, const char *p_path, uint32_t device_id) {
+    struct sockaddr_un addr;
+
+    if (!p_state || !p_path) {
+        return false;
+    }
+
+    memset(p_state, 0, sizeof(fe_state_t));
+    p_state->listen_fd = -1;
+    p_state->device_id = device_id;
+
+    for (int s=0; s < FE_MAX_SUBSCRIBERS; ++s) {
+        p_state->subscribers[s].fd = -1;
+    }
+    for (int b=0; b < FE_MAX_BUFFERS; ++b) {
+        for (int p=0; p < FE_MAX_PLANES; ++p) {
+            p_state->dmabuf_fds[b][p] = -1;
+        }
+    }
+
+    if (strlen(p_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long: %s\n", __func__, p_path);
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, p_path);
+    strcpy(p_state->path, p_path);
+
+    p_state->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (p_state->listen_fd < 0) {
+        perror("fe_init: socket");
+        return false;
+    }
+
+    unlink(p_path);
+
+    if (bind(p_state->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            listen(p_state->listen_fd, FE_MAX_SUBSCRIBERS) < 0) {
+        perror("fe_init: bind");
+        close(p_state->listen_fd);
+        p_state->listen_fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void fe_set_buffers(fe_state_t *p_state, unsigned int num_buffers, unsigned int num_planes, const int *p_fds) {
+    if (!p_state || !p_fds) {
+        return;
+    }
+
+    if (num_buffers > FE_MAX_BUFFERS) {
+        num_buffers = FE_MAX_BUFFERS;
+    }
+    if (num_planes > FE_MAX_PLANES) {
+        num_planes = FE_MAX_PLANES;
+    }
+
+    p_state->num_buffers = num_buffers;
+    p_state->num_planes = num_planes;
+
+    for (unsigned int b=0; b < num_buffers; ++b) {
+        for (unsigned int p=0; p < num_planes; ++p) {
+            p_state->dmabuf_fds[b][p] = p_fds[b * num_planes + p];
+        }
+    }
+}
+
+void fe_destroy(fe_state_t *p_state) {
+    if (!p_state) {
+        return;
+    }
+
+    for (int s=0; s < FE_MAX_SUBSCRIBERS; ++s) {
+        if (p_state->subscribers[s].fd >= 0) {
+            fe_drop_subscriber(p_state, &p_state->subscribers[s]);
+        }
+    }
+
+    for (int b=0; b < FE_MAX_BUFFERS; ++b) {
+        for (int p=0; p < FE_MAX_PLANES; ++p) {
+            if (p_state->dmabuf_fds[b][p] >= 0) {
+                close(p_state->dmabuf_fds[b][p]);
+                p_state->dmabuf_fds[b][p] = -1;
+            }
+        }
+    }
+
+    if (p_state->listen_fd >= 0) {
+        close(p_state->listen_fd);
+        p_state->listen_fd = -1;
+        unlink(p_state->path);
+    }
+}
+
+static void fe_accept(fe_state_t *p_state) {
+    int fd;
+
+    while ((fd = accept4(p_state->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        fe_subscriber_t *p_sub = NULL;
+
+        for (int s=0; s < FE_MAX_SUBSCRIBERS; ++s) {
+            if (p_state->subscribers[s].fd < 0) {
+                p_sub = &p_state->subscribers[s];
+                break;
+            }
+        }
+
+        if (!p_sub) {
+            fprintf(stderr, "%s: too many subscribers on %s\n", __func__, p_state->path);
+            close(fd);
+            continue;
+        }
+
+        p_sub->fd = fd;
+        p_sub->held = 0;
+        p_sub->fds_sent = 0;
+    }
+}
+
+static void fe_read_releases(fe_state_t *p_state, fe_subscriber_t *p_sub) {
+    fe_release_msg_t msg;
+    ssize_t len;
+
+    while ((len = recv(p_sub->fd, &msg, sizeof(msg), MSG_DONTWAIT)) == sizeof(msg)) {
+        /* Ignore releases of buffers the subscriber doesn't hold */
+        if (msg.index >= p_state->num_buffers || !(p_sub->held & (1u << msg.index))) {
+            continue;
+        }
+
+        uint32_t bit = 1u << msg.index;
+
+        p_sub->held &= ~bit;
+        if (--p_state->refcount[msg.index] == 0) {
+            p_state->released |= bit;
+        }
+    }
+
+    /* Orderly shutdown or a socket error */
+    if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        fe_drop_subscriber(p_state, p_sub);
+    }
+}
+
+uint32_t fe_poll(fe_state_t *p_state) {
+    uint32_t released;
+
+    if (!p_state || p_state->listen_fd < 0) {
+        return 0;
+    }
+
+    fe_accept(p_state);
+
+    for (int s=0; s < FE_MAX_SUBSCRIBERS; ++s) {
+        if (p_state->subscribers[s].fd >= 0) {
+            fe_read_releases(p_state, &p_state->subscribers[s]);
+        }
+    }
+
+    released = p_state->released;
+    p_state->released = 0;
+
+    return released;
+}
+
+static bool fe_send(fe_state_t *p_state, fe_subscriber_t *p_sub, fe_frame_msg_t *p_msg) {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * FE_MAX_PLANES)];
+        struct cmsghdr align;
+    } control;
+    bool b_attach = !(p_sub->fds_sent & (1u << p_msg->index));
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = p_msg;
+    iov.iov_len = sizeof(fe_frame_msg_t);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    p_msg->num_fds = 0;
+
+    if (b_attach) {
+        size_t fds_len = sizeof(int) * p_state->num_planes;
+        struct cmsghdr *p_cmsg;
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(fds_len);
+
+        p_cmsg = CMSG_FIRSTHDR(&msg);
+        p_cmsg->cmsg_level = SOL_SOCKET;
+        p_cmsg->cmsg_type = SCM_RIGHTS;
+        p_cmsg->cmsg_len = CMSG_LEN(fds_len);
+        memcpy(CMSG_DATA(p_cmsg), p_state->dmabuf_fds[p_msg->index], fds_len);
+
+        p_msg->num_fds = p_state->num_planes;
+    }
+
+    if (sendmsg(p_sub->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            fe_drop_subscriber(p_state, p_sub);
+        }
+        return false;
+    }
+
+    if (b_attach) {
+        p_sub->fds_sent |= 1u << p_msg->index;
+    }
+
+    return true;
+}
+
+bool fe_publish(fe_state_t *p_state, fe_frame_msg_t *p_msg) {
+    unsigned int held = 0;
+    bool b_taken = false;
+
+    if (!p_state || !p_msg || p_state->listen_fd < 0 || p_msg->index >= p_state->num_buffers) {
+        return false;
+    }
+
+    for (unsigned int i=0; i < p_state->num_buffers; ++i) {
+        if (p_state->refcount[i] > 0) {
+            held++;
+        }
+    }
+
+    /* Keep enough buffers with the driver, this one counts as held once sent */
+    if (held + 1 + FE_MIN_QUEUED_BUFFERS > p_state->num_buffers) {
+        p_state->frames_skipped++;
+        return false;
+    }
+
+    p_msg->version = FE_PROTOCOL_VERSION;
+    p_msg->device_id = p_state->device_id;
+    p_msg->num_planes = p_state->num_planes;
+
+    for (int s=0; s < FE_MAX_SUBSCRIBERS; ++s) {
+        fe_subscriber_t *p_sub = &p_state->subscribers[s];
+
+        if (p_sub->fd < 0) {
+            continue;
+        }
+
+        if (fe_send(p_state, p_sub, p_msg)) {
+            p_sub->held |= 1u << p_msg->index;
+            p_state->refcount[p_msg->index]++;
+            b_taken = true;
+        }
+    }
+
+    if (b_taken) {
+        p_state->frames_exported++;
+    }
+
+    return b_taken;
+}
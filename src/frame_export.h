@@ -0,0 +1,122 @@
+//
+// Zero-copy frame sharing with local processes over DMABUF
+//
+// Subscribers connect to a SOCK_SEQPACKET Unix socket. For every exported frame
+// they receive one fe_frame_msg_t; the dmabuf fds of a capture buffer are attached
+// with SCM_RIGHTS the first time that buffer is sent to the subscriber only, so
+// subscribers keep them by buffer index. When done with a frame, a subscriber sends
+// back an fe_release_msg_t. The capture buffer is returned to the driver once every
+// subscriber that received it has released it, or has disconnected.
+//
+
+#ifndef _FRAME_EXPORT_H
+#define _FRAME_EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FE_MAX_SUBSCRIBERS                          (8)
+#define FE_MAX_BUFFERS                              (32)
+#define FE_MAX_PLANES                               (8)
+
+/* Buffers always left with the driver so capture never stalls on subscribers */
+#define FE_MIN_QUEUED_BUFFERS                       (1)
+
+#define FE_PROTOCOL_VERSION                         (1)
+
+typedef struct {
+    uint32_t version;
+    uint32_t index;             /* Capture buffer index, echoed back on release */
+    uint32_t sequence;          /* Driver frame sequence number */
+    uint32_t device_id;
+    uint64_t timestamp_us;      /* CLOCK_MONOTONIC capture time */
+    uint32_t pixelformat;       /* V4L2 fourcc */
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;            /* Bytes per row of the first plane */
+    uint32_t chroma_offset;     /* NV12 CbCr offset into a single plane buffer, 0 otherwise */
+    uint32_t chroma_stride;
+    uint32_t bytesused;
+    uint32_t num_planes;        /* Planes, one dmabuf fd each */
+    uint32_t num_fds;           /* Fds attached to this message, 0 if already sent */
+    int32_t crop_left;          /* Region of interest inside the frame */
+    int32_t crop_top;
+    uint32_t crop_width;
+    uint32_t crop_height;
+} fe_frame_msg_t;
+
+typedef struct {
+    uint32_t index;
+    uint32_t sequence;
+} fe_release_msg_t;
+
+typedef struct {
+    int fd;                     /* -1 when the slot is free */
+    uint32_t held;              /* Buffers not released yet */
+    uint32_t fds_sent;          /* Buffers whose fds the subscriber has */
+} fe_subscriber_t;
+
+typedef struct {
+    int listen_fd;
+    char path[108];
+    uint32_t device_id;
+    fe_subscriber_t subscribers[FE_MAX_SUBSCRIBERS];
+
+    unsigned int num_buffers;
+    unsigned int num_planes;
+    int dmabuf_fds[FE_MAX_BUFFERS][FE_MAX_PLANES];
+
+    /* Subscribers holding each buffer, and buffers waiting to be requeued */
+    int refcount[FE_MAX_BUFFERS];
+    uint32_t released;
+
+    /* Monitoring */
+    uint64_t frames_exported;
+    uint64_t frames_skipped;
+} fe_state_t;
+
+/**
+ * @func fe_init
+ * @param p_state State to initialize
+ * @param p_path Socket path, an existing socket file is replaced
+ * @param device_id Sent with every frame so subscribers can tell devices apart
+ * @return True if the socket is listening
+ */
+bool fe_init(fe_state_t *p_state, const char *p_path, uint32_t device_id);
+
+/**
+ * @func fe_set_buffers
+ * @param p_state Export state
+ * @param num_buffers Capture buffers
+ * @param num_planes Planes per buffer
+ * @param p_fds num_buffers * num_planes dmabuf fds, buffer major. Ownership passes
+ *              to the export state.
+ */
+void fe_set_buffers(fe_state_t *p_state, unsigned int num_buffers, unsigned int num_planes, const int *p_fds);
+
+/**
+ * @func fe_destroy
+ * @param p_state State to release, closes every socket and dmabuf fd
+ */
+void fe_destroy(fe_state_t *p_state);
+
+/**
+ * @func fe_poll
+ * @param p_state Export state
+ * @return Mask of buffers released by their last subscriber, the caller requeues them
+ *
+ * Accepts new subscribers and reads release messages without blocking.
+ */
+uint32_t fe_poll(fe_state_t *p_state);
+
+/**
+ * @func fe_publish
+ * @param p_state Export state
+ * @param p_msg Frame description, version, device_id, num_planes and num_fds are filled in
+ * @return True if a subscriber took the buffer, it must not be requeued until fe_poll()
+ *         reports it
+ */
+bool fe_publish(fe_state_t *p_state, fe_frame_msg_t *p_msg);
+
+#endif //_FRAME_EXPORT_H
@@ -0,0 +1,91 @@
+//
+// Per-frame capture metadata carried from the driver to every output
+//
+// The segment is added after encoding rather than through libjpeg, so the end of
+// processing is known when it is written and passed-through device JPEGs get the
+// same segment as encoded ones. It goes right after SOI, or after JFIF's APP0.
+//
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_meta.h"
+
+uint64_t fm_monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+size_t fm_format(const fm_frame_meta_t *p_meta, char *p_buf, size_t buf_len) {
+    int len;
+
+    if (!p_meta || !p_buf || buf_len == 0) {
+        return 0;
+    }
+
+    len = snprintf(p_buf, buf_len, "capture_ns=%llu;sequence=%u;device=%u;process_start_ns=%llu;process_end_ns=%llu",
+                   (unsigned long long) p_meta->capture_ns, p_meta->sequence, p_meta->device_id,
+                   (unsigned long long) p_meta->process_start_ns, (unsigned long long) p_meta->process_end_ns);
+
+    if (len < 0) {
+        return 0;
+    }
+
+    return ((size_t) len < buf_len) ? (size_t) len : buf_len - 1;
+}
+
+size_t fm_insert_segment(uint8_t *p_jpeg, size_t jpeg_len, size_t buf_size, uint8_t marker, const uint8_t *p_data,
+                         size_t data_len) {
+    size_t segment_len;
+    size_t offset = 2;
+
+    if (!p_jpeg || (!p_data && data_len > 0) || jpeg_len < 2 || p_jpeg[0] != 0xFF || p_jpeg[1] != 0xD8) {
+        return jpeg_len;
+    }
+
+    /* JFIF wants its APP0 segment first, go after it */
+    if (jpeg_len >= 6 && p_jpeg[2] == 0xFF && p_jpeg[3] == 0xE0) {
+        offset += 2 + ((p_jpeg[4] << 8) | p_jpeg[5]);
+        if (offset > jpeg_len) {
+            return jpeg_len;
+        }
+    }
+
+    /* Marker, length, payload */
+    segment_len = 2 + 2 + data_len;
+
+    if (segment_len - 2 > 0xFFFF || jpeg_len + segment_len > buf_size) {
+        return jpeg_len;
+    }
+
+    memmove(&p_jpeg[offset + segment_len], &p_jpeg[offset], jpeg_len - offset);
+
+    uint8_t *p_seg = &p_jpeg[offset];
+
+    p_seg[0] = 0xFF;
+    p_seg[1] = marker;
+    p_seg[2] = (uint8_t) ((segment_len - 2) >> 8);
+    p_seg[3] = (uint8_t) ((segment_len - 2) & 0xFF);
+    memcpy(&p_seg[4], p_data, data_len);
+
+    return jpeg_len + segment_len;
+}
+
+size_t fm_insert_jpeg(uint8_t *p_jpeg, size_t jpeg_len, size_t buf_size, const fm_frame_meta_t *p_meta) {
+    uint8_t payload[sizeof(FM_APP_IDENTIFIER) + FM_STRING_MAX_LENGTH];
+    size_t id_len = sizeof(FM_APP_IDENTIFIER);
+
+    if (!p_meta) {
+        return jpeg_len;
+    }
+
+    /* NUL terminated identifier, then the record */
+    memcpy(payload, FM_APP_IDENTIFIER, id_len);
+
+    size_t record_len = fm_format(p_meta, (char *) &payload[id_len], sizeof(payload) - id_len);
+
+    return fm_insert_segment(p_jpeg, jpeg_len, buf_size, FM_APP_MARKER, payload, id_len + record_len);
+}
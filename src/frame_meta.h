@@ -0,0 +1,72 @@
+//
+// Per-frame capture metadata carried from the driver to every output
+//
+
+#ifndef _FRAME_META_H
+#define _FRAME_META_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* APP9 segment, identified by FM_APP_IDENTIFIER so other APP9 users are ignored */
+#define FM_APP_MARKER                               (0xE9)
+#define FM_APP_IDENTIFIER                           "HAWKEYE"
+
+/* Longest formatted record, and the most fm_insert_jpeg() adds: marker, length, identifier and record */
+#define FM_STRING_MAX_LENGTH                        (160)
+#define FM_SEGMENT_MAX_LENGTH                       (4 + sizeof(FM_APP_IDENTIFIER) + FM_STRING_MAX_LENGTH)
+
+typedef struct {
+    uint64_t capture_ns;        /* CLOCK_MONOTONIC time the driver captured the frame */
+    uint32_t sequence;          /* V4L2 sequence number, gaps are dropped frames */
+    uint32_t device_id;
+    uint64_t process_start_ns;  /* CLOCK_MONOTONIC time processing started */
+    uint64_t process_end_ns;    /* CLOCK_MONOTONIC time encoding finished */
+} fm_frame_meta_t;
+
+/**
+ * @func fm_monotonic_ns
+ * @return CLOCK_MONOTONIC in nanoseconds, the one clock for frame records, stage timing and trace spans
+ */
+uint64_t fm_monotonic_ns(void);
+
+/**
+ * @func fm_format
+ * @param p_meta Record to format
+ * @param p_buf Output, NUL terminated
+ * @param buf_len Size of p_buf, FM_STRING_MAX_LENGTH is always enough
+ * @return Length of the string
+ *
+ * The record is formatted as key=value pairs separated by ';', the same text is
+ * used in the JPEG segment and in side channels.
+ */
+size_t fm_format(const fm_frame_meta_t *p_meta, char *p_buf, size_t buf_len);
+
+/**
+ * @func fm_insert_segment
+ * @param p_jpeg Complete JPEG datastream, the segment is inserted after SOI and APP0
+ * @param jpeg_len Length of the datastream
+ * @param buf_size Size of the buffer holding it
+ * @param marker Second byte of the segment marker, e.g. JPEG_COM
+ * @param p_data Segment payload
+ * @param data_len Length of the payload, at most 65533
+ * @return New length, jpeg_len unchanged if the buffer is too small or not a JPEG
+ *
+ * Lets segments that depend on the whole frame be added after its scanlines were
+ * streamed to the encoder.
+ */
+size_t fm_insert_segment(uint8_t *p_jpeg, size_t jpeg_len, size_t buf_size, uint8_t marker, const uint8_t *p_data,
+                         size_t data_len);
+
+/**
+ * @func fm_insert_jpeg
+ * @param p_jpeg Complete JPEG datastream, the segment is inserted after SOI and APP0
+ * @param jpeg_len Length of the datastream
+ * @param buf_size Size of the buffer holding it
+ * @param p_meta Record to embed
+ * @return New length, jpeg_len unchanged if the buffer is too small or not a JPEG
+ */
+size_t fm_insert_jpeg(uint8_t *p_jpeg, size_t jpeg_len, size_t buf_size, const fm_frame_meta_t *p_meta);
+
+#endif //_FRAME_META_H
@@ -3,6 +3,14 @@
 #define __FRAMES_H
 
 #include "v4l2uvc.h"
+#include "jpeg_tables.h"
+#include "rate_control.h"
+#include "resample.h"
+#include "frame_export.h"
+#include "frame_meta.h"
+#include "telemetry.h"
+#include "frame_arena.h"
+#include "color_detect.h"
 
 #define MIN_FRAME_SIZE 8*1024
 #define MAX_FRAME_SIZE 1024*1024
@@ -19,6 +27,29 @@ struct frame_buffer {
     long current_frame;
     size_t buffer_size;
     struct video_device *vd;
+    uint32_t device_id;
+    fm_frame_meta_t meta;
+    jt_huff_state_t huff_state;
+    rc_state_t rate_ctrl;
+    rs_state_t resample;
+    tm_state_t telemetry;
+    bool b_export;
+    fe_state_t frame_export;
+
+    /* Encoded frame output */
+    uint8_t *out_buf;
+    size_t out_size;
+
+    /* Scratch memory for one frame, including libjpeg's */
+    fa_arena_t arena;
+
+    /* Frames published since the last profile-fps report */
+    unsigned long fps_frames;
+
+    /* Frames left until the next color detection, and the parameters and tracks of this device's detections */
+    int detect_countdown;
+    detect_params_t detect_params;
+    detect_tracker_t detect_tracker;
 };
 
 struct frame_buffers {
@@ -0,0 +1,178 @@
+//
+// Per-stage latency histograms for the capture and processing path
+//
+// Recording is a bucket index computation and an increment, cheap enough to leave
+// on in production. Dumping and resetting happen from the main loop, between
+// frames, when the signal handler has asked for them.
+//
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+#include "frame_meta.h"
+#include "histogram.h"
+
+static hg_histogram_t stage_histograms[HG_NUM_STAGES];
+
+static const char *stage_names[HG_NUM_STAGES] = {
+    [HG_STAGE_DQBUF]        = "dqbuf",
+    [HG_STAGE_COPY]         = "copy",
+    [HG_STAGE_CONVERT]      = "convert",
+    [HG_STAGE_GRADIENTS]    = "gradients",
+    [HG_STAGE_CLUSTER]      = "cluster",
+    [HG_STAGE_FEATURES]     = "features",
+    [HG_STAGE_CLASSIFY]     = "classify",
+    [HG_STAGE_BLOBS]        = "blobs",
+    [HG_STAGE_ENCODE]       = "encode",
+    [HG_STAGE_WRITE]        = "write",
+};
+
+static unsigned int hg_bucket_index(uint64_t value) {
+    unsigned int shift;
+
+    if (value < 2 * HG_SUB_BUCKETS) {
+        return (unsigned int) value;
+    }
+
+    shift = (63 - __builtin_clzll(value)) - HG_SUB_BUCKET_BITS;
+
+    return (shift + 1) * HG_SUB_BUCKETS + (unsigned int) ((value >> shift) - HG_SUB_BUCKETS);
+}
+
+/* Middle of the range of values that land in a bucket */
+static uint64_t hg_bucket_value(unsigned int index) {
+    unsigned int shift;
+    uint64_t low;
+
+    if (index < 2 * HG_SUB_BUCKETS) {
+        return index;
+    }
+
+    shift = index / HG_SUB_BUCKETS - 1;
+    low = (uint64_t) (index % HG_SUB_BUCKETS + HG_SUB_BUCKETS) << shift;
+
+    return low + ((1ull << shift) >> 1);
+}
+
+void hg_reset(hg_histogram_t *p_hist) {
+    if (!p_hist) {
+        return;
+    }
+
+    memset(p_hist, 0, sizeof(hg_histogram_t));
+}
+
+void hg_record(hg_histogram_t *p_hist, uint64_t value) {
+    if (!p_hist) {
+        return;
+    }
+
+    if (p_hist->count == 0 || value < p_hist->min) {
+        p_hist->min = value;
+    }
+    if (value > p_hist->max) {
+        p_hist->max = value;
+    }
+
+    p_hist->count++;
+    p_hist->sum += value;
+    p_hist->buckets[hg_bucket_index(value)]++;
+}
+
+uint64_t hg_percentile(const hg_histogram_t *p_hist, double percentile) {
+    uint64_t rank;
+    uint64_t seen = 0;
+    uint64_t value;
+
+    if (!p_hist || p_hist->count == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t) ((percentile / 100.0) * p_hist->count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > p_hist->count) {
+        rank = p_hist->count;
+    }
+
+    for (unsigned int i=0; i < HG_BUCKETS; ++i) {
+        seen += p_hist->buckets[i];
+        if (seen >= rank) {
+            value = hg_bucket_value(i);
+
+            /* The extremes are exact, don't report past them */
+            if (value < p_hist->min) {
+                value = p_hist->min;
+            }
+            if (value > p_hist->max) {
+                value = p_hist->max;
+            }
+            return value;
+        }
+    }
+
+    return p_hist->max;
+}
+
+void hg_stage_record(hg_stage_t stage, uint64_t elapsed_ns) {
+    if (stage >= HG_NUM_STAGES) {
+        return;
+    }
+
+    hg_record(&stage_histograms[stage], elapsed_ns);
+}
+
+void hg_stage_end(hg_stage_t stage, uint64_t start_ns) {
+    uint64_t now = fm_monotonic_ns();
+
+    hg_stage_record(stage, (now > start_ns) ? now - start_ns : 0);
+
+    if (tr_is_enabled()) {
+        tr_span(hg_stage_name(stage), start_ns, now);
+    }
+}
+
+const hg_histogram_t *hg_stage_histogram(hg_stage_t stage) {
+    if (stage >= HG_NUM_STAGES) {
+        return NULL;
+    }
+
+    return &stage_histograms[stage];
+}
+
+const char *hg_stage_name(hg_stage_t stage) {
+    if (stage >= HG_NUM_STAGES) {
+        return "unknown";
+    }
+
+    return stage_names[stage];
+}
+
+void hg_dump_stages(void) {
+    printf("%s: %-10s %10s %10s %10s %10s %10s %10s %10s\n", __func__,
+           "stage", "count", "mean us", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+
+    for (hg_stage_t stage=0; stage < HG_NUM_STAGES; ++stage) {
+        const hg_histogram_t *p_hist = &stage_histograms[stage];
+
+        if (p_hist->count == 0) {
+            continue;
+        }
+
+        printf("%s: %-10s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", __func__,
+               stage_names[stage], (unsigned long long) p_hist->count,
+               (double) p_hist->sum / p_hist->count / 1e3,
+               hg_percentile(p_hist, 50.0) / 1e3, hg_percentile(p_hist, 90.0) / 1e3,
+               hg_percentile(p_hist, 99.0) / 1e3, hg_percentile(p_hist, 99.9) / 1e3,
+               p_hist->max / 1e3);
+    }
+
+    fflush(stdout);
+}
+
+void hg_reset_stages(void) {
+    for (hg_stage_t stage=0; stage < HG_NUM_STAGES; ++stage) {
+        hg_reset(&stage_histograms[stage]);
+    }
+}
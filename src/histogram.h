@@ -0,0 +1,106 @@
+//
+// Per-stage latency histograms for the capture and processing path
+//
+
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Log-linear buckets: values below 2 * HG_SUB_BUCKETS get their own bucket, above
+ * that each power of two is split into HG_SUB_BUCKETS, so any value is recorded
+ * within 1 / HG_SUB_BUCKETS (about 3%) of its true value.
+ */
+#define HG_SUB_BUCKET_BITS                          (5)
+#define HG_SUB_BUCKETS                              (1 << HG_SUB_BUCKET_BITS)
+#define HG_BUCKETS                                  ((64 - HG_SUB_BUCKET_BITS + 1) * HG_SUB_BUCKETS)
+
+typedef enum {
+    HG_STAGE_DQBUF = 0,
+    HG_STAGE_COPY,
+    HG_STAGE_CONVERT,
+    HG_STAGE_GRADIENTS,
+    HG_STAGE_CLUSTER,
+    HG_STAGE_FEATURES,
+    HG_STAGE_CLASSIFY,
+    HG_STAGE_BLOBS,
+    HG_STAGE_ENCODE,
+    HG_STAGE_WRITE,
+    HG_NUM_STAGES
+} hg_stage_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[HG_BUCKETS];
+} hg_histogram_t;
+
+/**
+ * @func hg_reset
+ * @param p_hist Histogram to clear
+ */
+void hg_reset(hg_histogram_t *p_hist);
+
+/**
+ * @func hg_record
+ * @param p_hist Histogram
+ * @param value Value to add
+ */
+void hg_record(hg_histogram_t *p_hist, uint64_t value);
+
+/**
+ * @func hg_percentile
+ * @param p_hist Histogram
+ * @param percentile 0.0 to 100.0
+ * @return Midpoint of the bucket holding the percentile, 0 if the histogram is empty
+ */
+uint64_t hg_percentile(const hg_histogram_t *p_hist, double percentile);
+
+/**
+ * @func hg_stage_record
+ * @param stage Stage the time was spent in
+ * @param elapsed_ns Time spent
+ */
+void hg_stage_record(hg_stage_t stage, uint64_t elapsed_ns);
+
+/**
+ * @func hg_stage_end
+ * @param stage Stage that finished
+ * @param start_ns fm_monotonic_ns() when the stage started
+ *
+ * Also records the stage as a trace span when tracing is enabled.
+ */
+void hg_stage_end(hg_stage_t stage, uint64_t start_ns);
+
+/**
+ * @func hg_stage_histogram
+ * @param stage Stage
+ * @return Histogram of the stage, NULL for an invalid stage
+ */
+const hg_histogram_t *hg_stage_histogram(hg_stage_t stage);
+
+/**
+ * @func hg_stage_name
+ * @param stage Stage
+ * @return Short name of the stage
+ */
+const char *hg_stage_name(hg_stage_t stage);
+
+/**
+ * @func hg_dump_stages
+ *
+ * Prints a percentile table of every stage that has samples.
+ */
+void hg_dump_stages(void);
+
+/**
+ * @func hg_reset_stages
+ */
+void hg_reset_stages(void);
+
+#endif //_HISTOGRAM_H
@@ -31,10 +31,51 @@
 #include "v4l2uvc.h"
 #include "color_detect.h"
 #include "stripe_filter.h"
+#include "jpeg_tables.h"
+#include "histogram.h"
+#include "trace.h"
+#include "frame_arena.h"
+#include "frame_meta.h"
 #include "image_utils.h"
 
 #define OUTPUT_BUF_SIZE  4096
 
+/*
+ * Fused row loops time the stages of one row in ROW_TIMING_INTERVAL, the stage split is scaled up from those rows.
+ * Odd, so the timed rows cycle through every row of libjpeg's 8 and 16 row batches, it encodes on the last one.
+ */
+#define ROW_TIMING_INTERVAL  (17)
+
+/* Features found in the last frame stripe detection ran on */
+static size_t stripe_feature_count = 0;
+
+/* Set when the last frame's features did not fit in the output buffer */
+static bool b_stripe_features_dropped = false;
+
+size_t get_stripe_feature_count(void) {
+    return stripe_feature_count;
+}
+
+bool get_stripe_features_dropped(void) {
+    return b_stripe_features_dropped;
+}
+
+/* Time spent on all rows, estimated from the rows that were timed */
+static uint64_t scale_row_time(uint64_t timed_ns, size_t timed_rows, size_t rows) {
+    return (timed_rows > 0) ? timed_ns * rows / timed_rows : 0;
+}
+
+/* Grow a static scratch buffer, contents are not kept */
+static unsigned char *scratch_buffer(unsigned char **p_buf, size_t *p_size, size_t size) {
+    if (size > *p_size) {
+        free(*p_buf);
+        *p_buf = malloc(size);
+        *p_size = size;
+    }
+
+    return *p_buf;
+}
+
 typedef struct {
     struct jpeg_destination_mgr pub; /* public fields */
 
@@ -123,6 +164,28 @@ GLOBAL(void) dest_buffer(j_compress_ptr cinfo, unsigned char *buffer, int size,
     dest->written = written;
 }
 
+/******************************************************************************
+Description.: Starts compression with the Huffman tables selected by p_huff.
+              When abbreviated output needs a new tables-only datastream, it is
+              written into p_huff->tables before the frame is started.
+Input Value.: compressor with defaults and quality set, table state (may be
+              NULL), quality and the frame destination buffer
+Return Value: -
+******************************************************************************/
+static void start_compress(j_compress_ptr cinfo, jt_huff_state_t *p_huff, int quality, unsigned char *dst, size_t dst_size, int *written) {
+    boolean write_all_tables = jt_prepare_compress(p_huff, cinfo, quality);
+
+    if (p_huff && p_huff->b_tables_pending) {
+        dest_buffer(cinfo, p_huff->tables, JT_TABLES_MAX_SIZE, &p_huff->tables_len);
+        jpeg_write_tables(cinfo);
+        jt_tables_written(p_huff, quality);
+
+        dest_buffer(cinfo, dst, dst_size, written);
+    }
+
+    jpeg_start_compress(cinfo, write_all_tables);
+}
+
 /******************************************************************************
 Description.: yuv2jpeg function is based on compress_yuyv_to_jpeg written by
               Gabriel A. Devenyi.
@@ -135,31 +198,34 @@ Input Value.: video structure from v4l2uvc.c/h, destination buffer and buffersiz
 Return Value: the buffer will contain the compressed data
 ******************************************************************************/
 size_t
-compress_yuyv_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, size_t src_size, unsigned int width,
-                      unsigned int height, int quality, bool enable_stripe_detect, bool b_write_detect_image) {
+compress_yuyv_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, size_t src_size, unsigned int src_stride,
+                      unsigned int width, unsigned int height, int quality, bool enable_stripe_detect, bool b_write_detect_image,
+                      detect_params_t *p_detect_params, jt_huff_state_t *p_huff) {
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[height];
-    static unsigned char *frame_buffer = NULL;
-    static uint8_t* p_gray = NULL;
-    static uint8_t* p_gray_image = NULL;
+    JSAMPROW row_pointer[1];
+    static unsigned char *p_rgb_row = NULL;
+    static size_t rgb_row_size = 0;
+    static unsigned char *p_gray = NULL;
+    static size_t gray_size = 0;
+    static unsigned char *p_gray_image = NULL;
+    static size_t gray_image_size = 0;
     int z;
     static int written;
 
-    if (frame_buffer == NULL) {
-        frame_buffer = calloc(width * 3 * height, 1);
-    }
+    /* The whole gray frame is only kept for the stripe detection image */
+    bool b_keep_gray_image = enable_stripe_detect && b_write_detect_image;
 
-    if (p_gray == NULL) {
-        p_gray = calloc(width, 1);
-    }
+    row_pointer[0] = scratch_buffer(&p_rgb_row, &rgb_row_size, (size_t) width * 3);
+    scratch_buffer(&p_gray, &gray_size, width);
 
-    if (p_gray_image == NULL) {
-        p_gray_image = calloc(width * height, 1);
+    if (b_keep_gray_image) {
+        scratch_buffer(&p_gray_image, &gray_image_size, (size_t) width * height);
     }
 
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
+    fa_jpeg_attach((j_common_ptr) &cinfo);
     dest_buffer(&cinfo, dst, dst_size, &written);
 
     cinfo.image_width = width;
@@ -170,21 +236,35 @@ compress_yuyv_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, s
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, quality, TRUE);
 
-    jpeg_start_compress(&cinfo, TRUE);
-
-    unsigned char *ptr = frame_buffer;
-
-    uint8_t* p_gray_image_ptr = &p_gray_image[0];
+    start_compress(&cinfo, p_huff, quality, dst, dst_size, &written);
 
     /* Feature detection lists */
     sf_gradient_list_t grad_list = { 0 };
     sf_gradient_cluster_list_t cluster_list = { 0 };
     sf_feature_list_t feature_list = { 0 };
 
+    bool b_color_detect = color_detect_begin(width, height, p_detect_params);
+
+    unsigned char *src_start = src;
+
+    /*
+     * Every per-pixel consumer runs on a row while it is in cache: conversion to the RGB row the
+     * encoder takes, gradient transitions on the gray row and color-class runs on the source row.
+     * No full-frame intermediate is written. Stage times are sampled on every ROW_TIMING_INTERVAL-th
+     * row and taken out of the loop time.
+     */
+    uint64_t stage_start = fm_monotonic_ns();
+    uint64_t gradient_ns = 0;
+    uint64_t classify_ns = 0;
+    uint64_t encode_ns = 0;
+    size_t timed_rows = 0;
+
     z = 0;
     for (size_t line=0; line < height; ++line) {
-	    row_pointer[line] = ptr;
-	    uint8_t* p_gray_ptr = &p_gray[0];
+        unsigned char *ptr = row_pointer[0];
+        uint8_t* p_gray_ptr = &p_gray[0];
+
+        src = src_start + line * src_stride;
 
         for(size_t x = 0; x < width; x++) {
             int r, g, b;
@@ -199,7 +279,6 @@ compress_yuyv_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, s
 
             // Use luminance value for gray image
             *p_gray_ptr++ = y;
-            *p_gray_image_ptr++ = y;
 
             r = ((y << 8) + (359 * v)) >> 8;
             g = ((y << 8) - (88 * u) - (183 * v)) >> 8;
@@ -214,37 +293,105 @@ compress_yuyv_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, s
                 src += 4;
             }
         }
+
+        if (b_keep_gray_image) {
+            memcpy(&p_gray_image[line * width], p_gray, width);
+        }
+
+        bool b_timed = (line % ROW_TIMING_INTERVAL) == 0;
+        uint64_t row_mark = b_timed ? fm_monotonic_ns() : 0;
+        uint64_t now;
+
         if (enable_stripe_detect) {
             // perform per-line gradient detection
             sf_find_gradients(&grad_list, &p_gray[0], width, line);
+            if (b_timed) {
+                now = fm_monotonic_ns();
+                gradient_ns += now - row_mark;
+                row_mark = now;
+            }
+        }
+
+        if (b_color_detect) {
+            color_detect_yuv422_row(src_start + line * src_stride, line, false);
+            if (b_timed) {
+                now = fm_monotonic_ns();
+                classify_ns += now - row_mark;
+                row_mark = now;
+            }
+        }
+
+        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+        if (b_timed) {
+            encode_ns += fm_monotonic_ns() - row_mark;
+            timed_rows++;
         }
     }
 
+    uint64_t loop_end = fm_monotonic_ns();
+    gradient_ns = scale_row_time(gradient_ns, timed_rows, height);
+    classify_ns = scale_row_time(classify_ns, timed_rows, height);
+    encode_ns = scale_row_time(encode_ns, timed_rows, height);
+    uint64_t other_ns = gradient_ns + classify_ns + encode_ns;
+    uint64_t loop_ns = loop_end - stage_start;
+    hg_stage_record(HG_STAGE_CONVERT, (loop_ns > other_ns) ? loop_ns - other_ns : 0);
+
+    /* A single span, the stages alternate every row */
+    if (tr_is_enabled()) {
+        tr_span("row kernel", stage_start, loop_end);
+    }
+
+    const char *p_feature_string = NULL;
+
     if (enable_stripe_detect) {
+        hg_stage_record(HG_STAGE_GRADIENTS, gradient_ns);
+
         /* Cluster gradients and extract features from gradient clusters */
+        stage_start = fm_monotonic_ns();
         sf_cluster_gradients(&grad_list, &cluster_list);
+        hg_stage_end(HG_STAGE_CLUSTER, stage_start);
+
+        stage_start = fm_monotonic_ns();
         sf_find_features(&cluster_list, &feature_list);
+        hg_stage_end(HG_STAGE_FEATURES, stage_start);
+        stripe_feature_count = feature_list.num_elem;
+        b_stripe_features_dropped = false;
 
         if (b_write_detect_image) {
             sf_write_image("./sf_image.bmp", width, height, p_gray_image, width * height, &grad_list, &cluster_list,
                            &feature_list);
         }
 
-        /* Write feature list to JPEG_COM section of image */
-        const char *p_feature_string = sf_get_feature_list_data_string(&feature_list);
-
-        if (p_feature_string != NULL) {
-            jpeg_write_marker(&cinfo, JPEG_COM, (const JOCTET *) p_feature_string, strlen(p_feature_string));
-        }
+        p_feature_string = sf_get_feature_list_data_string(&feature_list);
     }
 
-    jpeg_write_scanlines(&cinfo, row_pointer, height);
+    if (b_color_detect) {
+        hg_stage_record(HG_STAGE_CLASSIFY, classify_ns);
+        color_detect_end();
+    }
 
+    stage_start = fm_monotonic_ns();
     jpeg_finish_compress(&cinfo);
+    jt_finish_compress(p_huff, &cinfo);
+    hg_stage_record(HG_STAGE_ENCODE, encode_ns + (fm_monotonic_ns() - stage_start));
     jpeg_destroy_compress(&cinfo);
 
-    //free(frame_buffer);
-    //free(p_gray);
+    /* Features are known only after the last row was encoded, add them as a JPEG_COM segment afterwards */
+    if (p_feature_string != NULL) {
+        static bool b_drop_logged = false;
+        size_t jpeg_len = written;
+
+        written = fm_insert_segment(dst, written, dst_size, JPEG_COM, (const uint8_t *) p_feature_string,
+                                    strlen(p_feature_string));
+
+        /* The frame is still published, only without its features; counted per frame, logged once */
+        b_stripe_features_dropped = (written == jpeg_len);
+        if (b_stripe_features_dropped && !b_drop_logged) {
+            b_drop_logged = true;
+            printf("%s: %zu stripe features did not fit in the output buffer and were dropped\n", __func__,
+                   stripe_feature_count);
+        }
+    }
 
     return (written);
 }
@@ -254,17 +401,22 @@ compress_yuyv_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, s
 #define PIX_MIN_VALUE       (0)
 #define PIX_MAX_VALUE       (255)
 
-size_t compress_z16_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char* src, size_t src_size, unsigned int width, unsigned int height, int quality, int mm_scale) {
+size_t compress_z16_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char* src, size_t src_size, unsigned int src_stride, unsigned int width, unsigned int height, int quality, int mm_scale, jt_huff_state_t *p_huff) {
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
     JSAMPROW row_pointer[1];
     unsigned char *line_buffer;
+    static unsigned char *p_scratch = NULL;
+    static size_t scratch_size = 0;
     static int written;
 
-    line_buffer = calloc(width, 1);
+    unsigned char *src_start = src;
+
+    line_buffer = scratch_buffer(&p_scratch, &scratch_size, width);
 
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
+    fa_jpeg_attach((j_common_ptr) &cinfo);
     /* jpeg_stdio_dest (&cinfo, file); */
     dest_buffer(&cinfo, dst, dst_size, &written);
 
@@ -276,12 +428,17 @@ size_t compress_z16_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char*
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, quality, TRUE);
 
-    jpeg_start_compress(&cinfo, TRUE);
+    start_compress(&cinfo, p_huff, quality, dst, dst_size, &written);
+
+    /* Rows are scaled as they are handed to libjpeg, so that counts as encoding */
+    uint64_t stage_start = fm_monotonic_ns();
 
     while(cinfo.next_scanline < height) {
         int x;
         unsigned char *ptr = line_buffer;
 
+        src = src_start + cinfo.next_scanline * src_stride;
+
         /* Copy input pixels (two bytes each) into output pixels (one byte each) */
         for (x=0; x < width; ++x) {
             unsigned short pix_in = src[0] | (src[1] << 8);
@@ -308,10 +465,393 @@ size_t compress_z16_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char*
     }
 
     jpeg_finish_compress(&cinfo);
+    jt_finish_compress(p_huff, &cinfo);
+    hg_stage_end(HG_STAGE_ENCODE, stage_start);
     jpeg_destroy_compress(&cinfo);
 
-    free(line_buffer);
+    return (written);
+}
+
+
+/******************************************************************************
+Description.: Stripe detection over the luma samples of a frame. The raw
+              encoders below hand rows to libjpeg without a full pass of their
+              own, so detection runs first and the feature list is written as a
+              COM marker before any frame data.
+Input Value.: started compressor, first luma sample, bytes between rows, bytes
+              between luma samples in a row, frame size
+Return Value: -
+******************************************************************************/
+static void detect_stripes(j_compress_ptr cinfo, const unsigned char *luma, unsigned int luma_stride, unsigned int step,
+                           unsigned int width, unsigned int height, bool b_write_detect_image) {
+    static uint8_t *p_gray = NULL;
+    static uint8_t *p_gray_image = NULL;
+    static size_t gray_image_size = 0;
+    static unsigned int gray_width = 0;
+
+    if (width > gray_width) {
+        free(p_gray);
+        p_gray = calloc(width, 1);
+        gray_width = width;
+    }
+
+    if (b_write_detect_image && (size_t) width * height > gray_image_size) {
+        free(p_gray_image);
+        gray_image_size = (size_t) width * height;
+        p_gray_image = calloc(gray_image_size, 1);
+    }
+
+    /* Feature detection lists */
+    sf_gradient_list_t grad_list = { 0 };
+    sf_gradient_cluster_list_t cluster_list = { 0 };
+    sf_feature_list_t feature_list = { 0 };
+
+    uint64_t stage_start = fm_monotonic_ns();
+
+    for (unsigned int line=0; line < height; ++line) {
+        const unsigned char *src = luma + (size_t) line * luma_stride;
+
+        for (unsigned int x=0; x < width; ++x) {
+            p_gray[x] = src[(size_t) x * step];
+        }
+
+        if (b_write_detect_image) {
+            memcpy(&p_gray_image[(size_t) line * width], p_gray, width);
+        }
+
+        sf_find_gradients(&grad_list, p_gray, width, line);
+    }
+    hg_stage_end(HG_STAGE_GRADIENTS, stage_start);
+
+    /* Cluster gradients and extract features from gradient clusters */
+    stage_start = fm_monotonic_ns();
+    sf_cluster_gradients(&grad_list, &cluster_list);
+    hg_stage_end(HG_STAGE_CLUSTER, stage_start);
+
+    stage_start = fm_monotonic_ns();
+    sf_find_features(&cluster_list, &feature_list);
+    hg_stage_end(HG_STAGE_FEATURES, stage_start);
+    stripe_feature_count = feature_list.num_elem;
+    b_stripe_features_dropped = false;
+
+    if (b_write_detect_image) {
+        sf_write_image("./sf_image.bmp", width, height, p_gray_image, width * height, &grad_list, &cluster_list,
+                       &feature_list);
+    }
+
+    /* Write feature list to JPEG_COM section of image */
+    const char *p_feature_string = sf_get_feature_list_data_string(&feature_list);
+
+    if (p_feature_string != NULL) {
+        jpeg_write_marker(cinfo, JPEG_COM, (const JOCTET *) p_feature_string, strlen(p_feature_string));
+    }
+}
+
+/******************************************************************************
+Description.: Encodes NV12 without color conversion. The luma plane is handed
+              to libjpeg as raw 4:2:0 data in place; only the interleaved CbCr
+              plane is split into the two chroma components.
+Input Value.: destination buffer and size, luma and chroma planes with their
+              strides, frame size, quality, stripe detection flags, table state
+Return Value: size of the compressed frame
+******************************************************************************/
+size_t compress_nv12_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *luma, unsigned int luma_stride,
+                             unsigned char *chroma, unsigned int chroma_stride, unsigned int width, unsigned int height,
+                             int quality, bool enable_stripe_detect, bool b_write_detect_image, jt_huff_state_t *p_huff) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW y_rows[2 * DCTSIZE];
+    JSAMPROW cb_rows[DCTSIZE];
+    JSAMPROW cr_rows[DCTSIZE];
+    JSAMPARRAY planes[3] = { y_rows, cb_rows, cr_rows };
+    static unsigned char *p_scratch = NULL;
+    static size_t scratch_size = 0;
+    static int written;
+
+    /* Raw data is read in whole blocks, rows narrower than that are padded in scratch */
+    unsigned int padded_width = (width + 2 * DCTSIZE - 1) & ~(2 * DCTSIZE - 1);
+    unsigned int chroma_width = padded_width / 2;
+    bool b_pad_luma = (padded_width > width) || (padded_width > luma_stride);
+    size_t luma_scratch = b_pad_luma ? (size_t) 2 * DCTSIZE * padded_width : 0;
+
+    unsigned char *p_rows = scratch_buffer(&p_scratch, &scratch_size, luma_scratch + (size_t) 2 * DCTSIZE * chroma_width);
+    unsigned char *p_cb = p_rows + luma_scratch;
+    unsigned char *p_cr = p_cb + (size_t) DCTSIZE * chroma_width;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    fa_jpeg_attach((j_common_ptr) &cinfo);
+    dest_buffer(&cinfo, dst, dst_size, &written);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+
+    cinfo.raw_data_in = TRUE;
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 2;
+    cinfo.comp_info[1].h_samp_factor = 1;
+    cinfo.comp_info[1].v_samp_factor = 1;
+    cinfo.comp_info[2].h_samp_factor = 1;
+    cinfo.comp_info[2].v_samp_factor = 1;
+
+    start_compress(&cinfo, p_huff, quality, dst, dst_size, &written);
+
+    if (enable_stripe_detect) {
+        detect_stripes(&cinfo, luma, luma_stride, 1, width, height, b_write_detect_image);
+    }
+
+    uint64_t stage_start = fm_monotonic_ns();
+
+    for (int i=0; i < DCTSIZE; ++i) {
+        cb_rows[i] = p_cb + (size_t) i * chroma_width;
+        cr_rows[i] = p_cr + (size_t) i * chroma_width;
+    }
+
+    while (cinfo.next_scanline < height) {
+        unsigned int row = cinfo.next_scanline;
+
+        /* Rows past the bottom edge repeat the last row */
+        for (int i=0; i < 2 * DCTSIZE; ++i) {
+            unsigned int y = (row + i < height) ? row + i : height - 1;
+            unsigned char *src = luma + (size_t) y * luma_stride;
+
+            if (b_pad_luma) {
+                y_rows[i] = p_rows + (size_t) i * padded_width;
+                memcpy(y_rows[i], src, width);
+                memset(y_rows[i] + width, src[width - 1], padded_width - width);
+            } else {
+                y_rows[i] = src;
+            }
+        }
+
+        for (int i=0; i < DCTSIZE; ++i) {
+            unsigned int y = row / 2 + i;
+            unsigned int x;
+
+            if (y > (height - 1) / 2) {
+                y = (height - 1) / 2;
+            }
+
+            const unsigned char *src = chroma + (size_t) y * chroma_stride;
+
+            for (x=0; x < (width + 1) / 2; ++x) {
+                cb_rows[i][x] = src[2 * x];
+                cr_rows[i][x] = src[2 * x + 1];
+            }
+            for (; x < chroma_width; ++x) {
+                cb_rows[i][x] = cb_rows[i][x - 1];
+                cr_rows[i][x] = cr_rows[i][x - 1];
+            }
+        }
+
+        jpeg_write_raw_data(&cinfo, planes, 2 * DCTSIZE);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jt_finish_compress(p_huff, &cinfo);
+    hg_stage_end(HG_STAGE_ENCODE, stage_start);
+    jpeg_destroy_compress(&cinfo);
+
+    return (written);
+}
+
+/******************************************************************************
+Description.: Encodes UYVY without color conversion. Each row is split into
+              its luma and chroma samples and handed to libjpeg as raw 4:2:2.
+Input Value.: destination buffer and size, source frame and stride, frame size,
+              quality, stripe detection flags, table state
+Return Value: size of the compressed frame
+******************************************************************************/
+size_t compress_uyvy_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, unsigned int src_stride,
+                             unsigned int width, unsigned int height, int quality, bool enable_stripe_detect,
+                             bool b_write_detect_image, detect_params_t *p_detect_params, jt_huff_state_t *p_huff) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW y_rows[DCTSIZE];
+    JSAMPROW cb_rows[DCTSIZE];
+    JSAMPROW cr_rows[DCTSIZE];
+    JSAMPARRAY planes[3] = { y_rows, cb_rows, cr_rows };
+    static unsigned char *p_scratch = NULL;
+    static size_t scratch_size = 0;
+    static int written;
+
+    unsigned int padded_width = (width + 2 * DCTSIZE - 1) & ~(2 * DCTSIZE - 1);
+    unsigned int chroma_width = padded_width / 2;
+
+    unsigned char *p_y = scratch_buffer(&p_scratch, &scratch_size, (size_t) DCTSIZE * 2 * padded_width);
+    unsigned char *p_cb = p_y + (size_t) DCTSIZE * padded_width;
+    unsigned char *p_cr = p_cb + (size_t) DCTSIZE * chroma_width;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    fa_jpeg_attach((j_common_ptr) &cinfo);
+    dest_buffer(&cinfo, dst, dst_size, &written);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+
+    cinfo.raw_data_in = TRUE;
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 1;
+    cinfo.comp_info[1].h_samp_factor = 1;
+    cinfo.comp_info[1].v_samp_factor = 1;
+    cinfo.comp_info[2].h_samp_factor = 1;
+    cinfo.comp_info[2].v_samp_factor = 1;
+
+    start_compress(&cinfo, p_huff, quality, dst, dst_size, &written);
+
+    if (enable_stripe_detect) {
+        detect_stripes(&cinfo, src + 1, src_stride, 2, width, height, b_write_detect_image);
+    }
+
+    bool b_color_detect = color_detect_begin(width, height, p_detect_params);
+    uint64_t classify_ns = 0;
+    size_t timed_rows = 0;
+
+    uint64_t stage_start = fm_monotonic_ns();
+
+    for (int i=0; i < DCTSIZE; ++i) {
+        y_rows[i] = p_y + (size_t) i * padded_width;
+        cb_rows[i] = p_cb + (size_t) i * chroma_width;
+        cr_rows[i] = p_cr + (size_t) i * chroma_width;
+    }
+
+    while (cinfo.next_scanline < height) {
+        unsigned int row = cinfo.next_scanline;
+
+        for (int i=0; i < DCTSIZE; ++i) {
+            unsigned int y = (row + i < height) ? row + i : height - 1;
+            const unsigned char *p_mp = src + (size_t) y * src_stride;
+            unsigned int x;
+
+            /* U Y0 V Y1 */
+            for (x=0; x < width / 2; ++x, p_mp += 4) {
+                cb_rows[i][x] = p_mp[0];
+                y_rows[i][2 * x] = p_mp[1];
+                cr_rows[i][x] = p_mp[2];
+                y_rows[i][2 * x + 1] = p_mp[3];
+            }
+            for (x=x * 2; x < padded_width; ++x) {
+                y_rows[i][x] = y_rows[i][x - 1];
+            }
+            for (x=width / 2; x < chroma_width; ++x) {
+                cb_rows[i][x] = cb_rows[i][x - 1];
+                cr_rows[i][x] = cr_rows[i][x - 1];
+            }
+
+            /* Classify colors while the source row is in cache, padding rows are skipped */
+            if (b_color_detect && row + i < height) {
+                if (y % ROW_TIMING_INTERVAL == 0) {
+                    uint64_t classify_start = fm_monotonic_ns();
+                    color_detect_yuv422_row(src + (size_t) y * src_stride, y, true);
+                    classify_ns += fm_monotonic_ns() - classify_start;
+                    timed_rows++;
+                } else {
+                    color_detect_yuv422_row(src + (size_t) y * src_stride, y, true);
+                }
+            }
+        }
+
+        jpeg_write_raw_data(&cinfo, planes, DCTSIZE);
+    }
+
+    uint64_t encode_ns = fm_monotonic_ns() - stage_start;
+
+    classify_ns = scale_row_time(classify_ns, timed_rows, height);
+    if (b_color_detect) {
+        hg_stage_record(HG_STAGE_CLASSIFY, classify_ns);
+        color_detect_end();
+    }
+
+    stage_start = fm_monotonic_ns();
+    jpeg_finish_compress(&cinfo);
+    jt_finish_compress(p_huff, &cinfo);
+    encode_ns += fm_monotonic_ns() - stage_start;
+    hg_stage_record(HG_STAGE_ENCODE, (encode_ns > classify_ns) ? encode_ns - classify_ns : 0);
+    jpeg_destroy_compress(&cinfo);
 
     return (written);
 }
 
+/******************************************************************************
+Description.: Encodes GREY or Y16 as a single component JPEG. GREY rows are
+              handed to libjpeg in place; Y16 keeps the high byte of each
+              little endian sample.
+Input Value.: destination buffer and size, source frame and stride, frame size,
+              quality, whether the source is Y16, stripe detection flags,
+              table state
+Return Value: size of the compressed frame
+******************************************************************************/
+size_t compress_grey_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, unsigned int src_stride,
+                             unsigned int width, unsigned int height, int quality, bool b_y16, bool enable_stripe_detect,
+                             bool b_write_detect_image, jt_huff_state_t *p_huff) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row_pointer[DCTSIZE];
+    static unsigned char *p_scratch = NULL;
+    static size_t scratch_size = 0;
+    static int written;
+
+    unsigned char *p_rows = b_y16 ? scratch_buffer(&p_scratch, &scratch_size, (size_t) DCTSIZE * width) : NULL;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    fa_jpeg_attach((j_common_ptr) &cinfo);
+    dest_buffer(&cinfo, dst, dst_size, &written);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 1;
+    cinfo.in_color_space = JCS_GRAYSCALE;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+
+    start_compress(&cinfo, p_huff, quality, dst, dst_size, &written);
+
+    if (enable_stripe_detect) {
+        detect_stripes(&cinfo, b_y16 ? src + 1 : src, src_stride, b_y16 ? 2 : 1, width, height, b_write_detect_image);
+    }
+
+    uint64_t stage_start = fm_monotonic_ns();
+
+    while (cinfo.next_scanline < height) {
+        unsigned int rows = height - cinfo.next_scanline;
+
+        if (rows > DCTSIZE) {
+            rows = DCTSIZE;
+        }
+
+        for (unsigned int i=0; i < rows; ++i) {
+            unsigned char *p_row = src + (size_t) (cinfo.next_scanline + i) * src_stride;
+
+            if (b_y16) {
+                row_pointer[i] = p_rows + (size_t) i * width;
+                for (unsigned int x=0; x < width; ++x) {
+                    row_pointer[i][x] = p_row[2 * x + 1];
+                }
+            } else {
+                row_pointer[i] = p_row;
+            }
+        }
+
+        jpeg_write_scanlines(&cinfo, row_pointer, rows);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jt_finish_compress(p_huff, &cinfo);
+    hg_stage_end(HG_STAGE_ENCODE, stage_start);
+    jpeg_destroy_compress(&cinfo);
+
+    return (written);
+}
@@ -5,10 +5,23 @@
 #include <stdbool.h>
 
 #include "color_detect.h"
+#include "jpeg_tables.h"
 
 size_t
-compress_yuyv_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, size_t src_size, unsigned int width,
-                      unsigned int height, int quality, bool enable_stripe_detect, bool b_write_detect_image);
-size_t compress_z16_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char* src, size_t src_size, unsigned int width, unsigned int height, int quality, int mm_scale);
+compress_yuyv_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, size_t src_size, unsigned int src_stride,
+                      unsigned int width, unsigned int height, int quality, bool enable_stripe_detect, bool b_write_detect_image,
+                      detect_params_t *p_detect_params, jt_huff_state_t *p_huff);
+size_t compress_z16_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char* src, size_t src_size, unsigned int src_stride, unsigned int width, unsigned int height, int quality, int mm_scale, jt_huff_state_t *p_huff);
+size_t compress_nv12_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *luma, unsigned int luma_stride,
+                             unsigned char *chroma, unsigned int chroma_stride, unsigned int width, unsigned int height,
+                             int quality, bool enable_stripe_detect, bool b_write_detect_image, jt_huff_state_t *p_huff);
+size_t compress_uyvy_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, unsigned int src_stride,
+                             unsigned int width, unsigned int height, int quality, bool enable_stripe_detect,
+                             bool b_write_detect_image, detect_params_t *p_detect_params, jt_huff_state_t *p_huff);
+size_t compress_grey_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, unsigned int src_stride,
+                             unsigned int width, unsigned int height, int quality, bool b_y16, bool enable_stripe_detect,
+                             bool b_write_detect_image, jt_huff_state_t *p_huff);
+size_t get_stripe_feature_count(void);
+bool get_stripe_features_dropped(void);
 
 #endif
@@ -0,0 +1,290 @@
+//
+// Content-tuned Huffman tables and abbreviated JPEG datastreams
+//
+// libjpeg's optimize_coding makes an extra pass over every frame to gather symbol
+// counts. Instead, optimize_coding is only enabled for a warm-up window of frames.
+// libjpeg does not expose the raw counts, so the optimal code lengths it builds for
+// each warm-up frame are turned back into implied symbol probabilities (2^-len),
+// summed over the window, and one set of tables is generated from the sums. Those
+// tables are then installed on every following frame with no extra pass.
+//
+#include <string.h>
+#include <limits.h>
+
+#include "jpeg_tables.h"
+
+/* Longest code length produced before limiting to 16 bits */
+#define JT_MAX_CODE_LEN                             (64)
+
+/* Number of DC symbols for 8-bit samples */
+#define JT_NUM_DC_SYMBOLS                           (12)
+
+/* AC end-of-block and zero-run-length symbols */
+#define JT_AC_EOB                                   (0x00)
+#define JT_AC_ZRL                                   (0xF0)
+
+void jt_init(jt_huff_state_t *p_state, int warmup_frames, bool b_abbreviated) {
+    if (!p_state) {
+        return;
+    }
+
+    memset(p_state, 0, sizeof(jt_huff_state_t));
+
+    p_state->b_tune = (warmup_frames > 0) ? true : false;
+    p_state->warmup_frames = warmup_frames;
+    p_state->b_abbreviated = b_abbreviated;
+    p_state->tables_quality = -1;
+}
+
+/* Every symbol that may be coded must have a code, so seed each valid symbol with a
+ * frequency of one. Symbols not seen during warm-up end up with the longest codes.
+ */
+static void jt_seed_frequencies(long freq[257], bool b_ac) {
+    memset(freq, 0, 257 * sizeof(long));
+
+    if (!b_ac) {
+        for (int s=0; s < JT_NUM_DC_SYMBOLS; ++s) {
+            freq[s] = 1;
+        }
+        return;
+    }
+
+    freq[JT_AC_EOB] = 1;
+    freq[JT_AC_ZRL] = 1;
+
+    for (int run=0; run < 16; ++run) {
+        for (int size=1; size <= 10; ++size) {
+            freq[(run << 4) | size] = 1;
+        }
+    }
+}
+
+/* Generate an optimal table from symbol frequencies (ITU T.81 Annex K.2). The
+ * frequency array is consumed.
+ */
+static void jt_gen_optimal_table(JHUFF_TBL *p_tbl, long freq[257]) {
+    int bits[JT_MAX_CODE_LEN + 1] = { 0 };
+    int codesize[257] = { 0 };
+    int others[257];
+    int c1, c2, i, j, p;
+    long v;
+
+    for (i=0; i < 257; ++i) {
+        others[i] = -1;
+    }
+
+    /* Reserve one code point so that no real code is all ones */
+    freq[256] = 1;
+
+    for (;;) {
+        /* Find the two least frequent symbols, preferring the larger index on ties */
+        c1 = -1;
+        v = LONG_MAX;
+        for (i=0; i <= 256; ++i) {
+            if (freq[i] && freq[i] <= v) {
+                v = freq[i];
+                c1 = i;
+            }
+        }
+
+        c2 = -1;
+        v = LONG_MAX;
+        for (i=0; i <= 256; ++i) {
+            if (freq[i] && freq[i] <= v && i != c1) {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+
+        /* Done when only one tree is left */
+        if (c2 < 0) {
+            break;
+        }
+
+        /* Merge the two trees */
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        codesize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+
+        codesize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    for (i=0; i <= 256; ++i) {
+        if (codesize[i] && codesize[i] <= JT_MAX_CODE_LEN) {
+            bits[codesize[i]]++;
+        }
+    }
+
+    /* Limit code lengths to 16 bits */
+    for (i=JT_MAX_CODE_LEN; i > 16; --i) {
+        while (bits[i] > 0) {
+            j = i - 2;
+            while (bits[j] == 0) {
+                j--;
+            }
+
+            bits[i] -= 2;
+            bits[i-1]++;
+            bits[j+1] += 2;
+            bits[j]--;
+        }
+    }
+
+    /* Drop the reserved code point from the longest length */
+    while (bits[i] == 0) {
+        i--;
+    }
+    bits[i]--;
+
+    memset(p_tbl, 0, sizeof(JHUFF_TBL));
+    for (i=1; i <= 16; ++i) {
+        p_tbl->bits[i] = (UINT8) bits[i];
+    }
+
+    /* Symbols ordered by code length */
+    p = 0;
+    for (i=1; i <= JT_MAX_CODE_LEN; ++i) {
+        for (j=0; j <= 255; ++j) {
+            if (codesize[j] == i) {
+                p_tbl->huffval[p++] = (UINT8) j;
+            }
+        }
+    }
+}
+
+/* Accumulate the implied symbol probabilities of an optimized table */
+static void jt_accumulate(uint32_t freq[257], JHUFF_TBL *p_tbl) {
+    int k = 0;
+
+    if (!p_tbl) {
+        return;
+    }
+
+    for (int len=1; len <= 16; ++len) {
+        for (int n=0; n < p_tbl->bits[len]; ++n) {
+            freq[p_tbl->huffval[k++]] += 1u << (16 - len);
+        }
+    }
+}
+
+static void jt_build_tables(jt_huff_state_t *p_state) {
+    long freq[257];
+
+    for (int t=0; t < JT_NUM_TABLES; ++t) {
+        jt_seed_frequencies(freq, false);
+        for (int s=0; s < 257; ++s) {
+            freq[s] += p_state->dc_freq[t][s];
+        }
+        jt_gen_optimal_table(&p_state->dc_tbl[t], freq);
+
+        jt_seed_frequencies(freq, true);
+        for (int s=0; s < 257; ++s) {
+            freq[s] += p_state->ac_freq[t][s];
+        }
+        jt_gen_optimal_table(&p_state->ac_tbl[t], freq);
+    }
+
+    p_state->b_tuned = true;
+}
+
+static void jt_install_table(JHUFF_TBL *p_dst, JHUFF_TBL *p_src) {
+    if (!p_dst) {
+        return;
+    }
+
+    memcpy(p_dst->bits, p_src->bits, sizeof(p_dst->bits));
+    memcpy(p_dst->huffval, p_src->huffval, sizeof(p_dst->huffval));
+    p_dst->sent_table = FALSE;
+}
+
+boolean jt_prepare_compress(jt_huff_state_t *p_state, j_compress_ptr cinfo, int quality) {
+    if (!p_state || !cinfo) {
+        return TRUE;
+    }
+
+    p_state->b_tables_pending = false;
+
+    if (p_state->b_tune && !p_state->b_tuned) {
+        /* Inside the warm-up window, let libjpeg gather statistics for this frame */
+        cinfo->optimize_coding = TRUE;
+        return TRUE;
+    }
+
+    if (p_state->b_tuned) {
+        for (int t=0; t < JT_NUM_TABLES; ++t) {
+            jt_install_table(cinfo->dc_huff_tbl_ptrs[t], &p_state->dc_tbl[t]);
+            jt_install_table(cinfo->ac_huff_tbl_ptrs[t], &p_state->ac_tbl[t]);
+        }
+        cinfo->optimize_coding = FALSE;
+    }
+
+    if (!p_state->b_abbreviated) {
+        return TRUE;
+    }
+
+    /* Tables are fixed from here on, check whether consumers have them already. When
+     * they don't, the tables are left unsent so jpeg_write_tables() emits all of them.
+     */
+    if (p_state->tables_quality != quality || p_state->b_tables_tuned != p_state->b_tuned) {
+        p_state->b_tables_pending = true;
+    } else {
+        jpeg_suppress_tables(cinfo, TRUE);
+    }
+
+    return FALSE;
+}
+
+void jt_tables_written(jt_huff_state_t *p_state, int quality) {
+    if (!p_state) {
+        return;
+    }
+
+    p_state->b_tables_pending = false;
+    p_state->b_tables_updated = true;
+    p_state->tables_quality = quality;
+    p_state->b_tables_tuned = p_state->b_tuned;
+}
+
+void jt_finish_compress(jt_huff_state_t *p_state, j_compress_ptr cinfo) {
+    if (!p_state || !cinfo || !p_state->b_tune || p_state->b_tuned) {
+        return;
+    }
+
+    /* Only tables referenced by a component were optimized for this frame */
+    bool dc_used[JT_NUM_TABLES] = { false };
+    bool ac_used[JT_NUM_TABLES] = { false };
+
+    for (int ci=0; ci < cinfo->num_components; ++ci) {
+        jpeg_component_info *p_comp = &cinfo->comp_info[ci];
+
+        if (p_comp->dc_tbl_no < JT_NUM_TABLES) {
+            dc_used[p_comp->dc_tbl_no] = true;
+        }
+        if (p_comp->ac_tbl_no < JT_NUM_TABLES) {
+            ac_used[p_comp->ac_tbl_no] = true;
+        }
+    }
+
+    for (int t=0; t < JT_NUM_TABLES; ++t) {
+        if (dc_used[t]) {
+            jt_accumulate(p_state->dc_freq[t], cinfo->dc_huff_tbl_ptrs[t]);
+        }
+        if (ac_used[t]) {
+            jt_accumulate(p_state->ac_freq[t], cinfo->ac_huff_tbl_ptrs[t]);
+        }
+    }
+
+    if (++p_state->frames_collected >= p_state->warmup_frames) {
+        jt_build_tables(p_state);
+    }
+}
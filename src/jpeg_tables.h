@@ -0,0 +1,82 @@
+//
+// Content-tuned Huffman tables and abbreviated JPEG datastreams
+//
+
+#ifndef _JPEG_TABLES_H
+#define _JPEG_TABLES_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <jpeglib.h>
+
+/* Maximum size of a tables-only datastream (SOI, 4 x DQT, 4 x DHT, EOI) */
+#define JT_TABLES_MAX_SIZE                          (4096)
+
+/* Number of Huffman tables tracked (luma and chroma) */
+#define JT_NUM_TABLES                               (2)
+
+typedef struct {
+    /* Configuration */
+    bool b_tune;
+    bool b_abbreviated;
+    int warmup_frames;
+
+    /* Warm-up statistics */
+    int frames_collected;
+    bool b_tuned;
+    uint32_t dc_freq[JT_NUM_TABLES][257];
+    uint32_t ac_freq[JT_NUM_TABLES][257];
+
+    /* Tuned tables, only bits/huffval are used */
+    JHUFF_TBL dc_tbl[JT_NUM_TABLES];
+    JHUFF_TBL ac_tbl[JT_NUM_TABLES];
+
+    /* Quality the last tables-only datastream was built for, -1 if none */
+    int tables_quality;
+    bool b_tables_tuned;
+
+    /* Most recent tables-only datastream */
+    bool b_tables_pending;
+    uint8_t tables[JT_TABLES_MAX_SIZE];
+    int tables_len;
+    bool b_tables_updated;
+} jt_huff_state_t;
+
+/**
+ * @func jt_init
+ * @param p_state State to initialize
+ * @param warmup_frames Number of frames to collect symbol statistics over, 0 to use the standard tables
+ * @param b_abbreviated Omit tables from frame datastreams once they are fixed
+ */
+void jt_init(jt_huff_state_t *p_state, int warmup_frames, bool b_abbreviated);
+
+/**
+ * @func jt_prepare_compress
+ * @param p_state Huffman table state, may be NULL
+ * @param cinfo Compressor with defaults and quality already set
+ * @param quality The JPEG quality the compressor was set up with
+ * @return The write_all_tables value to pass to jpeg_start_compress
+ *
+ * Installs tuned tables once the warm-up window is over, or enables optimize_coding
+ * for frames inside the warm-up window. In abbreviated mode, p_state->b_tables_pending
+ * is set when the tables differ from the last tables-only datastream; the caller then
+ * writes one into p_state->tables with jpeg_write_tables() and calls @jt_tables_written.
+ */
+boolean jt_prepare_compress(jt_huff_state_t *p_state, j_compress_ptr cinfo, int quality);
+
+/**
+ * @func jt_tables_written
+ * @param p_state Huffman table state
+ * @param quality The JPEG quality the tables-only datastream was written for
+ */
+void jt_tables_written(jt_huff_state_t *p_state, int quality);
+
+/**
+ * @func jt_finish_compress
+ * @param p_state Huffman table state, may be NULL
+ * @param cinfo Compressor after jpeg_finish_compress and before jpeg_destroy_compress
+ */
+void jt_finish_compress(jt_huff_state_t *p_state, j_compress_ptr cinfo);
+
+#endif //_JPEG_TABLES_H
@@ -15,15 +15,26 @@
 #include "utils.h"
 #include "daemon.h"
 #include "settings.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define FRAME_BUFFER_LENGTH     (8)
-#define MAX_DETECT_COLORS       (2)
+#define FRAME_ARENA_BYTES_PER_PIXEL (4)
 
 static int is_running = 1;
 
+/* Set by SIGUSR1 and SIGUSR2, serviced between frames by the main loop */
+static volatile sig_atomic_t b_dump_histograms = 0;
+static volatile sig_atomic_t b_reset_histograms = 0;
+
 const char *p_color_detect_file_name = "detect_color_image.bmp~";
 const char *p_color_detect_file_rename = "detect_color_image.bmp";
 
+/* Color detection settings, copied into each device's frame buffer with its own tracker */
+static bool b_color_detect = false;
+static detect_params_t detect_params;
+
 static void signal_handler(int sig){
     switch (sig) {
         case SIGINT:
@@ -32,6 +43,12 @@ static void signal_handler(int sig){
         case SIGTERM:
             is_running = 0;
             break;
+        case SIGUSR1:
+            b_dump_histograms = 1;
+            break;
+        case SIGUSR2:
+            b_reset_histograms = 1;
+            break;
     }
 }
 
@@ -52,10 +69,51 @@ void init_signals(){
     signal(SIGPIPE, SIG_IGN);
 }
 
+static void init_frame_export(struct frame_buffer *fb) {
+    char path[sizeof(fb->frame_export.path)];
+    int fds[NB_BUFFER * VIDEO_MAX_PLANES];
+
+    // One socket per device, devices after the first get a numeric suffix
+    if (fb->device_id == 0) {
+        snprintf(path, sizeof(path), "%s", settings.export_socket);
+    } else {
+        snprintf(path, sizeof(path), "%s.%u", settings.export_socket, fb->device_id);
+    }
+
+    if (!fe_init(&fb->frame_export, path, fb->device_id)) {
+        user_panic("Could not create frame export socket %s.", path);
+    }
+
+    if (export_device_buffers(fb->vd, fds) < 0) {
+        user_panic("Device %s can't export its buffers.", fb->vd->device_filename);
+    }
+
+    fe_set_buffers(&fb->frame_export, NB_BUFFER, fb->vd->num_planes, fds);
+    fb->b_export = true;
+}
+
 struct frame_buffers *init_frame_buffers(size_t device_count, char *device_name) {
     int i;
     struct frame_buffer *fb;
     struct frame_buffers *fbs;
+    struct v4l2_rect crop;
+    negotiate_mode negotiate = NEGOTIATE_OFF;
+
+    // Passing the device's JPEG through is only possible when no stage needs pixels
+    if (settings.negotiate_format) {
+        negotiate = NEGOTIATE_ANY;
+        if (settings.enable_stripe_detect || settings.downscale != 1 || settings.crop_width > 0) {
+            negotiate = NEGOTIATE_RAW;
+        }
+        if (settings.enable_color_detect) {
+            negotiate = NEGOTIATE_YUV422;
+        }
+    }
+
+    crop.left = settings.crop_x;
+    crop.top = settings.crop_y;
+    crop.width = settings.crop_width;
+    crop.height = settings.crop_height;
 
     fbs = malloc(sizeof(struct frame_buffers));
     fbs->count = 0;
@@ -65,10 +123,48 @@ struct frame_buffers *init_frame_buffers(size_t device_count, char *device_name)
         fb = &fbs->buffers[i];
 
         create_frame_buffer(fb, FRAME_BUFFER_LENGTH);
-        if ((fb->vd = create_video_device(device_name, settings.width, settings.height, settings.fps, settings.v4l2_format, settings.jpeg_quality)) == NULL) {
+        fb->device_id = i;
+        if ((fb->vd = create_video_device(device_name, settings.width, settings.height, settings.fps, settings.v4l2_format, settings.jpeg_quality, &crop, negotiate, settings.userptr)) == NULL) {
             user_panic("Could not initialize video device.");
         }
 
+        if (settings.enable_color_detect &&
+                fb->vd->format_in != V4L2_PIX_FMT_YUYV && fb->vd->format_in != V4L2_PIX_FMT_UYVY) {
+            user_panic("Color detection needs yuv or uyvy frames, device %s delivers %.4s.", fb->vd->device_filename,
+                       (char *) &fb->vd->format_in);
+        }
+
+        /* Formats under two bytes per pixel get as much room as YUYV for the JPEG */
+        fb->out_size = fb->vd->framebuffer_size;
+        if (fb->out_size < fb->vd->width * fb->vd->height * 2) {
+            fb->out_size = fb->vd->width * fb->vd->height * 2;
+        }
+        fb->out_buf = alloc_device_scratch(fb->vd, fb->out_size);
+
+        /* Enough for libjpeg's whole-frame coefficient buffer, the arena grows if not */
+        if (!fa_init(&fb->arena, fb->vd->width * fb->vd->height * FRAME_ARENA_BYTES_PER_PIXEL)) {
+            panic("Couldn't allocate frame arena");
+        }
+
+        jt_init(&fb->huff_state, settings.huffman_warmup, (settings.abbreviated_jpeg == 0) ? false : true);
+        rc_init(&fb->rate_ctrl, settings.rate_control, settings.rate_target, settings.rate_interval, fb->vd->jpeg_quality);
+        rs_init(&fb->resample, settings.downscale, settings.z16_binning, fb->vd->view.width, fb->vd->view.height);
+        if (settings.downscale != RS_FACTOR_NONE && !rs_format_supported(fb->vd->format_in)) {
+            fprintf(stderr, "Device %s delivers %.4s, which can't be binned, frames are encoded at full resolution.\n",
+                    fb->vd->device_filename, (char *) &fb->vd->format_in);
+        }
+        tm_init(&fb->telemetry, settings.telemetry_window);
+
+        /* Detect colors and settings are shared, each device follows its own tracks */
+        fb->detect_params = detect_params;
+        init_detect_tracker(&fb->detect_tracker);
+        fb->detect_params.p_tracker = &fb->detect_tracker;
+
+        fb->b_export = false;
+        if (strlen(settings.export_socket)) {
+            init_frame_export(fb);
+        }
+
         fbs->count++;
     }
 
@@ -82,6 +178,13 @@ void destroy_frame_buffers(struct frame_buffers *fbs) {
     for (i = 0; i < fbs->count; i++) {
         fb = &fbs->buffers[i];
 
+        rs_destroy(&fb->resample);
+        tm_destroy(&fb->telemetry);
+        fa_destroy(&fb->arena);
+        free_device_scratch(fb->vd, fb->out_buf);
+        if (fb->b_export) {
+            fe_destroy(&fb->frame_export);
+        }
         destroy_video_device(fb->vd);
         destroy_frame_buffer(fb);
     }
@@ -90,36 +193,65 @@ void destroy_frame_buffers(struct frame_buffers *fbs) {
     free(fbs);
 }
 
+static void write_file(const char *temp_path, const char *path, void *data, size_t data_len) {
+    uint64_t stage_start = fm_monotonic_ns();
+
+    /* Open and write the file */
+    FILE* p_file = fopen(temp_path, "w+");
+
+    if (p_file == NULL) {
+        panic("Can't write output image file.");
+        return;
+    }
+
+    fwrite(data, data_len, 1, p_file);
+
+    fflush(p_file);
+    fclose(p_file);
+
+    /* Now that write is complete, rename the file */
+    rename(temp_path, path);
+
+    hg_stage_end(HG_STAGE_WRITE, stage_start);
+}
+
 void write_frame(struct frame_buffer *fb, void *data, size_t data_len) {
 
     static char out_file_path[128] = {0};
     static char temp_out_file_path[128] = {0};
+    static char tables_file_path[128] = {0};
+    static char temp_tables_file_path[128] = {0};
+    static uint8_t tables[JT_TABLES_MAX_SIZE + FM_SEGMENT_MAX_LENGTH];
 
     if (out_file_path[0] == 0 && temp_out_file_path[0] == 0) {
         sprintf(temp_out_file_path, "%s/%s.jpg~", settings.file_root, settings.base_file_name);
         sprintf(out_file_path, "%s/%s.jpg", settings.file_root, settings.base_file_name);
+        sprintf(temp_tables_file_path, "%s/%s.tables.jpg~", settings.file_root, settings.base_file_name);
+        sprintf(tables_file_path, "%s/%s.tables.jpg", settings.file_root, settings.base_file_name);
     }
 
     /* Only write files for specific formats */
     if (fb->vd->format_in == V4L2_PIX_FMT_YUYV ||
-	    fb->vd->format_in == V4L2_PIX_FMT_Z16) {
-
-    	/* Open and write the file */
-    	FILE* p_file = fopen(temp_out_file_path, "w+");
-
-    	if (p_file == NULL) {
-        	panic("Can't write output image file.");
-       	 	return;
-    	}
-
-    	// write the correct type of file
-    	fwrite(data, data_len, 1, p_file);
-
-    	fflush(p_file);
-    	fclose(p_file);
+	    fb->vd->format_in == V4L2_PIX_FMT_UYVY ||
+	    fb->vd->format_in == V4L2_PIX_FMT_NV12 ||
+	    fb->vd->format_in == V4L2_PIX_FMT_NV12M ||
+	    fb->vd->format_in == V4L2_PIX_FMT_GREY ||
+	    fb->vd->format_in == V4L2_PIX_FMT_Y16 ||
+	    fb->vd->format_in == V4L2_PIX_FMT_Z16 ||
+	    fb->vd->format_in == V4L2_PIX_FMT_MJPEG) {
+
+        /* Abbreviated frames need the tables they were encoded with in place first, marked with the first such frame */
+        if (fb->huff_state.b_tables_updated) {
+            size_t tables_len = fb->huff_state.tables_len;
+
+            memcpy(tables, fb->huff_state.tables, tables_len);
+            tables_len = fm_insert_jpeg(tables, tables_len, sizeof(tables), &fb->meta);
+
+            write_file(temp_tables_file_path, tables_file_path, tables, tables_len);
+            fb->huff_state.b_tables_updated = false;
+        }
 
-    	/* Now that write is complete, rename the file */
-    	rename(temp_out_file_path, out_file_path);
+        write_file(temp_out_file_path, out_file_path, data, data_len);
     }
 }
 
@@ -143,46 +275,324 @@ bool parseDetectColor(const char *p_detect_color_string, uint32_t detect_color_l
     return true;
 }
 
+/* Load the detect colors and parameters from settings */
+static void init_color_detect(void) {
+    char *p_colors;
+    char *p_save = NULL;
+    int color_count = 0;
+
+    if (!settings.enable_color_detect) {
+        return;
+    }
+
+    p_colors = strdup(settings.detect_colors);
+
+    for (char *p_token = strtok_r(p_colors, ",", &p_save); p_token; p_token = strtok_r(NULL, ",", &p_save)) {
+        detect_color_t detect_color;
+
+        if (color_count >= MAX_DETECT_COLORS) {
+            user_panic("At most %d detect-colors.", MAX_DETECT_COLORS);
+        }
+
+        memset(&detect_color, 0, sizeof(detect_color));
+        if (!parseDetectColor(p_token, strlen(p_token), &detect_color)) {
+            user_panic("Invalid detect color: %s, expected #RRGGBB.", p_token);
+        }
+
+        calcNorms(&detect_color);
+        setDetectColor(&detect_color, color_count++);
+    }
+
+    free(p_colors);
+
+    if (color_count == 0) {
+        user_panic("enable-color-detect needs at least one of detect-colors.");
+    }
+
+    build_detect_params(&detect_params, color_count, settings.detect_tolerance / 100.0f, settings.min_detect_conf,
+                        (settings.write_detect_image == 0) ? false : true, true, settings.file_root,
+                        p_color_detect_file_rename);
+    set_detect_tracking(&detect_params, (settings.detect_tracking == 0) ? false : true, settings.detect_full_scan);
+    set_detect_coarse(&detect_params, settings.detect_coarse);
+    set_detect_threads(&detect_params, settings.detect_threads);
+
+    b_color_detect = true;
+}
+
+/*
+ * Detections of the last color detection, replaced like the frame so readers never see a partial file.
+ * The first line is the frame's capture record, so detections can be matched to the frame they came from.
+ */
+static void write_detections(struct frame_buffer *fb, const char *p_blobs) {
+    static char out_file_path[128] = {0};
+    static char temp_out_file_path[128] = {0};
+    static char detections[FM_STRING_MAX_LENGTH + 1 + BLOB_STRING_MAX_LENGTH];
+    size_t len;
+
+    if (out_file_path[0] == 0) {
+        snprintf(temp_out_file_path, sizeof(temp_out_file_path), "%s/%s.blobs~", settings.file_root, settings.base_file_name);
+        snprintf(out_file_path, sizeof(out_file_path), "%s/%s.blobs", settings.file_root, settings.base_file_name);
+    }
+
+    if (!p_blobs) {
+        p_blobs = "0\n";
+    }
+
+    len = fm_format(&fb->meta, detections, FM_STRING_MAX_LENGTH);
+    len += snprintf(&detections[len], sizeof(detections) - len, "\n%s", p_blobs);
+    if (len >= sizeof(detections)) {
+        len = sizeof(detections) - 1;
+    }
+
+    write_file(temp_out_file_path, out_file_path, detections, len);
+}
+
+/* Offer the dequeued capture buffer to export subscribers, true if one of them holds it */
+static bool export_frame(struct frame_buffer *fb) {
+    struct video_device *vd = fb->vd;
+    fe_frame_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.index = vd->buf.index;
+    msg.sequence = fb->meta.sequence;
+    msg.timestamp_us = fb->meta.capture_ns / 1000;
+    msg.pixelformat = vd->format_in;
+    msg.width = vd->width;
+    msg.height = vd->height;
+    msg.stride = vd->stride;
+    msg.chroma_stride = vd->chroma_stride;
+    msg.bytesused = (vd->buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ? vd->planes[0].bytesused : vd->buf.bytesused;
+
+    if (format_is_planar(vd->format_in) && vd->num_planes == 1) {
+        msg.chroma_offset = vd->stride * vd->height;
+    }
+
+    // Software crops are left to the subscriber, the buffer holds the whole frame
+    if (vd->crop_mode == CROP_SOFTWARE) {
+        msg.crop_left = vd->crop.left;
+        msg.crop_top = vd->crop.top;
+        msg.crop_width = vd->crop.width;
+        msg.crop_height = vd->crop.height;
+    } else {
+        msg.crop_width = vd->width;
+        msg.crop_height = vd->height;
+    }
+
+    return fe_publish(&fb->frame_export, &msg);
+}
+
 void grab_frame(struct frame_buffer *fb) {
     uint8_t *buf = NULL;
     uint32_t buf_size = 0;
+    bool b_held = false;
+    uint64_t frame_start = tr_is_enabled() ? fm_monotonic_ns() : 0;
+    uint64_t span_start;
+
+    mem_set_phase(MEM_PHASE_CAPTURE);
+
+    /* Buffers every export subscriber is done with go back to the driver */
+    if (fb->b_export) {
+        uint32_t released = fe_poll(&fb->frame_export);
+
+        for (unsigned int i = 0; i < NB_BUFFER; i++) {
+            if (released & (1u << i)) {
+                requeue_device_buffer_index(fb->vd, i);
+            }
+        }
+    }
 
-    buf = (uint8_t *) malloc(fb->vd->framebuffer_size);
-    buf_size = fb->vd->framebuffer_size;
+    buf = fb->out_buf;
+    buf_size = fb->out_size;
 
     if (!buf) {
         perror("Couldn't allocate output frame data buffer");
         return;
     }
 
+    fa_set_current(&fb->arena);
+
     size_t frame_size = 0;
     frame_size = capture_frame(fb->vd);
 
     if (frame_size > 0) {
+        fb->meta.capture_ns = fb->vd->capture_ns;
+        fb->meta.sequence = fb->vd->buf.sequence;
+        fb->meta.device_id = fb->device_id;
+        fb->meta.process_start_ns = fm_monotonic_ns();
+
+        tr_set_frame(fb->device_id, fb->meta.sequence);
+
+        /*
+         * Subscribers get the driver's buffer as soon as it is dequeued, ahead of any processing. The pipeline
+         * below reads the copy capture_frame() made in the framebuffer, not the exported buffer, so a buffer a
+         * subscriber holds only waits for that subscriber: fe_poll() requeues it once released.
+         */
+        if (fb->b_export) {
+            b_held = export_frame(fb);
+        }
+
+        unsigned char *p_frame = fb->vd->view.data;
+        unsigned int frame_stride = fb->vd->view.stride;
+        unsigned int frame_width = fb->vd->view.width;
+        unsigned int frame_height = fb->vd->view.height;
+        unsigned char *p_frame_chroma = fb->vd->view.chroma;
+        unsigned int frame_chroma_stride = fb->vd->view.chroma_stride;
+
+        /* Bin down to the output resolution; everything downstream sees the reduced frame */
+        mem_set_phase(MEM_PHASE_RESAMPLE);
+        if (fb->resample.factor != RS_FACTOR_NONE) {
+            unsigned int scaled_width, scaled_height;
+
+            size_t scaled_size = rs_resample(&fb->resample, fb->vd->format_in, p_frame, frame_stride, p_frame_chroma,
+                                             frame_chroma_stride, frame_width, frame_height, &scaled_width,
+                                             &scaled_height);
+            if (tr_is_enabled()) {
+                tr_span("resample", fb->meta.process_start_ns, fm_monotonic_ns());
+            }
+
+            if (scaled_size > 0) {
+                p_frame = fb->resample.p_buf;
+                frame_size = scaled_size;
+                frame_stride = scaled_width * format_bytes_per_pixel(fb->vd->format_in);
+                p_frame_chroma = fb->resample.p_chroma;
+                frame_chroma_stride = scaled_width;
+                frame_width = scaled_width;
+                frame_height = scaled_height;
+            }
+        }
+
+        /*
+         * Color detection classifies the packed 4:2:2 frame the encoder reads, every detect-stride frames.
+         * Row by row inside the encoder's own pass normally; coarse-to-fine and strip-parallel detection need
+         * the whole frame, so they scan it just before encoding instead.
+         */
+        detect_params_t *p_detect_params = NULL;
+        bool b_detected = false;
+
+        if (b_color_detect && (fb->vd->format_in == V4L2_PIX_FMT_YUYV || fb->vd->format_in == V4L2_PIX_FMT_UYVY) &&
+                --fb->detect_countdown <= 0) {
+            fb->detect_countdown = settings.detect_stride;
+            b_detected = true;
+
+            if (fb->detect_params.coarse_decimation > 1 || fb->detect_params.num_threads > 1) {
+                span_start = tr_is_enabled() ? fm_monotonic_ns() : 0;
+                yuv422_color_detection(p_frame, frame_stride, frame_width, frame_height,
+                                       (fb->vd->format_in == V4L2_PIX_FMT_UYVY), &fb->detect_params);
+                if (tr_is_enabled()) {
+                    tr_span("color detect", span_start, fm_monotonic_ns());
+                }
+            } else {
+                p_detect_params = &fb->detect_params;
+            }
+        }
+
+        mem_set_phase(MEM_PHASE_ENCODE);
+        double encode_start = gettime();
+
         /* Process by input format type (output type is always JPEG) */
         switch (fb->vd->format_in) {
             case V4L2_PIX_FMT_YUYV:
-                    frame_size = compress_yuyv_to_jpeg(buf, buf_size, fb->vd->framebuffer, frame_size, fb->vd->width,
-                                                       fb->vd->height, fb->vd->jpeg_quality,
+                    frame_size = compress_yuyv_to_jpeg(buf, buf_size, p_frame, frame_size, frame_stride,
+                                                       frame_width, frame_height, fb->rate_ctrl.quality,
                                                        (settings.enable_stripe_detect == 0) ? false : true,
-                                                       (settings.write_detect_image == 0) ? false : true);
+                                                       (settings.write_detect_image == 0) ? false : true,
+                                                       p_detect_params, &fb->huff_state);
                 break;
             case V4L2_PIX_FMT_Z16:
-                frame_size = compress_z16_to_jpeg(buf, buf_size, fb->vd->framebuffer, frame_size, fb->vd->width,
-                                                      fb->vd->height, fb->vd->jpeg_quality, settings.mm_scale);
+                frame_size = compress_z16_to_jpeg(buf, buf_size, p_frame, frame_size, frame_stride,
+                                                      frame_width, frame_height, fb->rate_ctrl.quality, settings.mm_scale,
+                                                      &fb->huff_state);
+                break;
+            case V4L2_PIX_FMT_UYVY:
+                frame_size = compress_uyvy_to_jpeg(buf, buf_size, p_frame, frame_stride,
+                                                   frame_width, frame_height, fb->rate_ctrl.quality,
+                                                   (settings.enable_stripe_detect == 0) ? false : true,
+                                                   (settings.write_detect_image == 0) ? false : true,
+                                                   p_detect_params, &fb->huff_state);
+                break;
+            case V4L2_PIX_FMT_NV12:
+            case V4L2_PIX_FMT_NV12M:
+                frame_size = compress_nv12_to_jpeg(buf, buf_size, p_frame, frame_stride,
+                                                   p_frame_chroma, frame_chroma_stride,
+                                                   frame_width, frame_height, fb->rate_ctrl.quality,
+                                                   (settings.enable_stripe_detect == 0) ? false : true,
+                                                   (settings.write_detect_image == 0) ? false : true,
+                                                   &fb->huff_state);
+                break;
+            case V4L2_PIX_FMT_GREY:
+            case V4L2_PIX_FMT_Y16:
+                frame_size = compress_grey_to_jpeg(buf, buf_size, p_frame, frame_stride,
+                                                   frame_width, frame_height, fb->rate_ctrl.quality,
+                                                   (fb->vd->format_in == V4L2_PIX_FMT_Y16) ? true : false,
+                                                   (settings.enable_stripe_detect == 0) ? false : true,
+                                                   (settings.write_detect_image == 0) ? false : true,
+                                                   &fb->huff_state);
+                break;
+            case V4L2_PIX_FMT_MJPEG:
+                frame_size = copy_frame(buf, buf_size, fb->vd->framebuffer, frame_size);
                 break;
             default:
                 panic("Video device is using unknown format.");
                 break;
         }
 
+        double encode_end = gettime();
+        rc_update(&fb->rate_ctrl, frame_size, encode_end - encode_start, encode_end);
+
+        /* Every output frame carries its capture record */
+        fb->meta.process_end_ns = fm_monotonic_ns();
+        if (frame_size > 0) {
+            frame_size = fm_insert_jpeg(buf, frame_size, buf_size, &fb->meta);
+        }
+
+        mem_set_phase(MEM_PHASE_PUBLISH);
         write_frame(fb, buf, frame_size);
+        if (b_detected) {
+            write_detections(fb, get_blob_data_string());
+        }
+
+        /* The frame is published once write_frame() has renamed it into place */
+        uint64_t publish_ns = fm_monotonic_ns();
+
+        if (tr_is_enabled()) {
+            tr_span("publish", fb->meta.process_end_ns, publish_ns);
+        }
+
+        if (tm_record(&fb->telemetry, fb->meta.sequence, fb->meta.capture_ns, publish_ns)) {
+            tm_print(&fb->telemetry, fb->device_id);
+        }
+
+        mx_frame(fb->device_id, fb->telemetry.last_dropped, fb->meta.capture_ns);
+        mx_add(fb->device_id, MX_OUTPUT_BYTES, frame_size);
+        mx_add(fb->device_id, MX_ENCODE_NS, (uint64_t) ((encode_end - encode_start) * 1e9));
+        mx_set(fb->device_id, MX_QUALITY, fb->rate_ctrl.quality);
+        mx_set(fb->device_id, MX_LATENCY_NS, publish_ns - fb->meta.capture_ns);
+        if (settings.enable_stripe_detect) {
+            mx_add(fb->device_id, MX_STRIPE_FEATURES, get_stripe_feature_count());
+            if (get_stripe_features_dropped()) {
+                mx_add(fb->device_id, MX_FEATURES_DROPPED, 1);
+            }
+        }
+        if (b_detected) {
+            mx_add(fb->device_id, MX_COLOR_BLOBS, get_num_blobs());
+        }
+
+        /* Allocations and fps are counted per published frame, not per pass over the devices */
+        mem_frame_end();
+        fb->fps_frames++;
     }
 
-    free(buf);
-    buf = NULL;
+    if (!b_held) {
+        requeue_device_buffer(fb->vd);
+    }
 
-    requeue_device_buffer(fb->vd);
+    if (tr_is_enabled()) {
+        tr_span("frame", frame_start, fm_monotonic_ns());
+    }
+
+    fa_reset(&fb->arena);
+    fa_set_current(NULL);
+    mem_set_phase(MEM_PHASE_IDLE);
 }
 
 
@@ -193,8 +603,7 @@ int main(int argc, char *argv[]) {
     struct timespec ts;
 
     double delta;
-    static double fps_avg = 0.0f;
-    double fps;
+    double fps_start = 0.0;
 
     bool calc_fps = false;
 
@@ -202,12 +611,20 @@ int main(int argc, char *argv[]) {
     colorDetectInit();
 
     init_settings(argc, argv);
+    init_color_detect();
+
+    /* Steady state can't start before the Huffman tables are built */
+    mem_profile_init(settings.alloc_profile, max(MEM_WARMUP_FRAMES, settings.huffman_warmup + 1));
 
     // proflie fps
     if (settings.profile_fps != 0) {
         calc_fps = true;
     }
 
+    if (strlen(settings.trace_file) && !tr_init(settings.trace_file)) {
+        user_panic("Could not trace to %s.", settings.trace_file);
+    }
+
     if (settings.run_in_background) {
         daemonize();
     }
@@ -216,6 +633,10 @@ int main(int argc, char *argv[]) {
 
     fbs = init_frame_buffers(settings.video_device_count, settings.video_device_file);
 
+    if (strlen(settings.metrics_listen) && !mx_init(settings.metrics_listen, fbs->count)) {
+        user_panic("Could not serve metrics on %s.", settings.metrics_listen);
+    }
+
     while (is_running) {
         delta = gettime();
         for (i = 0; i < fbs->count; i++) {
@@ -223,15 +644,33 @@ int main(int argc, char *argv[]) {
             grab_frame(fb);
         }
 
+        if (b_dump_histograms) {
+            b_dump_histograms = 0;
+            hg_dump_stages();
+            tr_flush();
+            mem_profile_dump();
+        }
+        if (b_reset_histograms) {
+            b_reset_histograms = 0;
+            hg_reset_stages();
+        }
+
+        /* Published frames per wall clock second for each device, sleeps included, reported once a second */
         if (calc_fps) {
-            fps = 1.0f / ((gettime() - delta) / fbs->count);
-            if (fps_avg == 0.0f) {
-                fps_avg = fps;
-            } else {
-                fps_avg += fps;
-                fps_avg /= 2;
+            double now = gettime();
+
+            if (fps_start == 0.0) {
+                fps_start = delta;
+            }
+
+            if (now - fps_start >= 1.0) {
+                for (i = 0; i < fbs->count; i++) {
+                    fb = &fbs->buffers[i];
+                    printf("%s: device %u: fps: %f\n", __func__, fb->device_id, fb->fps_frames / (now - fps_start));
+                    fb->fps_frames = 0;
+                }
+                fps_start = now;
             }
-            printf("%s: fps: %f\n", __func__, fps_avg);
         }
 
         delta = gettime() - delta;
@@ -241,6 +680,13 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    mx_destroy();
+
+    tr_flush();
+    tr_destroy();
+
+    mem_profile_dump();
+
     destroy_frame_buffers(fbs);
 
     cleanup_settings();
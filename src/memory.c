@@ -4,6 +4,9 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
 
 #include "memory.h"
 
@@ -23,6 +26,204 @@ void panic(const char* str) {
 	exit(EXIT_FAILURE);
 }
 
+// Allocation profiling
+//
+// Every thread counts into a slot of its own, so the wrappers never lock. Slots
+// are static because the wrappers can't allocate. The frame count is shared, it
+// decides when steady state starts for all threads.
+
+#define MEM_BACKTRACE_DEPTH (32)
+
+typedef struct {
+	int tid;
+	uint64_t calls[MEM_NUM_PHASES];
+	uint64_t bytes[MEM_NUM_PHASES];
+} mem_thread_stats_t;
+
+static const char *phase_names[MEM_NUM_PHASES] = {
+	[MEM_PHASE_STARTUP]	= "startup",
+	[MEM_PHASE_IDLE]	= "idle",
+	[MEM_PHASE_CAPTURE]	= "capture",
+	[MEM_PHASE_RESAMPLE]	= "resample",
+	[MEM_PHASE_ENCODE]	= "encode",
+	[MEM_PHASE_PUBLISH]	= "publish",
+};
+
+static mem_profile_mode_t profile_mode = MEM_PROFILE_OFF;
+static uint64_t warmup = MEM_WARMUP_FRAMES;
+static uint64_t frames = 0;
+
+/* Allocations counted up to the end of warm-up */
+static uint64_t warmup_calls = 0;
+static uint64_t warmup_bytes = 0;
+
+static mem_thread_stats_t thread_stats[MEM_MAX_THREADS];
+static unsigned int thread_count = 0;
+
+static __thread mem_thread_stats_t *p_thread_stats = NULL;
+static __thread bool b_thread_stats_failed = false;
+static __thread mem_phase_t thread_phase = MEM_PHASE_STARTUP;
+static __thread bool b_in_report = false;
+
+bool mem_parse_profile_mode(const char *p_mode_string, mem_profile_mode_t *p_mode) {
+	if (!p_mode_string || !p_mode) {
+		return false;
+	}
+
+	if (strcmp(p_mode_string, "off") == 0) {
+		*p_mode = MEM_PROFILE_OFF;
+	} else if (strcmp(p_mode_string, "count") == 0) {
+		*p_mode = MEM_PROFILE_COUNT;
+	} else if (strcmp(p_mode_string, "strict") == 0) {
+		*p_mode = MEM_PROFILE_STRICT;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+void mem_profile_init(mem_profile_mode_t mode, uint64_t warmup_frames) {
+	void *p_frames[1];
+
+	warmup = warmup_frames;
+
+	/* The first backtrace() loads the unwinder, which allocates, so get it done now */
+	if (mode == MEM_PROFILE_STRICT) {
+		backtrace(p_frames, 1);
+	}
+
+	__atomic_store_n(&profile_mode, mode, __ATOMIC_RELEASE);
+}
+
+void mem_set_phase(mem_phase_t phase) {
+	thread_phase = (phase < MEM_NUM_PHASES) ? phase : MEM_PHASE_IDLE;
+}
+
+static void mem_totals(uint64_t *p_calls, uint64_t *p_bytes) {
+	unsigned int count = __atomic_load_n(&thread_count, __ATOMIC_ACQUIRE);
+
+	*p_calls = 0;
+	*p_bytes = 0;
+
+	if (count > MEM_MAX_THREADS) {
+		count = MEM_MAX_THREADS;
+	}
+
+	for (unsigned int t=0; t < count; ++t) {
+		for (int p=0; p < MEM_NUM_PHASES; ++p) {
+			*p_calls += __atomic_load_n(&thread_stats[t].calls[p], __ATOMIC_RELAXED);
+			*p_bytes += __atomic_load_n(&thread_stats[t].bytes[p], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void mem_frame_end(void) {
+	if (profile_mode == MEM_PROFILE_OFF) {
+		return;
+	}
+
+	uint64_t frame = __atomic_add_fetch(&frames, 1, __ATOMIC_RELAXED);
+
+	if (frame == warmup) {
+		mem_totals(&warmup_calls, &warmup_bytes);
+	}
+}
+
+void mem_profile_dump(void) {
+	unsigned int count = __atomic_load_n(&thread_count, __ATOMIC_ACQUIRE);
+	uint64_t frame = __atomic_load_n(&frames, __ATOMIC_RELAXED);
+	uint64_t calls, bytes;
+
+	if (profile_mode == MEM_PROFILE_OFF) {
+		return;
+	}
+
+	if (count > MEM_MAX_THREADS) {
+		count = MEM_MAX_THREADS;
+	}
+
+	printf("%s: %-8s %-10s %12s %14s\n", __func__, "thread", "phase", "calls", "bytes");
+
+	for (unsigned int t=0; t < count; ++t) {
+		for (int p=0; p < MEM_NUM_PHASES; ++p) {
+			uint64_t phase_calls = __atomic_load_n(&thread_stats[t].calls[p], __ATOMIC_RELAXED);
+
+			if (phase_calls == 0) {
+				continue;
+			}
+
+			printf("%s: %-8d %-10s %12llu %14llu\n", __func__, thread_stats[t].tid, phase_names[p],
+			       (unsigned long long) phase_calls,
+			       (unsigned long long) __atomic_load_n(&thread_stats[t].bytes[p], __ATOMIC_RELAXED));
+		}
+	}
+
+	mem_totals(&calls, &bytes);
+
+	if (frame > warmup) {
+		printf("%s: %llu frames after warm-up, %.3f allocations and %.1f bytes per frame\n", __func__,
+		       (unsigned long long) (frame - warmup), (double) (calls - warmup_calls) / (frame - warmup),
+		       (double) (bytes - warmup_bytes) / (frame - warmup));
+	} else {
+		printf("%s: %llu of %llu warm-up frames\n", __func__, (unsigned long long) frame, (unsigned long long) warmup);
+	}
+
+	fflush(stdout);
+}
+
+/* The calling thread's slot, claimed on its first allocation */
+static mem_thread_stats_t *mem_thread_stats(void) {
+	unsigned int slot;
+
+	if (p_thread_stats || b_thread_stats_failed) {
+		return p_thread_stats;
+	}
+
+	slot = __atomic_fetch_add(&thread_count, 1, __ATOMIC_ACQ_REL);
+	if (slot >= MEM_MAX_THREADS) {
+		b_thread_stats_failed = true;
+		return NULL;
+	}
+
+	thread_stats[slot].tid = (int) syscall(SYS_gettid);
+	p_thread_stats = &thread_stats[slot];
+
+	return p_thread_stats;
+}
+
+static void mem_report(const char *p_func, size_t size) {
+	void *p_frames[MEM_BACKTRACE_DEPTH];
+	int depth;
+
+	/* Anything allocated while reporting is not reported again */
+	b_in_report = true;
+
+	dprintf(STDERR_FILENO, "%s: %zu bytes allocated in %s on frame %llu, after warm-up\n", p_func, size,
+	        phase_names[thread_phase], (unsigned long long) __atomic_load_n(&frames, __ATOMIC_RELAXED));
+
+	depth = backtrace(p_frames, MEM_BACKTRACE_DEPTH);
+	backtrace_symbols_fd(p_frames, depth, STDERR_FILENO);
+
+	b_in_report = false;
+}
+
+static inline void mem_account(const char *p_func, size_t size) {
+	mem_thread_stats_t *p_stats;
+
+	if (profile_mode == MEM_PROFILE_OFF || b_in_report || !(p_stats = mem_thread_stats())) {
+		return;
+	}
+
+	/* Only this thread writes its slot, the dump reads it */
+	__atomic_store_n(&p_stats->calls[thread_phase], p_stats->calls[thread_phase] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&p_stats->bytes[thread_phase], p_stats->bytes[thread_phase] + size, __ATOMIC_RELAXED);
+
+	if (profile_mode == MEM_PROFILE_STRICT && __atomic_load_n(&frames, __ATOMIC_RELAXED) >= warmup) {
+		mem_report(p_func, size);
+	}
+}
+
 // Memory allocator wrappers
 
 char* __real_strdup(const char *s);
@@ -31,6 +232,8 @@ void* __real_realloc(void *ptr, size_t size);
 void* __real_calloc(size_t num, size_t size);
 
 char* __wrap_strdup(const char *s) {
+	mem_account("strdup", strlen(s) + 1);
+
 	char *ptr = __real_strdup(s);
 	char error[512];
 	if (ptr == NULL) {
@@ -43,6 +246,8 @@ char* __wrap_strdup(const char *s) {
 }
 
 void* __wrap_malloc(size_t size) {
+	mem_account("malloc", size);
+
 	void *tmp = __real_malloc(size);
 	char error[512];
 	if (tmp == NULL) {
@@ -54,6 +259,8 @@ void* __wrap_malloc(size_t size) {
 }
 
 void* __wrap_realloc(void *ptr, size_t size) {
+	mem_account("realloc", size);
+
 	void *tmp = __real_realloc(ptr, size);
 	char error[512];
 	if (tmp == NULL) {
@@ -65,6 +272,8 @@ void* __wrap_realloc(void *ptr, size_t size) {
 }
 
 void* __wrap_calloc(size_t num, size_t size) {
+	mem_account("calloc", num * size);
+
 	void *tmp = __real_calloc(num, size);
 	char error[512];
 	if (tmp == NULL) {
@@ -1,7 +1,70 @@
 #ifndef __MEMORY_H
 #define __MEMORY_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
 void user_panic(const char* fmt, ...);
 void panic(const char* str);
 
+// Allocation profiling
+
+#define MEM_MAX_THREADS (32)
+
+/* Frames before steady state, extended by the Huffman warm-up */
+#define MEM_WARMUP_FRAMES (30)
+
+typedef enum {
+	MEM_PROFILE_OFF = 0,
+	MEM_PROFILE_COUNT,
+	MEM_PROFILE_STRICT
+} mem_profile_mode_t;
+
+typedef enum {
+	MEM_PHASE_STARTUP = 0,
+	MEM_PHASE_IDLE,
+	MEM_PHASE_CAPTURE,
+	MEM_PHASE_RESAMPLE,
+	MEM_PHASE_ENCODE,
+	MEM_PHASE_PUBLISH,
+	MEM_NUM_PHASES
+} mem_phase_t;
+
+/**
+ * @func mem_parse_profile_mode
+ * @param p_mode_string One of off, count or strict
+ * @param p_mode Parsed mode
+ * @return True if the string named a mode
+ */
+bool mem_parse_profile_mode(const char *p_mode_string, mem_profile_mode_t *p_mode);
+
+/**
+ * @func mem_profile_init
+ * @param mode Count allocations, and in strict mode log a backtrace for every
+ *             allocation after warm-up
+ * @param warmup_frames Frames after which no allocation is expected
+ */
+void mem_profile_init(mem_profile_mode_t mode, uint64_t warmup_frames);
+
+/**
+ * @func mem_set_phase
+ * @param phase Pipeline phase the calling thread's allocations are counted against
+ */
+void mem_set_phase(mem_phase_t phase);
+
+/**
+ * @func mem_frame_end
+ *
+ * Marks the end of one frame, steady state starts after the warm-up frames.
+ */
+void mem_frame_end(void);
+
+/**
+ * @func mem_profile_dump
+ *
+ * Prints calls and bytes per thread and phase, and allocations per frame since warm-up.
+ */
+void mem_profile_dump(void);
+
 #endif
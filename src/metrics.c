@@ -0,0 +1,428 @@
+//
+// Prometheus text exposition of capture and processing metrics
+//
+// Every counter and gauge has exactly one writer, the thread capturing its device,
+// so updates are a relaxed load and store with no lock or read-modify-write. The
+// server thread sleeps in accept() and only reads the values when a scrape comes
+// in, so nothing is formatted unless someone asks for it.
+//
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+/* Scrapers that stall are dropped rather than holding up the next one */
+#define MX_IO_TIMEOUT_SEC                           (1)
+#define MX_REQUEST_MAX_LENGTH                       (1024)
+
+/* Frame rate smoothing, each frame moves the average 1 / MX_FPS_SMOOTHING of the way */
+#define MX_FPS_SMOOTHING                            (8)
+
+typedef struct {
+    uint64_t counters[MX_NUM_COUNTERS];
+    int64_t gauges[MX_NUM_GAUGES];
+
+    /* Only touched by the writer */
+    uint64_t last_capture_ns;
+} mx_device_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    mx_counter_t counter;
+} mx_counter_family_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    mx_gauge_t gauge;
+    double scale;
+} mx_gauge_family_t;
+
+static const mx_counter_family_t counter_families[] = {
+    { "hawkeye_frames_total", "Frames published.", MX_FRAMES },
+    { "hawkeye_frames_dropped_total", "Frames dropped by the driver.", MX_DROPPED },
+    { "hawkeye_output_bytes_total", "JPEG bytes published.", MX_OUTPUT_BYTES },
+    { "hawkeye_features_dropped_total", "Frames published without stripe features that did not fit.",
+      MX_FEATURES_DROPPED },
+};
+
+static const mx_gauge_family_t gauge_families[] = {
+    { "hawkeye_fps", "Capture frame rate.", MX_FPS_MILLI, 1e-3 },
+    { "hawkeye_jpeg_quality", "Current JPEG quality.", MX_QUALITY, 1.0 },
+    { "hawkeye_capture_latency_seconds", "Capture to publish latency of the last frame.", MX_LATENCY_NS, 1e-9 },
+};
+
+static mx_device_t devices[MX_MAX_DEVICES];
+static unsigned int device_count = 0;
+static bool b_enabled = false;
+
+static int listen_fd = -1;
+static char listen_path[108];
+static pthread_t server_thread;
+static bool b_serving = false;
+
+static inline uint64_t mx_load_counter(uint32_t device, mx_counter_t counter) {
+    return __atomic_load_n(&devices[device].counters[counter], __ATOMIC_RELAXED);
+}
+
+static inline int64_t mx_load_gauge(uint32_t device, mx_gauge_t gauge) {
+    return __atomic_load_n(&devices[device].gauges[gauge], __ATOMIC_RELAXED);
+}
+
+void mx_add(uint32_t device, mx_counter_t counter, uint64_t value) {
+    if (!b_enabled || device >= device_count || counter >= MX_NUM_COUNTERS) {
+        return;
+    }
+
+    uint64_t *p_counter = &devices[device].counters[counter];
+
+    __atomic_store_n(p_counter, __atomic_load_n(p_counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+void mx_set(uint32_t device, mx_gauge_t gauge, int64_t value) {
+    if (!b_enabled || device >= device_count || gauge >= MX_NUM_GAUGES) {
+        return;
+    }
+
+    __atomic_store_n(&devices[device].gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+void mx_frame(uint32_t device, uint32_t dropped, uint64_t capture_ns) {
+    mx_device_t *p_device;
+
+    if (!b_enabled || device >= device_count) {
+        return;
+    }
+
+    p_device = &devices[device];
+
+    if (dropped > 0) {
+        mx_add(device, MX_DROPPED, dropped);
+    }
+
+    if (p_device->last_capture_ns != 0 && capture_ns > p_device->last_capture_ns) {
+        int64_t fps = (int64_t) (1000000000000ull / (capture_ns - p_device->last_capture_ns));
+        int64_t average = mx_load_gauge(device, MX_FPS_MILLI);
+
+        mx_set(device, MX_FPS_MILLI, (average == 0) ? fps : average + (fps - average) / MX_FPS_SMOOTHING);
+    }
+    p_device->last_capture_ns = capture_ns;
+
+    mx_add(device, MX_FRAMES, 1);
+}
+
+static size_t mx_append(char *p_buf, size_t buf_len, size_t len, const char *p_format, ...) {
+    va_list args;
+    int written;
+
+    if (len >= buf_len) {
+        return len;
+    }
+
+    va_start(args, p_format);
+    written = vsnprintf(&p_buf[len], buf_len - len, p_format, args);
+    va_end(args);
+
+    if (written < 0) {
+        return len;
+    }
+
+    return ((size_t) written < buf_len - len) ? len + written : buf_len - 1;
+}
+
+size_t mx_render(char *p_buf, size_t buf_len) {
+    size_t len = 0;
+
+    if (!p_buf || buf_len == 0) {
+        return 0;
+    }
+    p_buf[0] = 0;
+
+    for (size_t f=0; f < sizeof(counter_families) / sizeof(counter_families[0]); ++f) {
+        const mx_counter_family_t *p_family = &counter_families[f];
+
+        len = mx_append(p_buf, buf_len, len, "# HELP %s %s\n# TYPE %s counter\n",
+                        p_family->name, p_family->help, p_family->name);
+        for (uint32_t d=0; d < device_count; ++d) {
+            len = mx_append(p_buf, buf_len, len, "%s{device=\"%u\"} %llu\n", p_family->name, d,
+                            (unsigned long long) mx_load_counter(d, p_family->counter));
+        }
+    }
+
+    len = mx_append(p_buf, buf_len, len, "# HELP hawkeye_detections_total Features and blobs detected.\n"
+                                         "# TYPE hawkeye_detections_total counter\n");
+    for (uint32_t d=0; d < device_count; ++d) {
+        len = mx_append(p_buf, buf_len, len, "hawkeye_detections_total{device=\"%u\",kind=\"stripe\"} %llu\n"
+                                             "hawkeye_detections_total{device=\"%u\",kind=\"color\"} %llu\n",
+                        d, (unsigned long long) mx_load_counter(d, MX_STRIPE_FEATURES),
+                        d, (unsigned long long) mx_load_counter(d, MX_COLOR_BLOBS));
+    }
+
+    len = mx_append(p_buf, buf_len, len, "# HELP hawkeye_encode_seconds Time spent encoding frames.\n"
+                                         "# TYPE hawkeye_encode_seconds summary\n");
+    for (uint32_t d=0; d < device_count; ++d) {
+        len = mx_append(p_buf, buf_len, len, "hawkeye_encode_seconds_sum{device=\"%u\"} %.9f\n"
+                                             "hawkeye_encode_seconds_count{device=\"%u\"} %llu\n",
+                        d, mx_load_counter(d, MX_ENCODE_NS) / 1e9,
+                        d, (unsigned long long) mx_load_counter(d, MX_FRAMES));
+    }
+
+    for (size_t f=0; f < sizeof(gauge_families) / sizeof(gauge_families[0]); ++f) {
+        const mx_gauge_family_t *p_family = &gauge_families[f];
+
+        len = mx_append(p_buf, buf_len, len, "# HELP %s %s\n# TYPE %s gauge\n",
+                        p_family->name, p_family->help, p_family->name);
+        for (uint32_t d=0; d < device_count; ++d) {
+            len = mx_append(p_buf, buf_len, len, "%s{device=\"%u\"} %g\n", p_family->name, d,
+                            mx_load_gauge(d, p_family->gauge) * p_family->scale);
+        }
+    }
+
+    return len;
+}
+
+static void mx_send_all(int fd, const char *p_data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, p_data, len, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return;
+        }
+
+        p_data += sent;
+        len -= sent;
+    }
+}
+
+/* True if the request target is "/" or "/metrics", a query is allowed but nothing else */
+static bool mx_path_served(const char *p_target) {
+    size_t len = strcspn(p_target, " ?\r\n");
+
+    return (len == 1 && p_target[0] == '/') || (len == 8 && strncmp(p_target, "/metrics", 8) == 0);
+}
+
+static void mx_serve(int fd) {
+    static char request[MX_REQUEST_MAX_LENGTH];
+    static char body[MX_RENDER_MAX_LENGTH];
+    char header[256];
+    size_t request_len = 0;
+    const char *p_status = "200 OK";
+    size_t body_len;
+    int header_len;
+
+    struct timeval timeout = { .tv_sec = MX_IO_TIMEOUT_SEC, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    /* Only the request line matters, read until the end of the headers */
+    while (request_len < sizeof(request) - 1) {
+        ssize_t received = recv(fd, &request[request_len], sizeof(request) - 1 - request_len, 0);
+
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+
+        request_len += received;
+        request[request_len] = 0;
+
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+    request[request_len] = 0;
+
+    if (strncmp(request, "GET ", 4) != 0) {
+        p_status = "405 Method Not Allowed";
+        body_len = 0;
+    } else if (!mx_path_served(&request[4])) {
+        p_status = "404 Not Found";
+        body_len = 0;
+    } else {
+        body_len = mx_render(body, sizeof(body));
+    }
+
+    header_len = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\n"
+                                                  "Content-Type: text/plain; version=0.0.4\r\n"
+                                                  "Content-Length: %zu\r\n"
+                                                  "Connection: close\r\n\r\n", p_status, body_len);
+
+    mx_send_all(fd, header, header_len);
+    mx_send_all(fd, body, body_len);
+}
+
+static void *mx_server(void *p_arg) {
+    (void) p_arg;
+
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (!__atomic_load_n(&b_serving, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            perror("mx_server: accept");
+            sleep(MX_IO_TIMEOUT_SEC);
+            continue;
+        }
+
+        mx_serve(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static int mx_listen_unix(const char *p_path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(p_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long: %s\n", __func__, p_path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, p_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("mx_init: socket");
+        return -1;
+    }
+
+    unlink(p_path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("mx_init: bind");
+        close(fd);
+        return -1;
+    }
+
+    strcpy(listen_path, p_path);
+
+    return fd;
+}
+
+static int mx_listen_tcp(const char *p_port) {
+    struct sockaddr_in addr;
+    char *p_end;
+    long port = strtol(p_port, &p_end, 10);
+    int reuse = 1;
+    int fd;
+
+    if (*p_port == 0 || *p_end != 0 || port <= 0 || port > 65535) {
+        fprintf(stderr, "%s: invalid port: %s\n", __func__, p_port);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t) port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("mx_init: socket");
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("mx_init: bind");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool mx_init(const char *p_listen, unsigned int num_devices) {
+    sigset_t all_signals, old_signals;
+
+    if (!p_listen || b_serving) {
+        return false;
+    }
+
+    memset(devices, 0, sizeof(devices));
+    device_count = (num_devices > MX_MAX_DEVICES) ? MX_MAX_DEVICES : num_devices;
+    listen_path[0] = 0;
+
+    listen_fd = (p_listen[0] == '/') ? mx_listen_unix(p_listen) : mx_listen_tcp(p_listen);
+    if (listen_fd < 0) {
+        return false;
+    }
+
+    if (listen(listen_fd, 4) < 0) {
+        perror("mx_init: listen");
+        mx_destroy();
+        return false;
+    }
+
+    b_serving = true;
+
+    /* Signals are for the capture loop, the server thread starts with them blocked */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+
+    if (pthread_create(&server_thread, NULL, mx_server, NULL) != 0) {
+        pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+        fprintf(stderr, "%s: couldn't start server thread\n", __func__);
+        b_serving = false;
+        mx_destroy();
+        return false;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+    b_enabled = true;
+
+    fprintf(stdout, "%s: serving metrics on %s%s\n", __func__, (p_listen[0] == '/') ? "" : "127.0.0.1:", p_listen);
+
+    return true;
+}
+
+void mx_destroy(void) {
+    b_enabled = false;
+
+    if (b_serving) {
+        /* Wakes the server thread out of accept() */
+        __atomic_store_n(&b_serving, false, __ATOMIC_RELEASE);
+        shutdown(listen_fd, SHUT_RDWR);
+        pthread_join(server_thread, NULL);
+    }
+
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+
+    if (listen_path[0]) {
+        unlink(listen_path);
+        listen_path[0] = 0;
+    }
+}
@@ -0,0 +1,89 @@
+//
+// Prometheus text exposition of capture and processing metrics
+//
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MX_MAX_DEVICES                              (8)
+
+/* Largest rendered scrape */
+#define MX_RENDER_MAX_LENGTH                        (16384)
+
+typedef enum {
+    MX_FRAMES = 0,              /* Frames published */
+    MX_DROPPED,                 /* Frames the driver dropped, from sequence gaps */
+    MX_OUTPUT_BYTES,            /* JPEG bytes published */
+    MX_ENCODE_NS,               /* Time spent encoding */
+    MX_STRIPE_FEATURES,         /* Stripe features detected */
+    MX_FEATURES_DROPPED,        /* Frames whose stripe features did not fit in the output buffer */
+    MX_COLOR_BLOBS,             /* Color blobs detected */
+    MX_NUM_COUNTERS
+} mx_counter_t;
+
+typedef enum {
+    MX_FPS_MILLI = 0,           /* Capture rate in thousandths of a frame per second */
+    MX_QUALITY,                 /* Current JPEG quality */
+    MX_LATENCY_NS,              /* Capture to publish latency of the last frame */
+    MX_NUM_GAUGES
+} mx_gauge_t;
+
+/**
+ * @func mx_init
+ * @param p_listen Unix socket path if it starts with '/', otherwise a TCP port on localhost
+ * @param num_devices Devices that report metrics
+ * @return True if the exporter is serving
+ *
+ * Scrapes are answered from a thread of their own, the capture path only ever
+ * stores to counters.
+ */
+bool mx_init(const char *p_listen, unsigned int num_devices);
+
+/**
+ * @func mx_destroy
+ *
+ * Stops serving and closes the listening socket.
+ */
+void mx_destroy(void);
+
+/**
+ * @func mx_add
+ * @param device Device the counter belongs to
+ * @param counter Counter
+ * @param value Amount to add
+ *
+ * Each device's counters must only be updated from one thread.
+ */
+void mx_add(uint32_t device, mx_counter_t counter, uint64_t value);
+
+/**
+ * @func mx_set
+ * @param device Device the gauge belongs to
+ * @param gauge Gauge
+ * @param value New value
+ */
+void mx_set(uint32_t device, mx_gauge_t gauge, int64_t value);
+
+/**
+ * @func mx_frame
+ * @param device Device that published a frame
+ * @param dropped Frames the driver dropped before this one, as counted by telemetry
+ * @param capture_ns CLOCK_MONOTONIC capture time
+ *
+ * Counts the frame, drops before it and updates the frame rate.
+ */
+void mx_frame(uint32_t device, uint32_t dropped, uint64_t capture_ns);
+
+/**
+ * @func mx_render
+ * @param p_buf Output, NUL terminated
+ * @param buf_len Size of p_buf
+ * @return Length of the exposition text
+ */
+size_t mx_render(char *p_buf, size_t buf_len);
+
+#endif //_METRICS_H
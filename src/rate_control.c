@@ -0,0 +1,148 @@
+//
+// Closed-loop JPEG quality control
+//
+// Encoded size and encode time both fall roughly geometrically as quality drops, so
+// quality is stepped by RC_GAIN points for every factor of two the measurement is
+// away from the target. Adjustments are made once every interval frames and only
+// when the measurement is outside the dead-band, to avoid hunting.
+//
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rate_control.h"
+
+bool rc_parse_mode(const char *p_mode_string, rc_mode_t *p_mode) {
+    if (!p_mode_string || !p_mode) {
+        return false;
+    }
+
+    if (strcmp(p_mode_string, "off") == 0) {
+        *p_mode = RC_MODE_OFF;
+    } else if (strcmp(p_mode_string, "frame-bytes") == 0) {
+        *p_mode = RC_MODE_FRAME_BYTES;
+    } else if (strcmp(p_mode_string, "second-bytes") == 0) {
+        *p_mode = RC_MODE_SECOND_BYTES;
+    } else if (strcmp(p_mode_string, "frame-ms") == 0) {
+        *p_mode = RC_MODE_FRAME_MS;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+void rc_init(rc_state_t *p_state, rc_mode_t mode, int target, int interval, int quality) {
+    if (!p_state) {
+        return;
+    }
+
+    memset(p_state, 0, sizeof(rc_state_t));
+
+    p_state->mode = (target > 0) ? mode : RC_MODE_OFF;
+    p_state->target = target;
+    p_state->interval = (interval < 1) ? 1 : interval;
+    p_state->max_quality = quality;
+    p_state->min_quality = (quality < RC_MIN_QUALITY) ? quality : RC_MIN_QUALITY;
+    p_state->quality = quality;
+    p_state->window_start = -1.0;
+}
+
+/* Measurement over the window, in the units of the target */
+static double rc_measure(rc_state_t *p_state, double now) {
+    switch (p_state->mode) {
+        case RC_MODE_FRAME_BYTES:
+            return (double) p_state->window_bytes / p_state->window_frames;
+        case RC_MODE_SECOND_BYTES:
+            if (now <= p_state->window_start) {
+                return -1.0;
+            }
+            return (double) p_state->window_bytes / (now - p_state->window_start);
+        case RC_MODE_FRAME_MS:
+            return (p_state->window_encode_time * 1000.0) / p_state->window_frames;
+        default:
+            return -1.0;
+    }
+}
+
+bool rc_update(rc_state_t *p_state, size_t frame_bytes, double encode_time, double now) {
+    if (!p_state || p_state->mode == RC_MODE_OFF) {
+        return false;
+    }
+
+    p_state->frames++;
+
+    /* The byte rate is measured from the end of the previous window */
+    if (p_state->window_start < 0.0) {
+        p_state->window_start = now;
+        if (p_state->mode == RC_MODE_SECOND_BYTES) {
+            return false;
+        }
+    }
+
+    p_state->window_frames++;
+    p_state->window_bytes += frame_bytes;
+    p_state->window_encode_time += encode_time;
+
+    if (p_state->window_frames < p_state->interval) {
+        return false;
+    }
+
+    double measured = rc_measure(p_state, now);
+
+    p_state->window_frames = 0;
+    p_state->window_bytes = 0;
+    p_state->window_encode_time = 0.0;
+    p_state->window_start = now;
+
+    if (measured <= 0.0) {
+        return false;
+    }
+
+    p_state->last_measured = measured;
+
+    double ratio = measured / p_state->target;
+
+    if (fabs(ratio - 1.0) < RC_DEADBAND) {
+        return false;
+    }
+
+    int step = (int) lround(-RC_GAIN * log2(ratio));
+
+    if (step == 0) {
+        step = (ratio > 1.0) ? -1 : 1;
+    }
+    if (step > RC_MAX_STEP) {
+        step = RC_MAX_STEP;
+    }
+    if (step < -RC_MAX_STEP) {
+        step = -RC_MAX_STEP;
+    }
+
+    int quality = p_state->quality + step;
+
+    if (quality > p_state->max_quality) {
+        quality = p_state->max_quality;
+    }
+    if (quality < p_state->min_quality) {
+        quality = p_state->min_quality;
+    }
+
+    if (quality == p_state->quality) {
+        return false;
+    }
+
+    p_state->last_decision.frame = p_state->frames;
+    p_state->last_decision.prev_quality = p_state->quality;
+    p_state->last_decision.quality = quality;
+    p_state->last_decision.measured = measured;
+    p_state->last_decision.target = p_state->target;
+    p_state->adjustments++;
+
+    p_state->quality = quality;
+
+    printf("%s: frame %llu quality %d -> %d (measured %.1f, target %.1f)\n", __func__,
+           (unsigned long long) p_state->frames, p_state->last_decision.prev_quality, quality, measured, p_state->target);
+
+    return true;
+}
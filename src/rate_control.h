@@ -0,0 +1,89 @@
+//
+// Closed-loop JPEG quality control
+//
+
+#ifndef _RATE_CONTROL_H
+#define _RATE_CONTROL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Lowest quality the controller will select */
+#define RC_MIN_QUALITY                              (10)
+
+/* Relative error inside which quality is left alone */
+#define RC_DEADBAND                                 (0.05)
+
+/* Quality points per factor of two of error, and the largest single step */
+#define RC_GAIN                                     (12.0)
+#define RC_MAX_STEP                                 (10)
+
+typedef enum {
+    RC_MODE_OFF = 0,
+    RC_MODE_FRAME_BYTES,
+    RC_MODE_SECOND_BYTES,
+    RC_MODE_FRAME_MS
+} rc_mode_t;
+
+/* Most recent controller decision, kept for monitoring */
+typedef struct {
+    uint64_t frame;
+    int prev_quality;
+    int quality;
+    double measured;
+    double target;
+} rc_decision_t;
+
+typedef struct {
+    rc_mode_t mode;
+    double target;
+    int interval;
+    int min_quality;
+    int max_quality;
+
+    /* Quality to encode the next frame with */
+    int quality;
+
+    /* Measurements over the current interval */
+    int window_frames;
+    size_t window_bytes;
+    double window_encode_time;
+    double window_start;
+
+    /* Monitoring */
+    uint64_t frames;
+    uint64_t adjustments;
+    double last_measured;
+    rc_decision_t last_decision;
+} rc_state_t;
+
+/**
+ * @func rc_parse_mode
+ * @param p_mode_string One of off, frame-bytes, second-bytes or frame-ms
+ * @param p_mode Parsed mode
+ * @return True if the string named a mode
+ */
+bool rc_parse_mode(const char *p_mode_string, rc_mode_t *p_mode);
+
+/**
+ * @func rc_init
+ * @param p_state Controller to initialize
+ * @param mode What the target is measured in
+ * @param target Bytes per frame, bytes per second or milliseconds per frame
+ * @param interval Number of frames between quality adjustments
+ * @param quality Starting quality, also the highest quality that will be selected
+ */
+void rc_init(rc_state_t *p_state, rc_mode_t mode, int target, int interval, int quality);
+
+/**
+ * @func rc_update
+ * @param p_state Controller state
+ * @param frame_bytes Size of the encoded frame, as counted by the JPEG destination
+ * @param encode_time Time spent encoding the frame, in seconds
+ * @param now Current time in seconds
+ * @return True if p_state->quality was changed
+ */
+bool rc_update(rc_state_t *p_state, size_t frame_bytes, double encode_time, double now);
+
+#endif //_RATE_CONTROL_H
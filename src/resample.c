@@ -0,0 +1,397 @@
+//
+// Pre-encode downscaling by pixel binning
+//
+// Rows are reduced vertically into a row accumulator first, which is the only pass
+// that touches every source byte and is vectorized for SSE2 and NEON. The horizontal
+// reduction then runs over the accumulator at 1/factor of the source rows.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "memory.h"
+#include "resample.h"
+
+/* Largest bin, in samples */
+#define RS_MAX_BIN_SAMPLES                          (RS_FACTOR_MAX * RS_FACTOR_MAX)
+
+bool rs_parse_z16_mode(const char *p_mode_string, rs_z16_mode_t *p_mode) {
+    if (!p_mode_string || !p_mode) {
+        return false;
+    }
+
+    if (strcmp(p_mode_string, "min") == 0) {
+        *p_mode = RS_Z16_MIN;
+    } else if (strcmp(p_mode_string, "median") == 0) {
+        *p_mode = RS_Z16_MEDIAN;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool rs_init(rs_state_t *p_state, int factor, rs_z16_mode_t z16_mode, unsigned int max_width, unsigned int max_height) {
+    if (!p_state) {
+        return false;
+    }
+
+    memset(p_state, 0, sizeof(rs_state_t));
+
+    p_state->factor = RS_FACTOR_NONE;
+    p_state->z16_mode = z16_mode;
+
+    if (factor != RS_FACTOR_NONE && factor != 2 && factor != RS_FACTOR_MAX) {
+        return false;
+    }
+
+    p_state->factor = factor;
+
+    if (factor == RS_FACTOR_NONE) {
+        return true;
+    }
+
+    p_state->buf_size = (size_t) (max_width / factor) * (max_height / factor) * 2;
+    p_state->p_buf = malloc(p_state->buf_size);
+
+    p_state->acc_len = (size_t) max_width * 2;
+    p_state->p_acc = malloc(p_state->acc_len * sizeof(uint16_t));
+
+    return true;
+}
+
+void rs_destroy(rs_state_t *p_state) {
+    if (!p_state) {
+        return;
+    }
+
+    free(p_state->p_buf);
+    p_state->p_buf = NULL;
+
+    free(p_state->p_acc);
+    p_state->p_acc = NULL;
+}
+
+/* p_acc[i] += p_row[i] */
+static void rs_accumulate_row(uint16_t *p_acc, const uint8_t *p_row, size_t len) {
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) &p_row[i]);
+        __m128i a_lo = _mm_loadu_si128((const __m128i *) &p_acc[i]);
+        __m128i a_hi = _mm_loadu_si128((const __m128i *) &p_acc[i + 8]);
+
+        _mm_storeu_si128((__m128i *) &p_acc[i], _mm_add_epi16(a_lo, _mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128((__m128i *) &p_acc[i + 8], _mm_add_epi16(a_hi, _mm_unpackhi_epi8(v, zero)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= len; i += 8) {
+        vst1q_u16(&p_acc[i], vaddw_u8(vld1q_u16(&p_acc[i]), vld1_u8(&p_row[i])));
+    }
+#endif
+
+    for (; i < len; ++i) {
+        p_acc[i] += p_row[i];
+    }
+}
+
+/* p_acc[i] = min(p_acc[i], p_row[i] - 1). Subtracting one wraps invalid zero samples
+ * to 0xFFFF so they lose every comparison; adding one back restores them.
+ */
+static void rs_min_row(uint16_t *p_acc, const uint8_t *p_row, size_t len) {
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i bias = _mm_set1_epi16((short) 0x8000);
+
+    for (; i + 8 <= len; i += 8) {
+        __m128i v = _mm_sub_epi16(_mm_loadu_si128((const __m128i *) &p_row[i * 2]), one);
+        __m128i a = _mm_loadu_si128((const __m128i *) &p_acc[i]);
+
+        /* SSE2 only has a signed 16-bit minimum, bias both sides into signed range */
+        __m128i m = _mm_min_epi16(_mm_xor_si128(v, bias), _mm_xor_si128(a, bias));
+        _mm_storeu_si128((__m128i *) &p_acc[i], _mm_xor_si128(m, bias));
+    }
+#elif defined(__ARM_NEON)
+    const uint16x8_t one = vdupq_n_u16(1);
+
+    for (; i + 8 <= len; i += 8) {
+        uint16x8_t v = vsubq_u16(vreinterpretq_u16_u8(vld1q_u8(&p_row[i * 2])), one);
+        vst1q_u16(&p_acc[i], vminq_u16(vld1q_u16(&p_acc[i]), v));
+    }
+#endif
+
+    for (; i < len; ++i) {
+        uint16_t v = (uint16_t) ((p_row[i * 2] | (p_row[i * 2 + 1] << 8)) - 1);
+
+        if (v < p_acc[i]) {
+            p_acc[i] = v;
+        }
+    }
+}
+
+/* Packed 4:2:2, luma at y_off and y_off + 2 of each macropixel, chroma at c_off and c_off + 2 */
+static void rs_bin_yuv422(rs_state_t *p_state, const uint8_t *p_src, size_t src_stride,
+                          unsigned int out_width, unsigned int out_height, int y_off, int c_off) {
+    const int f = p_state->factor;
+    const int shift = (f == 2) ? 2 : 4;
+    const int round = 1 << (shift - 1);
+    const size_t acc_len = (size_t) out_width * f * 2;
+    uint8_t *p_out = p_state->p_buf;
+
+    for (unsigned int oy=0; oy < out_height; ++oy) {
+        memset(p_state->p_acc, 0, acc_len * sizeof(uint16_t));
+
+        for (int r=0; r < f; ++r) {
+            rs_accumulate_row(p_state->p_acc, &p_src[(size_t) (oy * f + r) * src_stride], acc_len);
+        }
+
+        const uint16_t *p_acc = p_state->p_acc;
+
+        /* Each output macropixel covers 2 * f source pixels, i.e. f source macropixels */
+        for (unsigned int om=0; om < out_width / 2; ++om) {
+            uint32_t y0 = 0, y1 = 0, u = 0, v = 0;
+
+            for (int k=0; k < f; ++k) {
+                const uint16_t *p_mp = &p_acc[(om * f + k) * 4];
+
+                if (k < f / 2) {
+                    y0 += p_mp[y_off] + p_mp[y_off + 2];
+                } else {
+                    y1 += p_mp[y_off] + p_mp[y_off + 2];
+                }
+                u += p_mp[c_off];
+                v += p_mp[c_off + 2];
+            }
+
+            p_out[y_off] = (uint8_t) ((y0 + round) >> shift);
+            p_out[c_off] = (uint8_t) ((u + round) >> shift);
+            p_out[y_off + 2] = (uint8_t) ((y1 + round) >> shift);
+            p_out[c_off + 2] = (uint8_t) ((v + round) >> shift);
+            p_out += 4;
+        }
+    }
+}
+
+/* 8-bit samples with components interleaved per pixel (1 for GREY and NV12 luma, 2 for NV12 chroma),
+ * each component box-filtered over factor x factor pixels
+ */
+static void rs_bin_bytes(rs_state_t *p_state, const uint8_t *p_src, size_t src_stride, uint8_t *p_out,
+                         unsigned int out_width, unsigned int out_height, int components) {
+    const int f = p_state->factor;
+    const int shift = (f == 2) ? 2 : 4;
+    const int round = 1 << (shift - 1);
+    const size_t acc_len = (size_t) out_width * f * components;
+
+    for (unsigned int oy=0; oy < out_height; ++oy) {
+        memset(p_state->p_acc, 0, acc_len * sizeof(uint16_t));
+
+        for (int r=0; r < f; ++r) {
+            rs_accumulate_row(p_state->p_acc, &p_src[(size_t) (oy * f + r) * src_stride], acc_len);
+        }
+
+        const uint16_t *p_acc = p_state->p_acc;
+
+        for (unsigned int ox=0; ox < out_width; ++ox) {
+            for (int c=0; c < components; ++c) {
+                uint32_t sum = 0;
+
+                for (int k=0; k < f; ++k) {
+                    sum += p_acc[(ox * f + k) * components + c];
+                }
+
+                *p_out++ = (uint8_t) ((sum + round) >> shift);
+            }
+        }
+    }
+}
+
+/* 16-bit grey, the bin sums don't fit the row accumulator so bins are summed directly */
+static void rs_bin_y16(rs_state_t *p_state, const uint8_t *p_src, size_t src_stride,
+                       unsigned int out_width, unsigned int out_height) {
+    const int f = p_state->factor;
+    const int shift = (f == 2) ? 2 : 4;
+    const uint32_t round = 1u << (shift - 1);
+    uint8_t *p_out = p_state->p_buf;
+
+    for (unsigned int oy=0; oy < out_height; ++oy) {
+        for (unsigned int ox=0; ox < out_width; ++ox) {
+            uint32_t sum = 0;
+
+            for (int r=0; r < f; ++r) {
+                const uint8_t *p_row = &p_src[(size_t) (oy * f + r) * src_stride + (size_t) ox * f * 2];
+
+                for (int c=0; c < f; ++c) {
+                    sum += p_row[c * 2] | (p_row[c * 2 + 1] << 8);
+                }
+            }
+
+            uint16_t m = (uint16_t) ((sum + round) >> shift);
+            *p_out++ = m & 0xFF;
+            *p_out++ = m >> 8;
+        }
+    }
+}
+
+static void rs_bin_z16_min(rs_state_t *p_state, const uint8_t *p_src, size_t src_stride,
+                           unsigned int out_width, unsigned int out_height) {
+    const int f = p_state->factor;
+    const size_t acc_len = (size_t) out_width * f;
+    uint8_t *p_out = p_state->p_buf;
+
+    for (unsigned int oy=0; oy < out_height; ++oy) {
+        memset(p_state->p_acc, 0xFF, acc_len * sizeof(uint16_t));
+
+        for (int r=0; r < f; ++r) {
+            rs_min_row(p_state->p_acc, &p_src[(size_t) (oy * f + r) * src_stride], acc_len);
+        }
+
+        const uint16_t *p_acc = p_state->p_acc;
+
+        for (unsigned int ox=0; ox < out_width; ++ox) {
+            uint16_t m = 0xFFFF;
+
+            for (int k=0; k < f; ++k) {
+                if (p_acc[ox * f + k] < m) {
+                    m = p_acc[ox * f + k];
+                }
+            }
+
+            m += 1;
+            *p_out++ = m & 0xFF;
+            *p_out++ = m >> 8;
+        }
+    }
+}
+
+/* Lower median of the valid samples, so ties fall on the nearer surface */
+static void rs_bin_z16_median(rs_state_t *p_state, const uint8_t *p_src, size_t src_stride,
+                              unsigned int out_width, unsigned int out_height) {
+    const int f = p_state->factor;
+    uint8_t *p_out = p_state->p_buf;
+    uint16_t samples[RS_MAX_BIN_SAMPLES];
+
+    for (unsigned int oy=0; oy < out_height; ++oy) {
+        for (unsigned int ox=0; ox < out_width; ++ox) {
+            int n = 0;
+
+            for (int r=0; r < f; ++r) {
+                const uint8_t *p_row = &p_src[(size_t) (oy * f + r) * src_stride + (size_t) ox * f * 2];
+
+                for (int c=0; c < f; ++c) {
+                    uint16_t v = p_row[c * 2] | (p_row[c * 2 + 1] << 8);
+
+                    if (v == 0) {
+                        continue;
+                    }
+
+                    /* Insertion sort, at most 16 samples */
+                    int j = n++;
+                    while (j > 0 && samples[j - 1] > v) {
+                        samples[j] = samples[j - 1];
+                        j--;
+                    }
+                    samples[j] = v;
+                }
+            }
+
+            uint16_t m = (n == 0) ? 0 : samples[(n - 1) / 2];
+            *p_out++ = m & 0xFF;
+            *p_out++ = m >> 8;
+        }
+    }
+}
+
+bool rs_format_supported(uint32_t format) {
+    switch (format) {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV12M:
+        case V4L2_PIX_FMT_GREY:
+        case V4L2_PIX_FMT_Y16:
+        case V4L2_PIX_FMT_Z16:
+            return true;
+        default:
+            return false;
+    }
+}
+
+size_t rs_resample(rs_state_t *p_state, uint32_t format, const uint8_t *p_src, size_t src_stride,
+                   const uint8_t *p_src_chroma, size_t src_chroma_stride, unsigned int width, unsigned int height,
+                   unsigned int *p_out_width, unsigned int *p_out_height) {
+    if (!p_state || !p_src || !p_out_width || !p_out_height || p_state->factor == RS_FACTOR_NONE) {
+        return 0;
+    }
+
+    const int f = p_state->factor;
+    unsigned int out_width = width / f;
+    unsigned int out_height = height / f;
+    size_t out_size;
+
+    if ((size_t) width * 2 > p_state->acc_len) {
+        return 0;
+    }
+
+    p_state->p_chroma = NULL;
+
+    switch (format) {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+            /* Whole output macropixels only */
+            out_width &= ~1u;
+            if (format == V4L2_PIX_FMT_UYVY) {
+                rs_bin_yuv422(p_state, p_src, src_stride, out_width, out_height, 1, 0);
+            } else {
+                rs_bin_yuv422(p_state, p_src, src_stride, out_width, out_height, 0, 1);
+            }
+            out_size = (size_t) out_width * out_height * 2;
+            break;
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV12M:
+            if (!p_src_chroma) {
+                return 0;
+            }
+            /* Whole chroma samples only, the chroma plane follows the luma plane at out_width stride */
+            out_width &= ~1u;
+            out_height &= ~1u;
+            p_state->p_chroma = p_state->p_buf + (size_t) out_width * out_height;
+            rs_bin_bytes(p_state, p_src, src_stride, p_state->p_buf, out_width, out_height, 1);
+            rs_bin_bytes(p_state, p_src_chroma, src_chroma_stride, p_state->p_chroma, out_width / 2, out_height / 2, 2);
+            out_size = (size_t) out_width * out_height * 3 / 2;
+            break;
+        case V4L2_PIX_FMT_GREY:
+            rs_bin_bytes(p_state, p_src, src_stride, p_state->p_buf, out_width, out_height, 1);
+            out_size = (size_t) out_width * out_height;
+            break;
+        case V4L2_PIX_FMT_Y16:
+            rs_bin_y16(p_state, p_src, src_stride, out_width, out_height);
+            out_size = (size_t) out_width * out_height * 2;
+            break;
+        case V4L2_PIX_FMT_Z16:
+            if (p_state->z16_mode == RS_Z16_MEDIAN) {
+                rs_bin_z16_median(p_state, p_src, src_stride, out_width, out_height);
+            } else {
+                rs_bin_z16_min(p_state, p_src, src_stride, out_width, out_height);
+            }
+            out_size = (size_t) out_width * out_height * 2;
+            break;
+        default:
+            return 0;
+    }
+
+    *p_out_width = out_width;
+    *p_out_height = out_height;
+
+    return out_size;
+}
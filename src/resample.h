@@ -0,0 +1,90 @@
+//
+// Pre-encode downscaling by pixel binning
+//
+
+#ifndef _RESAMPLE_H
+#define _RESAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Supported binning factors */
+#define RS_FACTOR_NONE                              (1)
+#define RS_FACTOR_MAX                               (4)
+
+typedef enum {
+    RS_Z16_MIN = 0,
+    RS_Z16_MEDIAN
+} rs_z16_mode_t;
+
+typedef struct {
+    int factor;
+    rs_z16_mode_t z16_mode;
+
+    /* Binned output frame, and its chroma plane for NV12 (out_width stride, after the luma) */
+    uint8_t *p_buf;
+    size_t buf_size;
+    uint8_t *p_chroma;
+
+    /* One row of per-column vertical sums (8-bit formats) or minimums (Z16) */
+    uint16_t *p_acc;
+    size_t acc_len;
+} rs_state_t;
+
+/**
+ * @func rs_parse_z16_mode
+ * @param p_mode_string min or median
+ * @param p_mode Parsed mode
+ * @return True if the string named a mode
+ */
+bool rs_parse_z16_mode(const char *p_mode_string, rs_z16_mode_t *p_mode);
+
+/**
+ * @func rs_init
+ * @param p_state State to initialize
+ * @param factor Binning factor, 1 (off), 2 or 4
+ * @param z16_mode How depth bins are reduced
+ * @param max_width Widest frame that will be binned
+ * @param max_height Tallest frame that will be binned
+ * @return True if the factor is supported
+ */
+bool rs_init(rs_state_t *p_state, int factor, rs_z16_mode_t z16_mode, unsigned int max_width, unsigned int max_height);
+
+/**
+ * @func rs_destroy
+ * @param p_state State to release
+ */
+void rs_destroy(rs_state_t *p_state);
+
+/**
+ * @func rs_format_supported
+ * @param format V4L2 pixel format
+ * @return True if rs_resample() can bin the format
+ */
+bool rs_format_supported(uint32_t format);
+
+/**
+ * @func rs_resample
+ * @param p_state Binning state, output is written to p_state->p_buf
+ * @param format V4L2 pixel format of the source, see rs_format_supported()
+ * @param p_src First byte of the source frame, the luma plane for NV12
+ * @param src_stride Bytes between the starts of consecutive source rows
+ * @param p_src_chroma First byte of the NV12 chroma plane, NULL for packed formats
+ * @param src_chroma_stride Bytes between the starts of consecutive chroma rows
+ * @param width Source width in pixels
+ * @param height Source height in pixels
+ * @param p_out_width Binned width in pixels
+ * @param p_out_height Binned height in pixels
+ * @return Size of the binned frame in bytes, 0 if the format is not supported
+ *
+ * YUYV and UYVY are box-filtered, with luma binned over factor x factor pixels and chroma
+ * over the matching 2 * factor x factor area. NV12 planes, GREY and Y16 are box-filtered
+ * per sample, the NV12 output chroma plane is at p_state->p_chroma. Z16 zero (invalid)
+ * samples are ignored; a bin with no valid samples stays zero.
+ */
+size_t rs_resample(rs_state_t *p_state, uint32_t format, const uint8_t *p_src, size_t src_stride,
+                   const uint8_t *p_src_chroma, size_t src_chroma_stride, unsigned int width, unsigned int height,
+                   unsigned int *p_out_width, unsigned int *p_out_height);
+
+#endif //_RESAMPLE_H
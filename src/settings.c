@@ -9,6 +9,10 @@
 #include "version.h"
 #include "config.h"
 #include "utils.h"
+#include "rate_control.h"
+#include "resample.h"
+#include "telemetry.h"
+#include "color_detect.h"
 
 #include "settings.h"
 
@@ -35,7 +39,12 @@ void print_usage() {
     fprintf(stdout, "       [-H height] [-j jpeg-quality] [-L log-level] [-f format] [-A user:pass]\n");
     fprintf(stdout, "       [-r file-root] [-b base_file_name] [-m mm-scale] [-P profile-fps]\n");
     fprintf(stdout, "       [-T detect-tolerance-percent] [-Q write-detect-image]\n");
-    fprintf(stdout, "       [-S enable-stripe-detect]\n");
+    fprintf(stdout, "       [-S enable-stripe-detect] [-O huffman-warmup-frames] [-a]\n");
+    fprintf(stdout, "       [-C rate-control] [-t rate-target] [-N rate-interval]\n");
+    fprintf(stdout, "       [-B downscale] [-Z z16-binning] [-c crop] [-n] [-x export-socket] [-U]\n");
+    fprintf(stdout, "       [-k telemetry-window] [-E metrics-listen] [-G trace-file]\n");
+    fprintf(stdout, "       [-X alloc-profile] [-e] [-K detect-colors] [-M min-detect-conf]\n");
+    fprintf(stdout, "       [-J detect-stride] [-R] [-V detect-full-scan] [-o detect-coarse] [-p detect-threads]\n");
     fprintf(stdout, "\n");
     fprintf(stdout, "Usage: %s [--daemon]\n", program_name);
     fprintf(stdout, "       [--pid=path] [--log=path] [--user=user] [--group=group]\n");
@@ -44,6 +53,15 @@ void print_usage() {
     fprintf(stdout, "       [--file-root=file-root] [--base-file-name=base-file-name]\n");
     fprintf(stdout, "       [--mm-scale=mm_scale] [--profile-fps=profile-fps]\n");
     fprintf(stdout, "       [--write-detect-image] [--enable-stripe-detect]\n");
+    fprintf(stdout, "       [--huffman-warmup=frames] [--abbreviated-jpeg]\n");
+    fprintf(stdout, "       [--rate-control=mode] [--rate-target=target] [--rate-interval=frames]\n");
+    fprintf(stdout, "       [--downscale=factor] [--z16-binning=mode] [--crop=x,y,width,height]\n");
+    fprintf(stdout, "       [--negotiate-format] [--export-socket=path] [--userptr]\n");
+    fprintf(stdout, "       [--telemetry-window=frames] [--metrics-listen=port|path]\n");
+    fprintf(stdout, "       [--trace-file=path] [--alloc-profile=mode]\n");
+    fprintf(stdout, "       [--enable-color-detect] [--detect-colors=#RRGGBB,...] [--detect-tolerance=percent]\n");
+    fprintf(stdout, "       [--min-detect-conf=conf] [--detect-stride=frames] [--detect-tracking]\n");
+    fprintf(stdout, "       [--detect-full-scan=frames] [--detect-coarse=decimation] [--detect-threads=threads]\n");
 
     fprintf(stdout, "Usage: %s [-h]\n", program_name);
     fprintf(stdout, "Usage: %s [-v]\n", program_name);
@@ -51,12 +69,40 @@ void print_usage() {
     fprintf(stdout, "devices is a : separated list of video devices, such as\n");
     fprintf(stdout, "for example \"/dev/video0:/dev/video1\".\n");
     fprintf(stdout, "log-level can be debug, info, warning, or error.\n");
-    fprintf(stdout, "format can be yuv or z16.  Output file is jpg\n");
+    fprintf(stdout, "format can be yuv, uyvy, nv12, grey, y16, z16 or mjpeg.  Output file is jpg\n");
+    fprintf(stdout, "negotiate-format picks the cheapest device format that meets width, height and fps, keeping\n");
+    fprintf(stdout, "the kind of image format gives: color, grey or depth.\n");
+    fprintf(stdout, "huffman-warmup builds Huffman tables from the first N frames and reuses them.\n");
+    fprintf(stdout, "abbreviated-jpeg omits tables from frames; they are written once to base-file-name.tables.jpg\n");
+    fprintf(stdout, "rate-control can be off, frame-bytes, second-bytes or frame-ms. Quality is adjusted\n");
+    fprintf(stdout, "every rate-interval frames to meet rate-target, never going above quality.\n");
+    fprintf(stdout, "downscale can be 1, 2 or 4; frames are binned before encoding and detection, except mjpeg.\n");
+    fprintf(stdout, "z16-binning can be min or median; zero depth samples are ignored.\n");
+    fprintf(stdout, "crop is done by the device when it supports it, in software otherwise.\n");
+    fprintf(stdout, "export-socket shares raw capture buffers as dmabuf fds with local processes.\n");
+    fprintf(stdout, "userptr captures into a locked huge page pool that also holds the processing buffers.\n");
+    fprintf(stdout, "telemetry-window reports dropped frames and capture to publish latency over the last N frames,\n");
+    fprintf(stdout, "  sliding by N/%d frames between reports.\n", TM_REPORTS_PER_WINDOW);
+    fprintf(stdout, "metrics-listen serves Prometheus metrics on a localhost TCP port, or a Unix socket given a path.\n");
+    fprintf(stdout, "trace-file records per-frame stage spans, written as Chrome trace-event JSON on SIGUSR1 and at exit.\n");
+    fprintf(stdout, "alloc-profile can be off, count or strict. count reports allocations per thread and phase\n");
+    fprintf(stdout, "on SIGUSR1 and at exit; strict also logs a backtrace for every allocation after warm-up.\n");
+    fprintf(stdout, "enable-color-detect finds blobs of detect-colors in yuv and uyvy frames every detect-stride frames,\n");
+    fprintf(stdout, "written to base-file-name.blobs after a line with the frame's capture record.\n");
+    fprintf(stdout, "min-detect-conf is the smallest blob in 10,000ths of the frame.\n");
+    fprintf(stdout, "detect-tracking only scans around known blobs, and the whole frame every detect-full-scan frames.\n");
+    fprintf(stdout, "detect-coarse can be 2, 4 or 8 to find blobs on a decimated grid first. Blobs are only certain to be\n");
+    fprintf(stdout, "  found when they hold a solid decimation x decimation square; thinner ones can be missed at any size.\n");
+    fprintf(stdout, "detect-threads splits full-frame scans across up to %d threads.\n", DETECT_MAX_THREADS);
 }
 
 void init_settings(int argc, char *argv[]) {
     struct config *conf;
     char *v4l2_format;
+    char *rate_control;
+    char *z16_binning;
+    char *crop;
+    char *alloc_profile;
     short display_version, display_usage;
 
     conf = create_config();
@@ -66,6 +112,30 @@ void init_settings(int argc, char *argv[]) {
     add_config_item(conf, 'P', "profile-fps", CONFIG_INT, &settings.profile_fps, DEFAULT_PROFILE_FPS);
     add_config_item(conf, 'Q', "write-detect-image", CONFIG_BOOL, &settings.write_detect_image, "0");
     add_config_item(conf, 'S', "enable-stripe-detect", CONFIG_BOOL, &settings.enable_stripe_detect, DEFAULT_ENABLE_STRIPE_DETECT);
+    add_config_item(conf, 'O', "huffman-warmup", CONFIG_INT, &settings.huffman_warmup, DEFAULT_HUFFMAN_WARMUP);
+    add_config_item(conf, 'a', "abbreviated-jpeg", CONFIG_BOOL, &settings.abbreviated_jpeg, DEFAULT_ABBREVIATED_JPEG);
+    add_config_item(conf, 'C', "rate-control", CONFIG_STR, &rate_control, DEFAULT_RATE_CONTROL);
+    add_config_item(conf, 't', "rate-target", CONFIG_INT, &settings.rate_target, DEFAULT_RATE_TARGET);
+    add_config_item(conf, 'N', "rate-interval", CONFIG_INT, &settings.rate_interval, DEFAULT_RATE_INTERVAL);
+    add_config_item(conf, 'B', "downscale", CONFIG_INT, &settings.downscale, DEFAULT_DOWNSCALE);
+    add_config_item(conf, 'Z', "z16-binning", CONFIG_STR, &z16_binning, DEFAULT_Z16_BINNING);
+    add_config_item(conf, 'c', "crop", CONFIG_STR, &crop, DEFAULT_CROP);
+    add_config_item(conf, 'n', "negotiate-format", CONFIG_BOOL, &settings.negotiate_format, DEFAULT_NEGOTIATE_FORMAT);
+    add_config_item(conf, 'x', "export-socket", CONFIG_STR, &settings.export_socket, DEFAULT_EXPORT_SOCKET);
+    add_config_item(conf, 'U', "userptr", CONFIG_BOOL, &settings.userptr, DEFAULT_USERPTR);
+    add_config_item(conf, 'k', "telemetry-window", CONFIG_INT, &settings.telemetry_window, DEFAULT_TELEMETRY_WINDOW);
+    add_config_item(conf, 'E', "metrics-listen", CONFIG_STR, &settings.metrics_listen, DEFAULT_METRICS_LISTEN);
+    add_config_item(conf, 'G', "trace-file", CONFIG_STR, &settings.trace_file, DEFAULT_TRACE_FILE);
+    add_config_item(conf, 'X', "alloc-profile", CONFIG_STR, &alloc_profile, DEFAULT_ALLOC_PROFILE);
+    add_config_item(conf, 'e', "enable-color-detect", CONFIG_BOOL, &settings.enable_color_detect, DEFAULT_ENABLE_COLOR_DETECT);
+    add_config_item(conf, 'K', "detect-colors", CONFIG_STR, &settings.detect_colors, DEFAULT_DETECT_COLORS);
+    add_config_item(conf, 'T', "detect-tolerance", CONFIG_INT, &settings.detect_tolerance, DEFAULT_DETECT_TOLERANCE);
+    add_config_item(conf, 'M', "min-detect-conf", CONFIG_INT, &settings.min_detect_conf, DEFAULT_MIN_DETECT_CONF);
+    add_config_item(conf, 'J', "detect-stride", CONFIG_INT, &settings.detect_stride, DEFAULT_DETECT_STRIDE);
+    add_config_item(conf, 'R', "detect-tracking", CONFIG_BOOL, &settings.detect_tracking, DEFAULT_DETECT_TRACKING);
+    add_config_item(conf, 'V', "detect-full-scan", CONFIG_INT, &settings.detect_full_scan, DEFAULT_DETECT_FULL_SCAN);
+    add_config_item(conf, 'o', "detect-coarse", CONFIG_INT, &settings.detect_coarse, DEFAULT_DETECT_COARSE);
+    add_config_item(conf, 'p', "detect-threads", CONFIG_INT, &settings.detect_threads, DEFAULT_DETECT_THREADS);
     add_config_item(conf, 'W', "width", CONFIG_INT, &settings.width, DEFAULT_WIDTH);
     add_config_item(conf, 'H', "height", CONFIG_INT, &settings.height, DEFAULT_HEIGHT);
     add_config_item(conf, 'm', "mm-scale", CONFIG_INT, &settings.mm_scale, DEFAULT_MM_SCALE);
@@ -93,6 +163,68 @@ void init_settings(int argc, char *argv[]) {
     if (strcmp(v4l2_format, "z16") == 0) {
         settings.v4l2_format = V4L2_PIX_FMT_Z16;
     }
+    if (strcmp(v4l2_format, "mjpeg") == 0) {
+        settings.v4l2_format = V4L2_PIX_FMT_MJPEG;
+    }
+    if (strcmp(v4l2_format, "uyvy") == 0) {
+        settings.v4l2_format = V4L2_PIX_FMT_UYVY;
+    }
+    if (strcmp(v4l2_format, "nv12") == 0) {
+        settings.v4l2_format = V4L2_PIX_FMT_NV12;
+    }
+    if (strcmp(v4l2_format, "grey") == 0) {
+        settings.v4l2_format = V4L2_PIX_FMT_GREY;
+    }
+    if (strcmp(v4l2_format, "y16") == 0) {
+        settings.v4l2_format = V4L2_PIX_FMT_Y16;
+    }
+
+    // Set rate control mode
+    rc_mode_t rc_mode;
+    if (!rc_parse_mode(rate_control, &rc_mode)) {
+        user_panic("Unknown rate-control mode: %s.", rate_control);
+    }
+    settings.rate_control = rc_mode;
+    free(rate_control);
+
+    // Set depth binning mode
+    rs_z16_mode_t z16_mode;
+    if (!rs_parse_z16_mode(z16_binning, &z16_mode)) {
+        user_panic("Unknown z16-binning mode: %s.", z16_binning);
+    }
+    settings.z16_binning = z16_mode;
+    free(z16_binning);
+
+    if (settings.downscale != RS_FACTOR_NONE && settings.downscale != 2 && settings.downscale != RS_FACTOR_MAX) {
+        user_panic("downscale must be 1, 2 or 4.");
+    }
+
+    // Parse crop rectangle
+    if (strlen(crop)) {
+        if (sscanf(crop, "%d,%d,%d,%d", &settings.crop_x, &settings.crop_y, &settings.crop_width, &settings.crop_height) != 4 ||
+                settings.crop_x < 0 || settings.crop_y < 0 || settings.crop_width <= 0 || settings.crop_height <= 0) {
+            user_panic("Invalid crop rectangle: %s.", crop);
+        }
+    }
+    free(crop);
+
+    // Set allocation profiling mode
+    mem_profile_mode_t profile_mode;
+    if (!mem_parse_profile_mode(alloc_profile, &profile_mode)) {
+        user_panic("Unknown alloc-profile mode: %s.", alloc_profile);
+    }
+    settings.alloc_profile = profile_mode;
+    free(alloc_profile);
+
+    // Only driver allocated buffers can be exported
+    if (settings.userptr && strlen(settings.export_socket)) {
+        user_panic("export-socket can't be used with userptr.");
+    }
+
+    if (settings.detect_coarse != 0 && settings.detect_coarse != 2 && settings.detect_coarse != 4 &&
+            settings.detect_coarse != 8) {
+        user_panic("detect-coarse must be 0, 2, 4 or 8.");
+    }
 
     // Parse video devices
     settings.video_device_count = 1;
@@ -101,6 +233,15 @@ void init_settings(int argc, char *argv[]) {
 
     settings.jpeg_quality = max(1, min(100, settings.jpeg_quality));
     settings.fps = max(1, min(50, settings.fps));
+    settings.huffman_warmup = max(0, min(MAX_HUFFMAN_WARMUP, settings.huffman_warmup));
+    settings.rate_target = max(0, settings.rate_target);
+    settings.rate_interval = max(1, settings.rate_interval);
+    settings.telemetry_window = max(0, min(TM_MAX_WINDOW, settings.telemetry_window));
+    settings.detect_tolerance = max(0, min(100, settings.detect_tolerance));
+    settings.min_detect_conf = max(0, min(10000, settings.min_detect_conf));
+    settings.detect_stride = max(1, settings.detect_stride);
+    settings.detect_full_scan = max(0, settings.detect_full_scan);
+    settings.detect_threads = max(1, min(DETECT_MAX_THREADS, settings.detect_threads));
 
     normalize_path(&settings.file_root, "The file-root you specified does not exist");
 
@@ -14,6 +14,33 @@
 #define DEFAULT_PROFILE_FPS "0"
 #define DEFAULT_WRITE_DETECT_IMAGE "0"
 #define DEFAULT_ENABLE_STRIPE_DETECT "0"
+#define DEFAULT_HUFFMAN_WARMUP "0"
+#define DEFAULT_ABBREVIATED_JPEG "0"
+
+#define DEFAULT_RATE_CONTROL "off"
+#define DEFAULT_RATE_TARGET "0"
+#define DEFAULT_RATE_INTERVAL "1"
+#define DEFAULT_DOWNSCALE "1"
+#define DEFAULT_Z16_BINNING "min"
+#define DEFAULT_CROP ""
+#define DEFAULT_NEGOTIATE_FORMAT "0"
+#define DEFAULT_EXPORT_SOCKET ""
+#define DEFAULT_USERPTR "0"
+#define DEFAULT_TELEMETRY_WINDOW "0"
+#define DEFAULT_METRICS_LISTEN ""
+#define DEFAULT_TRACE_FILE ""
+#define DEFAULT_ALLOC_PROFILE "off"
+#define DEFAULT_ENABLE_COLOR_DETECT "0"
+#define DEFAULT_DETECT_COLORS ""
+#define DEFAULT_DETECT_TOLERANCE "15"
+#define DEFAULT_MIN_DETECT_CONF "0"
+#define DEFAULT_DETECT_STRIDE "1"
+#define DEFAULT_DETECT_TRACKING "0"
+#define DEFAULT_DETECT_FULL_SCAN "0"
+#define DEFAULT_DETECT_COARSE "0"
+#define DEFAULT_DETECT_THREADS "1"
+
+#define MAX_HUFFMAN_WARMUP (1000)
 
 #define DETECT_COLOR_LENGTH (7)
 
@@ -27,6 +54,7 @@ struct settings {
 	char *file_root;
 	char *base_file_name;
 	int v4l2_format;
+	short negotiate_format;
 	int video_device_count;
 	char *video_device_file;
 	int profile_fps;
@@ -34,6 +62,54 @@ struct settings {
 	// Stripe-detect parameters
 	int enable_stripe_detect;
 	int write_detect_image;
+
+	// Color-detect parameters, detect_colors is a , separated list of #RRGGBB
+	short enable_color_detect;
+	char *detect_colors;
+	int detect_tolerance;
+	int min_detect_conf;
+	int detect_stride;
+	short detect_tracking;
+	int detect_full_scan;
+	int detect_coarse;
+	int detect_threads;
+
+	// JPEG entropy coding parameters
+	int huffman_warmup;
+	short abbreviated_jpeg;
+
+	// JPEG rate control parameters
+	int rate_control;
+	int rate_target;
+	int rate_interval;
+
+	// Pre-encode binning parameters
+	int downscale;
+	int z16_binning;
+
+	// Region of interest, zero width/height for the whole frame
+	int crop_x;
+	int crop_y;
+	int crop_width;
+	int crop_height;
+
+	// Unix socket raw frames are exported on, empty to disable
+	char *export_socket;
+
+	// Capture into a huge page pool instead of driver buffers
+	short userptr;
+
+	// Frames per drop and latency report, 0 to disable
+	int telemetry_window;
+
+	// Prometheus exporter, a localhost TCP port or Unix socket path, empty to disable
+	char *metrics_listen;
+
+	// Chrome trace-event output, written on SIGUSR1 and at exit, empty to disable
+	char *trace_file;
+
+	// Allocation accounting, see mem_profile_mode_t
+	int alloc_profile;
 };
 
 void init_settings(int argc, char *argv[]);
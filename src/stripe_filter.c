@@ -15,6 +15,12 @@
 #define SF_FEATURE_ANNOTATION_COLOR             (3)
 #define SF_FEATURE_CENTER_ANNOTATION_COLOR      (4)
 
+/* Cluster grid cells per axis, 2 / SF_CLUSTER_PERCENT_X and 2 / SF_CLUSTER_PERCENT_Y,
+ * so a cell is half the clustering range at the far edge of the frame */
+#define SF_GRID_CELLS_X                         (50)
+#define SF_GRID_CELLS_Y                         (10)
+#define SF_GRID_NONE                            (-1)
+
 typedef enum {
     SF_THRESHOLD_STATE_ABOVE,
     SF_THRESHOLD_STATE_BELOW
@@ -35,6 +41,21 @@ struct sf_filter {
     sf_filter_fn_t filter_fn;
 };
 
+/*
+ * Uniform grid over cluster centroids. Each cell holds a doubly linked list of the
+ * clusters whose centroid is in it, so a cluster can be moved when its centroid does.
+ */
+typedef struct {
+    uint32_t cell_width;
+    uint32_t cell_height;
+    int head[SF_GRID_CELLS_Y * SF_GRID_CELLS_X];
+    int next[SF_MAX_GRADIENT_CLUSTERS];
+    int prev[SF_MAX_GRADIENT_CLUSTERS];
+    int cell[SF_MAX_GRADIENT_CLUSTERS];
+} sf_cluster_grid_t;
+
+static sf_cluster_grid_t cluster_grid;
+
 /* Grayscale image color table */
 static rgbColorTableEntry stripeFilterColorTable[256] = { 0 };
 
@@ -183,32 +204,122 @@ static bool sf_value_in_range(int32_t base, float range, int32_t value) {
     return true;
 }
 
+/* Size the grid so coordinates up to max_x, max_y fall inside it, and empty it */
+static void sf_grid_init(uint32_t max_x, uint32_t max_y) {
+    cluster_grid.cell_width = max_x / SF_GRID_CELLS_X + 1;
+    cluster_grid.cell_height = max_y / SF_GRID_CELLS_Y + 1;
+
+    for (size_t i=0; i < SF_GRID_CELLS_Y * SF_GRID_CELLS_X; ++i) {
+        cluster_grid.head[i] = SF_GRID_NONE;
+    }
+}
+
+static int sf_grid_cell_x(int64_t x) {
+    int64_t cell = x / (int64_t) cluster_grid.cell_width;
+
+    return (x < 0) ? 0 : (cell >= SF_GRID_CELLS_X) ? SF_GRID_CELLS_X - 1 : (int) cell;
+}
+
+static int sf_grid_cell_y(int64_t y) {
+    int64_t cell = y / (int64_t) cluster_grid.cell_height;
+
+    return (y < 0) ? 0 : (cell >= SF_GRID_CELLS_Y) ? SF_GRID_CELLS_Y - 1 : (int) cell;
+}
+
+static void sf_grid_insert(int index, uint32_t x, uint32_t y) {
+    int cell = sf_grid_cell_y(y) * SF_GRID_CELLS_X + sf_grid_cell_x(x);
+
+    cluster_grid.cell[index] = cell;
+    cluster_grid.prev[index] = SF_GRID_NONE;
+    cluster_grid.next[index] = cluster_grid.head[cell];
+
+    if (cluster_grid.head[cell] != SF_GRID_NONE) {
+        cluster_grid.prev[cluster_grid.head[cell]] = index;
+    }
+    cluster_grid.head[cell] = index;
+}
+
+static void sf_grid_remove(int index) {
+    int prev = cluster_grid.prev[index];
+    int next = cluster_grid.next[index];
+
+    if (prev != SF_GRID_NONE) {
+        cluster_grid.next[prev] = next;
+    } else {
+        cluster_grid.head[cluster_grid.cell[index]] = next;
+    }
+
+    if (next != SF_GRID_NONE) {
+        cluster_grid.prev[next] = prev;
+    }
+}
+
+/* Re-file a cluster whose centroid moved, if it left its cell */
+static void sf_grid_move(int index, uint32_t x, uint32_t y) {
+    if (sf_grid_cell_y(y) * SF_GRID_CELLS_X + sf_grid_cell_x(x) != cluster_grid.cell[index]) {
+        sf_grid_remove(index);
+        sf_grid_insert(index, x, y);
+    }
+}
+
 static bool sf_cluster_grad(sf_gradient_info_t* p_grad, sf_gradient_cluster_list_t* p_cluster_list) {
     if (!p_grad || !p_cluster_list) {
         return false;
     }
 
-    for (size_t i=0; i < p_cluster_list->num_elem; ++i) {
-        /* The current cluster we're working with */
-        sf_gradient_cluster_info_t* p_cluster = &p_cluster_list->cluster_list[i];
-
-        /* If the current gradient is within the clustering percentage of the current
-         * cluster centroid, and of the same type, add it to the cluster.
-         */
-        if (sf_value_in_range(p_cluster->x_cent, SF_CLUSTER_PERCENT_X, p_grad->x_coord) &&
-            sf_value_in_range(p_cluster->y_cent, SF_CLUSTER_PERCENT_Y, p_grad->y_coord) &&
-            p_grad->type == p_cluster->type) {
-
-            /* Add to current cluster */
-            p_cluster->x_sum += p_grad->x_coord;
-            p_cluster->y_sum += p_grad->y_coord;
-            p_cluster->count++;
-            p_cluster->x_cent = p_cluster->x_sum / p_cluster->count;
-            p_cluster->y_cent = p_cluster->y_sum / p_cluster->count;
-            return true;
+    /*
+     * A centroid c is in range of coordinate v only if c * (1 - percent) <= v <= c * (1 + percent),
+     * so only cells holding centroids between v / (1 + percent) and v / (1 - percent) are checked.
+     * The bounds are widened by a pixel for float rounding.
+     */
+    int x_min = sf_grid_cell_x((int64_t) floorf(p_grad->x_coord / (1.0f + SF_CLUSTER_PERCENT_X)) - 1);
+    int x_max = sf_grid_cell_x((int64_t) ceilf(p_grad->x_coord / (1.0f - SF_CLUSTER_PERCENT_X)) + 1);
+    int y_min = sf_grid_cell_y((int64_t) floorf(p_grad->y_coord / (1.0f + SF_CLUSTER_PERCENT_Y)) - 1);
+    int y_max = sf_grid_cell_y((int64_t) ceilf(p_grad->y_coord / (1.0f - SF_CLUSTER_PERCENT_Y)) + 1);
+
+    /* The lowest numbered cluster in range takes the gradient, as if every cluster were scanned in order */
+    int match = SF_GRID_NONE;
+
+    for (int cell_y=y_min; cell_y <= y_max; ++cell_y) {
+        for (int cell_x=x_min; cell_x <= x_max; ++cell_x) {
+            int i = cluster_grid.head[cell_y * SF_GRID_CELLS_X + cell_x];
+
+            for (; i != SF_GRID_NONE; i = cluster_grid.next[i]) {
+                /* The current cluster we're working with */
+                sf_gradient_cluster_info_t* p_cluster = &p_cluster_list->cluster_list[i];
+
+                if (match != SF_GRID_NONE && i > match) {
+                    continue;
+                }
+
+                /* If the current gradient is within the clustering percentage of the current
+                 * cluster centroid, and of the same type, it can join the cluster.
+                 */
+                if (sf_value_in_range(p_cluster->x_cent, SF_CLUSTER_PERCENT_X, p_grad->x_coord) &&
+                    sf_value_in_range(p_cluster->y_cent, SF_CLUSTER_PERCENT_Y, p_grad->y_coord) &&
+                    p_grad->type == p_cluster->type) {
+                    match = i;
+                }
+            }
         }
     }
-    return false;
+
+    if (match == SF_GRID_NONE) {
+        return false;
+    }
+
+    /* Add to matching cluster */
+    sf_gradient_cluster_info_t* p_cluster = &p_cluster_list->cluster_list[match];
+
+    p_cluster->x_sum += p_grad->x_coord;
+    p_cluster->y_sum += p_grad->y_coord;
+    p_cluster->count++;
+    p_cluster->x_cent = p_cluster->x_sum / p_cluster->count;
+    p_cluster->y_cent = p_cluster->y_sum / p_cluster->count;
+
+    sf_grid_move(match, p_cluster->x_cent, p_cluster->y_cent);
+
+    return true;
 }
 
 static bool sf_create_cluster_from_grad(sf_gradient_info_t* p_grad, sf_gradient_cluster_list_t* p_cluster_list) {
@@ -221,6 +332,8 @@ static bool sf_create_cluster_from_grad(sf_gradient_info_t* p_grad, sf_gradient_
         return false;
     }
 
+    sf_grid_insert(p_cluster_list->num_elem, p_grad->x_coord, p_grad->y_coord);
+
     /* Add gradient to cluster */
     p_cluster_list->cluster_list[p_cluster_list->num_elem].count = 1;
     p_cluster_list->cluster_list[p_cluster_list->num_elem].x_cent = p_grad->x_coord;
@@ -239,6 +352,26 @@ bool sf_cluster_gradients(sf_gradient_list_t* p_grad, sf_gradient_cluster_list_t
         return false;
     }
 
+    /* Size the cluster grid to everything that can be in it, and file the clusters already found */
+    uint32_t max_x = 0;
+    uint32_t max_y = 0;
+
+    for (size_t i=0; i < p_grad->num_elem; ++i) {
+        max_x = (p_grad->gradient_list[i].x_coord > max_x) ? p_grad->gradient_list[i].x_coord : max_x;
+        max_y = (p_grad->gradient_list[i].y_coord > max_y) ? p_grad->gradient_list[i].y_coord : max_y;
+    }
+
+    for (size_t i=0; i < p_cluster_list->num_elem; ++i) {
+        max_x = (p_cluster_list->cluster_list[i].x_cent > max_x) ? p_cluster_list->cluster_list[i].x_cent : max_x;
+        max_y = (p_cluster_list->cluster_list[i].y_cent > max_y) ? p_cluster_list->cluster_list[i].y_cent : max_y;
+    }
+
+    sf_grid_init(max_x, max_y);
+
+    for (size_t i=0; i < p_cluster_list->num_elem; ++i) {
+        sf_grid_insert(i, p_cluster_list->cluster_list[i].x_cent, p_cluster_list->cluster_list[i].y_cent);
+    }
+
     /**
      * Iterate over gradients and determine whether to add the current gradient to an existing
      * cluster or create a new cluster.
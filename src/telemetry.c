@@ -0,0 +1,145 @@
+//
+// Frame drop and capture-to-publish latency telemetry
+//
+// Drops are counted from gaps in the driver's sequence numbers, which count every
+// frame the sensor produced whether or not a buffer was free for it. Latency is
+// taken from the driver's capture timestamp to the moment the output is published,
+// and summarized over a sliding window of the most recent frames, reported several
+// times per window so a spike shows up without waiting for a whole window to pass.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "telemetry.h"
+
+bool tm_init(tm_state_t *p_state, int window) {
+    if (!p_state) {
+        return false;
+    }
+
+    memset(p_state, 0, sizeof(tm_state_t));
+
+    if (window <= 0) {
+        return false;
+    }
+
+    p_state->window = (window > TM_MAX_WINDOW) ? TM_MAX_WINDOW : window;
+    p_state->report_interval = p_state->window / TM_REPORTS_PER_WINDOW;
+    if (p_state->report_interval < 1) {
+        p_state->report_interval = 1;
+    }
+
+    p_state->p_latency_ns = calloc(p_state->window, sizeof(uint64_t));
+    p_state->p_dropped = calloc(p_state->window, sizeof(uint32_t));
+    p_state->p_sorted_ns = calloc(p_state->window, sizeof(uint64_t));
+
+    return true;
+}
+
+void tm_destroy(tm_state_t *p_state) {
+    if (!p_state) {
+        return;
+    }
+
+    free(p_state->p_latency_ns);
+    p_state->p_latency_ns = NULL;
+
+    free(p_state->p_dropped);
+    p_state->p_dropped = NULL;
+
+    free(p_state->p_sorted_ns);
+    p_state->p_sorted_ns = NULL;
+}
+
+static int tm_compare(const void *p_a, const void *p_b) {
+    uint64_t a = *(const uint64_t *) p_a;
+    uint64_t b = *(const uint64_t *) p_b;
+
+    return (a > b) - (a < b);
+}
+
+/* Nearest-rank percentile of a sorted window */
+static uint64_t tm_percentile(const uint64_t *p_sorted, int count, int percent) {
+    int rank = (count * percent + 99) / 100;
+
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    return p_sorted[rank - 1];
+}
+
+static void tm_report_window(tm_state_t *p_state) {
+    int count = p_state->window_frames;
+
+    /* Percentiles don't depend on ring order, so the ring is copied as is */
+    memcpy(p_state->p_sorted_ns, p_state->p_latency_ns, count * sizeof(uint64_t));
+    qsort(p_state->p_sorted_ns, count, sizeof(uint64_t), tm_compare);
+
+    p_state->last_window.frames = count;
+    p_state->last_window.dropped = p_state->window_dropped;
+    p_state->last_window.p50_ns = tm_percentile(p_state->p_sorted_ns, count, 50);
+    p_state->last_window.p99_ns = tm_percentile(p_state->p_sorted_ns, count, 99);
+    p_state->last_window.max_ns = p_state->p_sorted_ns[count - 1];
+}
+
+bool tm_record(tm_state_t *p_state, uint32_t sequence, uint64_t capture_ns, uint64_t publish_ns) {
+    uint32_t gap = 0;
+    int head;
+
+    if (!p_state) {
+        return false;
+    }
+
+    /* A sequence that goes backwards means streaming restarted, not drops */
+    if (p_state->b_have_sequence && sequence > p_state->last_sequence) {
+        gap = sequence - p_state->last_sequence - 1;
+        p_state->dropped += gap;
+    }
+    p_state->last_sequence = sequence;
+    p_state->b_have_sequence = true;
+    p_state->last_dropped = gap;
+    p_state->frames++;
+
+    if (p_state->window == 0) {
+        return false;
+    }
+
+    /* Once the ring is full the oldest frame slides out of the window */
+    head = p_state->head;
+    if (p_state->window_frames == p_state->window) {
+        p_state->window_dropped -= p_state->p_dropped[head];
+    } else {
+        p_state->window_frames++;
+    }
+
+    p_state->p_latency_ns[head] = (publish_ns > capture_ns) ? publish_ns - capture_ns : 0;
+    p_state->p_dropped[head] = gap;
+    p_state->window_dropped += gap;
+    p_state->head = (head + 1) % p_state->window;
+
+    if (++p_state->frames_since_report < p_state->report_interval) {
+        return false;
+    }
+
+    p_state->frames_since_report = 0;
+    tm_report_window(p_state);
+
+    return true;
+}
+
+void tm_print(const tm_state_t *p_state, uint32_t device_id) {
+    const tm_window_t *p_window;
+
+    if (!p_state) {
+        return;
+    }
+
+    p_window = &p_state->last_window;
+
+    printf("%s: device %u: %u frames, %u dropped (%llu of %llu total), latency p50 %.2f ms p99 %.2f ms max %.2f ms\n",
+           __func__, device_id, p_window->frames, p_window->dropped,
+           (unsigned long long) p_state->dropped, (unsigned long long) (p_state->frames + p_state->dropped),
+           p_window->p50_ns / 1e6, p_window->p99_ns / 1e6, p_window->max_ns / 1e6);
+}
@@ -0,0 +1,88 @@
+//
+// Frame drop and capture-to-publish latency telemetry
+//
+
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Largest report window, in frames */
+#define TM_MAX_WINDOW                               (10000)
+
+/* Reports per window, each one covers the last window of frames */
+#define TM_REPORTS_PER_WINDOW                       (4)
+
+typedef struct {
+    uint32_t frames;
+    uint32_t dropped;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+} tm_window_t;
+
+typedef struct {
+    int window;
+    int report_interval;
+
+    /* Driver sequence of the last frame, gaps are frames the driver dropped */
+    bool b_have_sequence;
+    uint32_t last_sequence;
+
+    /* Frames dropped right before the last recorded one, counted even with reports disabled */
+    uint32_t last_dropped;
+
+    /* Rings of the latency and preceding drops of the last window frames, head is the oldest once full */
+    uint64_t *p_latency_ns;
+    uint32_t *p_dropped;
+    uint64_t *p_sorted_ns;
+    int head;
+    int window_frames;
+    uint32_t window_dropped;
+    int frames_since_report;
+
+    /* Totals since start */
+    uint64_t frames;
+    uint64_t dropped;
+
+    /* Most recent report */
+    tm_window_t last_window;
+} tm_state_t;
+
+/**
+ * @func tm_init
+ * @param p_state State to initialize
+ * @param window Frames covered by each report, 0 disables telemetry
+ * @return True if telemetry is enabled
+ */
+bool tm_init(tm_state_t *p_state, int window);
+
+/**
+ * @func tm_destroy
+ * @param p_state State to release
+ */
+void tm_destroy(tm_state_t *p_state);
+
+/**
+ * @func tm_record
+ * @param p_state Telemetry state
+ * @param sequence V4L2 sequence number of the frame
+ * @param capture_ns CLOCK_MONOTONIC capture time
+ * @param publish_ns CLOCK_MONOTONIC time the frame was published
+ * @return True if a report is due, it is in p_state->last_window
+ *
+ * Drops are counted even when the window is 0, other counters take them from
+ * p_state->last_dropped so every report agrees.
+ */
+bool tm_record(tm_state_t *p_state, uint32_t sequence, uint64_t capture_ns, uint64_t publish_ns);
+
+/**
+ * @func tm_print
+ * @param p_state Telemetry state
+ * @param device_id Device the state belongs to
+ */
+void tm_print(const tm_state_t *p_state, uint32_t device_id);
+
+#endif //_TELEMETRY_H
@@ -0,0 +1,213 @@
+//
+// Chrome trace-event recording of per-frame pipeline spans
+//
+// Each thread writes spans into a ring of its own, so recording is a handful of
+// stores with no lock. A flush copies whatever the rings still hold, skipping any
+// slot the owning thread may have overwritten while it was being read. When
+// tracing is off, a span costs one load and a branch.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+bool tr_b_enabled = false;
+
+static char trace_path[256];
+static char trace_temp_path[258];
+
+static tr_ring_t *rings[TR_MAX_THREADS];
+static unsigned int ring_count = 0;
+
+static __thread tr_ring_t *p_thread_ring = NULL;
+static __thread bool b_thread_ring_failed = false;
+static __thread uint32_t thread_device_id = 0;
+static __thread uint32_t thread_sequence = 0;
+
+bool tr_init(const char *p_path) {
+    if (!p_path || strlen(p_path) == 0) {
+        return false;
+    }
+
+    if (strlen(p_path) >= sizeof(trace_path)) {
+        fprintf(stderr, "%s: trace path too long: %s\n", __func__, p_path);
+        return false;
+    }
+
+    /* Relative paths are kept relative to where we started, not where a daemon runs */
+    if (p_path[0] != '/') {
+        char cwd[sizeof(trace_path)];
+
+        if (getcwd(cwd, sizeof(cwd)) == NULL || strlen(cwd) + 1 + strlen(p_path) >= sizeof(trace_path)) {
+            fprintf(stderr, "%s: trace path too long: %s\n", __func__, p_path);
+            return false;
+        }
+        strcpy(trace_path, cwd);
+        strcat(trace_path, "/");
+        strcat(trace_path, p_path);
+    } else {
+        snprintf(trace_path, sizeof(trace_path), "%s", p_path);
+    }
+    snprintf(trace_temp_path, sizeof(trace_temp_path), "%s~", trace_path);
+
+    __atomic_store_n(&tr_b_enabled, true, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void tr_destroy(void) {
+    unsigned int count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+
+    tr_b_enabled = false;
+
+    if (count > TR_MAX_THREADS) {
+        count = TR_MAX_THREADS;
+    }
+
+    for (unsigned int i=0; i < count; ++i) {
+        free(rings[i]);
+        rings[i] = NULL;
+    }
+
+    ring_count = 0;
+    p_thread_ring = NULL;
+}
+
+/* The calling thread's ring, registered the first time the thread records a span */
+static tr_ring_t *tr_thread_ring(void) {
+    unsigned int slot;
+
+    if (p_thread_ring || b_thread_ring_failed) {
+        return p_thread_ring;
+    }
+
+    slot = __atomic_load_n(&ring_count, __ATOMIC_RELAXED);
+    do {
+        if (slot >= TR_MAX_THREADS) {
+            b_thread_ring_failed = true;
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&ring_count, &slot, slot + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    tr_ring_t *p_ring = calloc(1, sizeof(tr_ring_t));
+
+    if (!p_ring) {
+        b_thread_ring_failed = true;
+        return NULL;
+    }
+
+    p_ring->tid = (int) syscall(SYS_gettid);
+    __atomic_store_n(&rings[slot], p_ring, __ATOMIC_RELEASE);
+    p_thread_ring = p_ring;
+
+    return p_ring;
+}
+
+void tr_set_frame(uint32_t device_id, uint32_t sequence) {
+    thread_device_id = device_id;
+    thread_sequence = sequence;
+}
+
+void tr_span(const char *p_name, uint64_t start_ns, uint64_t end_ns) {
+    tr_ring_t *p_ring;
+    tr_event_t *p_event;
+    uint64_t head;
+
+    if (!tr_is_enabled() || !(p_ring = tr_thread_ring())) {
+        return;
+    }
+
+    head = p_ring->head;
+    p_event = &p_ring->events[head % TR_RING_EVENTS];
+
+    /* The slot must not be seen changing before the previous head is */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    p_event->p_name = p_name;
+    p_event->start_ns = start_ns;
+    p_event->duration_ns = (end_ns > start_ns) ? end_ns - start_ns : 0;
+    p_event->device_id = thread_device_id;
+    p_event->sequence = thread_sequence;
+
+    /* Publishes the event to a concurrent flush */
+    __atomic_store_n(&p_ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void tr_write_event(FILE *p_file, const tr_ring_t *p_ring, const tr_event_t *p_event, bool *p_first) {
+    fprintf(p_file, "%s\n{\"name\":\"%s\",\"cat\":\"hawkeye\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"device\":%u,\"sequence\":%u}}",
+            *p_first ? "" : ",", p_event->p_name, (int) getpid(), p_ring->tid,
+            p_event->start_ns / 1e3, p_event->duration_ns / 1e3, p_event->device_id, p_event->sequence);
+    *p_first = false;
+}
+
+static void tr_write_ring(FILE *p_file, const tr_ring_t *p_ring, bool *p_first) {
+    tr_event_t event;
+    uint64_t head = __atomic_load_n(&p_ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = (head > TR_RING_EVENTS) ? head - TR_RING_EVENTS : 0;
+
+    fprintf(p_file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            *p_first ? "" : ",", (int) getpid(), p_ring->tid, (p_ring->tid == getpid()) ? "capture" : "worker");
+    *p_first = false;
+
+    for (uint64_t i=first; i < head; ++i) {
+        memcpy(&event, &p_ring->events[i % TR_RING_EVENTS], sizeof(event));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        /* The writer may have lapped us while we were copying */
+        uint64_t now_head = __atomic_load_n(&p_ring->head, __ATOMIC_ACQUIRE);
+        if (now_head > i + TR_RING_EVENTS - 1) {
+            continue;
+        }
+
+        tr_write_event(p_file, p_ring, &event, p_first);
+    }
+}
+
+bool tr_flush(void) {
+    unsigned int count;
+    bool b_first = true;
+
+    if (!tr_is_enabled()) {
+        return false;
+    }
+
+    FILE *p_file = fopen(trace_temp_path, "w+");
+
+    if (p_file == NULL) {
+        perror("tr_flush: fopen");
+        return false;
+    }
+
+    fprintf(p_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    if (count > TR_MAX_THREADS) {
+        count = TR_MAX_THREADS;
+    }
+
+    for (unsigned int i=0; i < count; ++i) {
+        tr_ring_t *p_ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+
+        /* Slot claimed but the ring not published yet */
+        if (p_ring) {
+            tr_write_ring(p_file, p_ring, &b_first);
+        }
+    }
+
+    fprintf(p_file, "\n]}\n");
+
+    fflush(p_file);
+    fclose(p_file);
+
+    /* Now that write is complete, rename the file */
+    rename(trace_temp_path, trace_path);
+
+    fprintf(stdout, "%s: trace written to %s\n", __func__, trace_path);
+
+    return true;
+}
@@ -0,0 +1,80 @@
+//
+// Chrome trace-event recording of per-frame pipeline spans
+//
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Spans kept per thread, older ones are overwritten */
+#define TR_RING_EVENTS                              (16384)
+#define TR_MAX_THREADS                              (32)
+
+typedef struct {
+    const char *p_name;         /* Static string, not copied */
+    uint64_t start_ns;          /* CLOCK_MONOTONIC */
+    uint64_t duration_ns;
+    uint32_t device_id;
+    uint32_t sequence;
+} tr_event_t;
+
+typedef struct {
+    int tid;
+    uint64_t head;              /* Events ever written, the writer is the owning thread */
+    tr_event_t events[TR_RING_EVENTS];
+} tr_ring_t;
+
+extern bool tr_b_enabled;
+
+/**
+ * @func tr_is_enabled
+ * @return True if spans are being recorded
+ */
+static inline bool tr_is_enabled(void) {
+    return tr_b_enabled;
+}
+
+/**
+ * @func tr_init
+ * @param p_path File traces are written to
+ * @return True if tracing is enabled
+ */
+bool tr_init(const char *p_path);
+
+/**
+ * @func tr_destroy
+ *
+ * Stops recording and releases every ring. Call once all threads are done.
+ */
+void tr_destroy(void);
+
+/**
+ * @func tr_set_frame
+ * @param device_id Device of the frame the calling thread is working on
+ * @param sequence V4L2 sequence number of the frame
+ *
+ * Spans recorded by the thread from now on are tagged with the frame.
+ */
+void tr_set_frame(uint32_t device_id, uint32_t sequence);
+
+/**
+ * @func tr_span
+ * @param p_name Span name, must be a static string
+ * @param start_ns CLOCK_MONOTONIC start
+ * @param end_ns CLOCK_MONOTONIC end
+ */
+void tr_span(const char *p_name, uint64_t start_ns, uint64_t end_ns);
+
+/**
+ * @func tr_flush
+ * @return True if the trace file was written
+ *
+ * Writes every span still held in the rings as Chrome trace-event JSON, which
+ * chrome://tracing and Perfetto load directly. The rings are not cleared.
+ */
+bool tr_flush(void);
+
+#endif //_TRACE_H
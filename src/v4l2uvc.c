@@ -32,12 +32,64 @@
 
 #include "huffman.h"
 #include "memory.h"
+#include "frame_meta.h"
+#include "histogram.h"
 
 #include "v4l2uvc.h"
 
 static int xioctl(int fd, int IOCTL_X, void *arg);
 static int video_enable(struct video_device *vd);
 static int video_disable(struct video_device *vd, streaming_state disabledState);
+static void init_crop(struct video_device *vd);
+static void enumerate_formats(struct video_device *vd);
+static void update_current_indexes(struct video_device *vd);
+static void negotiate_format(struct video_device *vd);
+static void prepare_buffer(struct video_device *vd, struct v4l2_buffer *buf, struct v4l2_plane *planes, unsigned int index);
+static int init_userptr(struct video_device *vd);
+
+/* What a format's samples are. Negotiation never trades one kind for another. */
+enum format_content {
+    FORMAT_CONTENT_COLOR,
+    FORMAT_CONTENT_GREY,
+    FORMAT_CONTENT_DEPTH
+};
+
+/* Processing cost of each capture format the pipeline handles, cheapest first.
+ * Formats missing from this table are never negotiated.
+ */
+struct format_cost {
+    uint32_t pixelformat;
+    enum format_content content;
+    int cost;
+    int compressed;
+    const char *reason;
+};
+
+static const struct format_cost format_costs[] = {
+    { V4L2_PIX_FMT_MJPEG, FORMAT_CONTENT_COLOR, 0, 1, "JPEG from the device is passed through" },
+    { V4L2_PIX_FMT_GREY,  FORMAT_CONTENT_GREY,  1, 0, "single component, rows are encoded in place" },
+    { V4L2_PIX_FMT_Z16,   FORMAT_CONTENT_DEPTH, 1, 0, "single component, encoded without color conversion" },
+    { V4L2_PIX_FMT_Y16,   FORMAT_CONTENT_GREY,  1, 0, "single component, encoded without color conversion" },
+    { V4L2_PIX_FMT_NV12,  FORMAT_CONTENT_COLOR, 2, 0, "planes are encoded directly as 4:2:0" },
+    { V4L2_PIX_FMT_NV12M, FORMAT_CONTENT_COLOR, 2, 0, "planes are encoded directly as 4:2:0" },
+    { V4L2_PIX_FMT_UYVY,  FORMAT_CONTENT_COLOR, 2, 0, "encoded directly as 4:2:2" },
+    { V4L2_PIX_FMT_YUYV,  FORMAT_CONTENT_COLOR, 3, 0, "needs color conversion before encoding" },
+};
+
+unsigned int format_bytes_per_pixel(uint32_t pixelformat) {
+    switch (pixelformat) {
+        case V4L2_PIX_FMT_GREY:
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV12M:
+            return 1;
+        default:
+            return 2;
+    }
+}
+
+int format_is_planar(uint32_t pixelformat) {
+    return (pixelformat == V4L2_PIX_FMT_NV12 || pixelformat == V4L2_PIX_FMT_NV12M);
+}
 
 static int xioctl(int fd, int IOCTL_X, void *arg) {
     int ret = 0;
@@ -56,12 +108,8 @@ static int xioctl(int fd, int IOCTL_X, void *arg) {
     return (ret);
 }
 
-struct video_device *create_video_device(char *device, int width, int height, int fps, int format, int jpeg_quality) {
+struct video_device *create_video_device(char *device, int width, int height, int fps, int format, int jpeg_quality, struct v4l2_rect *p_crop, negotiate_mode negotiate, int userptr) {
     struct video_device *vd;
-    struct v4l2_fmtdesc fmtdesc;
-    struct v4l2_format current_format;
-    struct v4l2_frmsizeenum fsenum;
-    int j;
 
     vd = malloc(sizeof(struct video_device));
 
@@ -79,7 +127,10 @@ struct video_device *create_video_device(char *device, int width, int height, in
     vd->fps = fps;
     vd->format_in = format;
     vd->use_streaming = 1; // Use mmap
+    vd->memory = userptr ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+    memset(&vd->pool, 0, sizeof(bp_pool_t));
     vd->jpeg_quality = jpeg_quality;
+    vd->negotiate_mode = negotiate;
 
     vd->format_count = 0;
     vd->formats = NULL;
@@ -87,19 +138,146 @@ struct video_device *create_video_device(char *device, int width, int height, in
     vd->resolution_count = 0;
     vd->resolutions = NULL;
 
+    vd->crop_mode = CROP_NONE;
+    memset(&vd->crop, 0, sizeof(struct v4l2_rect));
+    if (p_crop != NULL && p_crop->width > 0 && p_crop->height > 0) {
+        vd->crop = *p_crop;
+        vd->crop_mode = CROP_SOFTWARE;
+    }
+
     if (init_v4l2(vd) < 0) {
         user_panic("Init V4L2 failed on device %s.", vd->device_filename);
     }
 
-    // enumerating formats
-    memset(&current_format, 0, sizeof(struct v4l2_format));
-    current_format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    ioctl(vd->fd, VIDIOC_G_FMT, &current_format);
+    // enumerating formats, unless negotiation already did
+    if (vd->formats == NULL) {
+        enumerate_formats(vd);
+    }
+    update_current_indexes(vd);
+
+    switch(vd->format_in) {
+        case V4L2_PIX_FMT_MJPEG:
+            vd->framebuffer_size = vd->width * (vd->height + 8) * 2;
+            vd->framebuffer = (unsigned char *) alloc_device_scratch(vd, vd->framebuffer_size);
+            break;
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+        case V4L2_PIX_FMT_Z16:
+        case V4L2_PIX_FMT_Y16:
+        case V4L2_PIX_FMT_GREY:
+            vd->framebuffer_size = vd->stride * vd->height;
+            vd->framebuffer = (unsigned char *) alloc_device_scratch(vd, vd->framebuffer_size);
+            break;
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV12M:
+            // Luma plane followed by the half height interleaved chroma plane
+            vd->framebuffer_size = vd->stride * vd->height + vd->chroma_stride * (vd->height / 2);
+            vd->framebuffer = (unsigned char *) alloc_device_scratch(vd, vd->framebuffer_size);
+            break;
+        default:
+            user_panic("init_video_in: Unsupported format.");
+            break;
+    }
+
+    vd->view.data = vd->framebuffer;
+    vd->view.size = vd->framebuffer_size;
+    vd->view.width = vd->width;
+    vd->view.height = vd->height;
+    vd->view.stride = vd->stride;
+    vd->view.chroma = NULL;
+    vd->view.chroma_stride = 0;
+
+    if (format_is_planar(vd->format_in)) {
+        vd->view.chroma = vd->framebuffer + vd->stride * vd->height;
+        vd->view.chroma_stride = vd->chroma_stride;
+    }
+
+    if (vd->crop_mode == CROP_SOFTWARE) {
+        if (format_is_planar(vd->format_in)) {
+            // Planar frames are copied whole, the view points into both planes
+            vd->view.data += vd->crop.top * vd->stride + vd->crop.left;
+            vd->view.chroma += (vd->crop.top / 2) * vd->chroma_stride + vd->crop.left;
+        } else {
+            vd->view.data = vd->framebuffer + vd->crop.left * format_bytes_per_pixel(vd->format_in);
+            vd->view.size = vd->crop.height * vd->stride;
+        }
+        vd->view.width = vd->crop.width;
+        vd->view.height = vd->crop.height;
+    }
+
+    return vd;
+}
+
+static unsigned int enumerate_max_fps(int fd, uint32_t pixelformat, unsigned int width, unsigned int height) {
+    struct v4l2_frmivalenum fival;
+    unsigned int max_fps = 0;
+    unsigned int fps;
+    int i;
+
+    for (i = 0; ; i++) {
+        memset(&fival, 0, sizeof(struct v4l2_frmivalenum));
+        fival.index = i;
+        fival.pixel_format = pixelformat;
+        fival.width = width;
+        fival.height = height;
+
+        if (xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &fival) != 0) {
+            break;
+        }
+
+        if (fival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+            if (fival.discrete.numerator == 0) {
+                continue;
+            }
+            fps = fival.discrete.denominator / fival.discrete.numerator;
+        } else {
+            // Continuous or stepwise, the shortest interval gives the highest rate
+            if (fival.stepwise.min.numerator == 0) {
+                break;
+            }
+            fps = fival.stepwise.min.denominator / fival.stepwise.min.numerator;
+        }
+
+        if (fps > max_fps) {
+            max_fps = fps;
+        }
+
+        if (fival.type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+            break;
+        }
+    }
+
+    return max_fps;
+}
+
+/* Requested size clamped to [min, max] and rounded up onto the steps from min */
+static unsigned int stepwise_size(unsigned int requested, unsigned int min, unsigned int max, unsigned int step) {
+    unsigned int size;
+
+    if (requested <= min) {
+        return min;
+    }
+    if (requested >= max) {
+        return max;
+    }
+    if (step == 0) {
+        step = 1;
+    }
+
+    size = min + ((requested - min + step - 1) / step) * step;
+
+    return (size > max) ? max : size;
+}
+
+static void enumerate_formats(struct video_device *vd) {
+    struct v4l2_fmtdesc fmtdesc;
+    struct v4l2_frmsizeenum fsenum;
+    int j;
 
     while (1) {
         memset(&fmtdesc, 0, sizeof(struct v4l2_fmtdesc));
         fmtdesc.index = vd->format_count;
-        fmtdesc.type  = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        fmtdesc.type  = vd->buf_type;
         if (xioctl(vd->fd, VIDIOC_ENUM_FMT, &fmtdesc) < 0) {
             break;
         }
@@ -112,10 +290,6 @@ struct video_device *create_video_device(char *device, int width, int height, in
 
         memcpy(&vd->formats[vd->format_count], &fmtdesc, sizeof(struct v4l2_fmtdesc));
 
-        if (fmtdesc.pixelformat == format) {
-            vd->current_format_index = vd->format_count;
-        }
-
         memset(&fsenum, 0, sizeof(struct v4l2_frmsizeenum));
         for (j = 0; ; j++) {
             fsenum.pixel_format = fmtdesc.pixelformat;
@@ -132,45 +306,386 @@ struct video_device *create_video_device(char *device, int width, int height, in
                 vd->resolutions = realloc(vd->resolutions, (vd->resolution_count + 1)  *sizeof(struct resolution));
             }
 
-            vd->resolutions[vd->resolution_count].width = fsenum.discrete.width;
-            vd->resolutions[vd->resolution_count].height = fsenum.discrete.height;
-            vd->resolutions[vd->resolution_count].pixelformat = fmtdesc.pixelformat;
-
-            if (format == fmtdesc.pixelformat) {
-                if (fsenum.discrete.width == width && fsenum.discrete.height == height) {
-                    vd->current_resolution_index = vd->resolution_count;
-                }
+            struct resolution *res = &vd->resolutions[vd->resolution_count];
+
+            if (fsenum.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+                res->width = fsenum.discrete.width;
+                res->height = fsenum.discrete.height;
+            } else {
+                // Continuous or stepwise, record the smallest size on the steps that holds the requested one
+                res->width = stepwise_size(vd->width, fsenum.stepwise.min_width, fsenum.stepwise.max_width,
+                                           fsenum.stepwise.step_width);
+                res->height = stepwise_size(vd->height, fsenum.stepwise.min_height, fsenum.stepwise.max_height,
+                                            fsenum.stepwise.step_height);
             }
+            res->pixelformat = fmtdesc.pixelformat;
+            res->max_fps = enumerate_max_fps(vd->fd, fmtdesc.pixelformat, res->width, res->height);
 
             vd->resolution_count += 1;
+
+            if (fsenum.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+                break;
+            }
         }
 
         vd->format_count++;
     }
+}
 
-    switch(vd->format_in) {
-        case V4L2_PIX_FMT_MJPEG:
-            vd->framebuffer_size = vd->width * (vd->height + 8) * 2;
-            vd->framebuffer = (unsigned char *) malloc(vd->framebuffer_size);
-            break;
-        case V4L2_PIX_FMT_YUYV:
-            vd->framebuffer_size = vd->width * vd->height * 2;
-            vd->framebuffer = (unsigned char *) malloc(vd->framebuffer_size);
-            break;
-    case V4L2_PIX_FMT_Z16:
-            vd->framebuffer_size = vd->width * vd->height * 2;
-            vd->framebuffer = (unsigned char *) malloc(vd->framebuffer_size);
-            break;
-        default:
-            user_panic("init_video_in: Unsupported format.");
-            break;
+static void update_current_indexes(struct video_device *vd) {
+    unsigned int i;
+
+    for (i = 0; i < vd->format_count; i++) {
+        if (vd->formats[i].pixelformat == vd->format_in) {
+            vd->current_format_index = i;
+        }
     }
 
-    return vd;
+    for (i = 0; i < vd->resolution_count; i++) {
+        if (vd->resolutions[i].pixelformat == vd->format_in &&
+                vd->resolutions[i].width == vd->width && vd->resolutions[i].height == vd->height) {
+            vd->current_resolution_index = i;
+        }
+    }
+}
+
+static const struct format_cost *find_format_cost(uint32_t pixelformat) {
+    unsigned int i;
+
+    for (i = 0; i < sizeof(format_costs) / sizeof(format_costs[0]); i++) {
+        if (format_costs[i].pixelformat == pixelformat) {
+            return &format_costs[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Pick the cheapest format, then the smallest resolution, that still meets the
+ * requested resolution and frame rate. The requested values become the minimums.
+ * Only formats with the same content as the requested one are considered, so a
+ * color camera is never negotiated to grey or depth.
+ */
+static void negotiate_format(struct video_device *vd) {
+    const struct format_cost *requested_cost = find_format_cost(vd->format_in);
+    const struct format_cost *best_cost = NULL;
+    struct resolution *best = NULL;
+    unsigned int i, j;
+
+    if (requested_cost == NULL) {
+        fprintf(stdout, "Can't negotiate from %.4s on device %s, using the requested format.\n", (char *) &vd->format_in, vd->device_filename);
+        return;
+    }
+
+    for (i = 0; i < vd->resolution_count; i++) {
+        struct resolution *res = &vd->resolutions[i];
+        const struct format_cost *cost = find_format_cost(res->pixelformat);
+        int emulated = 0;
+
+        for (j = 0; j < vd->format_count; j++) {
+            if (vd->formats[j].pixelformat == res->pixelformat && (vd->formats[j].flags & V4L2_FMT_FLAG_EMULATED)) {
+                emulated = 1;
+            }
+        }
+
+        // Formats converted by libv4l2 in software are never cheaper than the native one
+        if (cost == NULL || emulated || cost->content != requested_cost->content) {
+            continue;
+        }
+        if (cost->compressed && vd->negotiate_mode != NEGOTIATE_ANY) {
+            continue;
+        }
+        if (vd->negotiate_mode == NEGOTIATE_YUV422 &&
+                res->pixelformat != V4L2_PIX_FMT_YUYV && res->pixelformat != V4L2_PIX_FMT_UYVY) {
+            continue;
+        }
+        if (res->width < vd->width || res->height < vd->height) {
+            continue;
+        }
+        // Drivers that don't enumerate intervals report 0, assume they can keep up
+        if (res->max_fps != 0 && res->max_fps < vd->fps) {
+            continue;
+        }
+
+        if (best == NULL || cost->cost < best_cost->cost ||
+                (cost->cost == best_cost->cost && res->width * res->height < best->width * best->height)) {
+            best = res;
+            best_cost = cost;
+        }
+    }
+
+    if (best == NULL) {
+        fprintf(stdout, "No format on device %s meets %dx%d at %d fps, using the requested format.\n", vd->device_filename, vd->width, vd->height, vd->fps);
+        return;
+    }
+
+    fprintf(stdout, "Negotiated %.4s %ux%u (max %u fps) on device %s: %s.\n", (char *) &best->pixelformat, best->width, best->height,
+            best->max_fps, vd->device_filename, best_cost->reason);
+
+    vd->format_in = best->pixelformat;
+    vd->width = best->width;
+    vd->height = best->height;
+}
+
+static void set_format(struct v4l2_format *fmt, unsigned int width, unsigned int height, uint32_t pixelformat) {
+    if (fmt->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        fmt->fmt.pix_mp.width = width;
+        fmt->fmt.pix_mp.height = height;
+        fmt->fmt.pix_mp.pixelformat = pixelformat;
+        fmt->fmt.pix_mp.field = V4L2_FIELD_ANY;
+    } else {
+        fmt->fmt.pix.width = width;
+        fmt->fmt.pix.height = height;
+        fmt->fmt.pix.pixelformat = pixelformat;
+        fmt->fmt.pix.field = V4L2_FIELD_ANY;
+    }
+}
+
+static void get_format(struct v4l2_format *fmt, unsigned int *width, unsigned int *height, uint32_t *pixelformat) {
+    if (fmt->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        *width = fmt->fmt.pix_mp.width;
+        *height = fmt->fmt.pix_mp.height;
+        *pixelformat = fmt->fmt.pix_mp.pixelformat;
+    } else {
+        *width = fmt->fmt.pix.width;
+        *height = fmt->fmt.pix.height;
+        *pixelformat = fmt->fmt.pix.pixelformat;
+    }
+}
+
+/* Plane count and row strides of the format that was set. NV12 chroma has the luma
+ * stride unless the driver reports it as a separate plane.
+ */
+static void init_strides(struct video_device *vd) {
+    vd->num_planes = 1;
+    vd->stride = vd->fmt.fmt.pix.bytesperline;
+
+    if (vd->buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        struct v4l2_pix_format_mplane *pix_mp = &vd->fmt.fmt.pix_mp;
+
+        vd->num_planes = pix_mp->num_planes;
+        if (vd->num_planes == 0) {
+            vd->num_planes = 1;
+        }
+        if (vd->num_planes > VIDEO_MAX_PLANES) {
+            vd->num_planes = VIDEO_MAX_PLANES;
+        }
+        vd->stride = pix_mp->plane_fmt[0].bytesperline;
+    }
+
+    if (vd->stride == 0) {
+        vd->stride = vd->width * format_bytes_per_pixel(vd->format_in);
+    }
+
+    vd->chroma_stride = vd->stride;
+    if (vd->num_planes > 1 && vd->fmt.fmt.pix_mp.plane_fmt[1].bytesperline != 0) {
+        vd->chroma_stride = vd->fmt.fmt.pix_mp.plane_fmt[1].bytesperline;
+    }
+}
+
+static void prepare_buffer(struct video_device *vd, struct v4l2_buffer *buf, struct v4l2_plane *planes, unsigned int index) {
+    unsigned int p;
+
+    memset(buf, 0, sizeof(struct v4l2_buffer));
+    buf->index = index;
+    buf->type = vd->buf_type;
+    buf->memory = vd->memory;
+
+    if (vd->buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        memset(planes, 0, sizeof(struct v4l2_plane) * VIDEO_MAX_PLANES);
+        buf->m.planes = planes;
+        buf->length = VIDEO_MAX_PLANES;
+    }
+
+    // User pointer buffers are described on every queue
+    if (vd->memory == V4L2_MEMORY_USERPTR) {
+        if (vd->buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+            buf->length = vd->num_planes;
+            for (p = 0; p < vd->num_planes; p++) {
+                planes[p].m.userptr = (unsigned long) vd->mem[index][p];
+                planes[p].length = vd->mem_length[p];
+            }
+        } else {
+            buf->m.userptr = (unsigned long) vd->mem[index][0];
+            buf->length = vd->mem_length[0];
+        }
+    }
+}
+
+/* Payload of one plane of the dequeued buffer */
+static unsigned char *plane_data(struct video_device *vd, unsigned int plane, size_t *bytesused) {
+    unsigned char *data = vd->mem[vd->buf.index][plane];
+
+    if (vd->buf_type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        *bytesused = vd->buf.bytesused;
+        return data;
+    }
+
+    *bytesused = vd->planes[plane].bytesused - vd->planes[plane].data_offset;
+    return data + vd->planes[plane].data_offset;
+}
+
+/* Try to crop on the device with the selection API so that only the region of
+ * interest crosses the bus. If the driver can't, crop in software instead, clamped
+ * to the frame and aligned to whole macropixels or chroma samples.
+ */
+static void init_crop(struct video_device *vd) {
+    struct v4l2_selection sel;
+    struct v4l2_format fmt;
+    unsigned int width, height;
+    uint32_t pixelformat;
+
+    if (vd->crop_mode == CROP_NONE) {
+        return;
+    }
+
+    memset(&sel, 0, sizeof(struct v4l2_selection));
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_CROP;
+    sel.r = vd->crop;
+
+    if (xioctl(vd->fd, VIDIOC_S_SELECTION, &sel) == 0) {
+        // The driver may have adjusted the rectangle, and the format follows the crop
+        memset(&fmt, 0, sizeof(struct v4l2_format));
+        fmt.type = vd->buf_type;
+
+        if (xioctl(vd->fd, VIDIOC_G_FMT, &fmt) == 0) {
+            get_format(&fmt, &width, &height, &pixelformat);
+        } else {
+            width = height = 0;
+        }
+
+        if (width == sel.r.width && height == sel.r.height) {
+            fprintf(stdout, "Cropping to %ux%u+%d+%d on device %s.\n", sel.r.width, sel.r.height, sel.r.left, sel.r.top, vd->device_filename);
+
+            vd->fmt = fmt;
+            vd->crop = sel.r;
+            vd->crop_mode = CROP_HARDWARE;
+            vd->width = width;
+            vd->height = height;
+            return;
+        }
+
+        // The driver scaled rather than cropped, put the default rectangle back so the frame is only cropped once
+        memset(&sel, 0, sizeof(struct v4l2_selection));
+        sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+
+        if (xioctl(vd->fd, VIDIOC_G_SELECTION, &sel) == 0) {
+            sel.target = V4L2_SEL_TGT_CROP;
+            xioctl(vd->fd, VIDIOC_S_SELECTION, &sel);
+        }
+
+        // The software crop works on whatever geometry the driver now delivers
+        memset(&fmt, 0, sizeof(struct v4l2_format));
+        fmt.type = vd->buf_type;
+
+        if (xioctl(vd->fd, VIDIOC_G_FMT, &fmt) == 0) {
+            get_format(&fmt, &width, &height, &pixelformat);
+
+            vd->fmt = fmt;
+            vd->width = width;
+            vd->height = height;
+        }
+    }
+
+    if (vd->crop.left < 0) {
+        vd->crop.left = 0;
+    }
+    if (vd->crop.top < 0) {
+        vd->crop.top = 0;
+    }
+    if (vd->crop.left >= vd->width || vd->crop.top >= vd->height) {
+        fprintf(stderr, "Crop rectangle is outside the frame on device %s, not cropping.\n", vd->device_filename);
+        vd->crop_mode = CROP_NONE;
+        return;
+    }
+    if (vd->crop.left + vd->crop.width > vd->width) {
+        vd->crop.width = vd->width - vd->crop.left;
+    }
+    if (vd->crop.top + vd->crop.height > vd->height) {
+        vd->crop.height = vd->height - vd->crop.top;
+    }
+
+    if (vd->format_in == V4L2_PIX_FMT_YUYV || vd->format_in == V4L2_PIX_FMT_UYVY) {
+        vd->crop.left &= ~1;
+        vd->crop.width &= ~1u;
+    } else if (format_is_planar(vd->format_in)) {
+        vd->crop.left &= ~1;
+        vd->crop.top &= ~1;
+        vd->crop.width &= ~1u;
+        vd->crop.height &= ~1u;
+    }
+
+    fprintf(stdout, "Device %s can't crop, cropping to %ux%u+%d+%d in software.\n", vd->device_filename, vd->crop.width, vd->crop.height, vd->crop.left, vd->crop.top);
+}
+
+/* Size the pool for the capture buffers plus the scratch frames the pipeline
+ * allocates later, then carve the capture buffers out of it. REQBUFS is tried here
+ * so that drivers without user pointer support fall back to mmap.
+ */
+static int init_userptr(struct video_device *vd) {
+    struct v4l2_requestbuffers rb;
+    size_t frame_size = vd->width * (vd->height + 8) * 2;
+    size_t capture_size = 0;
+    unsigned int i, p;
+
+    for (p = 0; p < vd->num_planes; p++) {
+        if (vd->buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+            vd->mem_length[p] = vd->fmt.fmt.pix_mp.plane_fmt[p].sizeimage;
+        } else {
+            vd->mem_length[p] = vd->fmt.fmt.pix.sizeimage;
+        }
+        if (vd->mem_length[p] == 0) {
+            vd->mem_length[p] = frame_size;
+        }
+        capture_size += (vd->mem_length[p] + BP_ALIGN - 1) & ~((size_t) BP_ALIGN - 1);
+    }
+
+    memset(&rb, 0, sizeof(struct v4l2_requestbuffers));
+    rb.count = NB_BUFFER;
+    rb.type = vd->buf_type;
+    rb.memory = V4L2_MEMORY_USERPTR;
+
+    if (xioctl(vd->fd, VIDIOC_REQBUFS, &rb) < 0) {
+        return -1;
+    }
+
+    if (!bp_init(&vd->pool, NB_BUFFER * capture_size + POOL_SCRATCH_FRAMES * frame_size)) {
+        return -1;
+    }
+
+    for (i = 0; i < NB_BUFFER; i++) {
+        for (p = 0; p < vd->num_planes; p++) {
+            vd->mem[i][p] = bp_alloc(&vd->pool, vd->mem_length[p]);
+        }
+    }
+
+    return 0;
+}
+
+/* Scratch memory comes from the pool while it lasts */
+void *alloc_device_scratch(struct video_device *vd, size_t size) {
+    void *ptr = bp_alloc(&vd->pool, size);
+
+    if (ptr == NULL) {
+        ptr = malloc(size);
+    }
+
+    return ptr;
+}
+
+void free_device_scratch(struct video_device *vd, void *ptr) {
+    if (!bp_contains(&vd->pool, ptr)) {
+        free(ptr);
+    }
 }
 
 int init_v4l2(struct video_device *vd) {
     int i;
+    unsigned int p;
+    unsigned int width, height;
+    uint32_t pixelformat;
     struct v4l2_streamparm setfps;
 
     if ((vd->fd = OPEN_VIDEO(vd->device_filename, O_RDWR)) == -1) {
@@ -184,7 +699,12 @@ int init_v4l2(struct video_device *vd) {
         return -1;
     }
 
-    if ((vd->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) == 0) {
+    // Single planar capture is preferred, multiplanar only drivers use the _MPLANE API
+    if (vd->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) {
+        vd->buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    } else if (vd->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
+        vd->buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    } else {
         fprintf(stderr, "Error opening device %s: video capture not supported.", vd->device_filename);
         return -1;
     }
@@ -204,20 +724,22 @@ int init_v4l2(struct video_device *vd) {
 
     vd->streaming_state = STREAMING_OFF;
 
+    if (vd->negotiate_mode != NEGOTIATE_OFF) {
+        enumerate_formats(vd);
+        negotiate_format(vd);
+    }
+
     // set format in
     memset(&vd->fmt, 0, sizeof(struct v4l2_format));
-    vd->fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vd->fmt.fmt.pix.width = vd->width;
-    vd->fmt.fmt.pix.height = vd->height;
-    vd->fmt.fmt.pix.pixelformat = vd->format_in;
-    vd->fmt.fmt.pix.field = V4L2_FIELD_ANY;
+    vd->fmt.type = vd->buf_type;
+    set_format(&vd->fmt, vd->width, vd->height, vd->format_in);
 
     if (xioctl(vd->fd, VIDIOC_S_FMT, &vd->fmt) < 0) {
         fprintf(stdout, "Unable to set format %d, res %dx%d, device %s. Trying fallback.", vd->format_in, vd->width, vd->height, vd->device_filename);
 
         // Try the fallback format
         vd->format_in = UVC_FALLBACK_FORMAT;
-        vd->fmt.fmt.pix.pixelformat = vd->format_in;
+        set_format(&vd->fmt, vd->width, vd->height, vd->format_in);
 
         if (xioctl(vd->fd, VIDIOC_S_FMT, &vd->fmt) < 0) {
             fprintf(stderr, "Unable to set fallback format %d, res %dx%d, device %s.", vd->format_in, vd->width, vd->height, vd->device_filename);
@@ -225,15 +747,17 @@ int init_v4l2(struct video_device *vd) {
         }
     }
 
-    if ((vd->fmt.fmt.pix.width != vd->width) ||
-            (vd->fmt.fmt.pix.height != vd->height)) {
-        fprintf(stdout, "The format asked unavailable, so the width %d height %d on device %s.", vd->fmt.fmt.pix.width, vd->fmt.fmt.pix.height, vd->device_filename);
+    get_format(&vd->fmt, &width, &height, &pixelformat);
 
-        vd->width = vd->fmt.fmt.pix.width;
-        vd->height = vd->fmt.fmt.pix.height;
+    if ((width != vd->width) ||
+            (height != vd->height)) {
+        fprintf(stdout, "The format asked unavailable, so the width %d height %d on device %s.", width, height, vd->device_filename);
+
+        vd->width = width;
+        vd->height = height;
 
         // look the format is not part of the deal ???
-        if (vd->format_in != vd->fmt.fmt.pix.pixelformat) {
+        if (vd->format_in != pixelformat) {
             if (vd->format_in == V4L2_PIX_FMT_MJPEG) {
                 fprintf(stderr, "The input device %s does not supports MJPEG mode.\nYou may also try the YUV mode, but it requires a much more CPU power.", vd->device_filename);
                 return -1;
@@ -243,15 +767,22 @@ int init_v4l2(struct video_device *vd) {
             } else if (vd->format_in == V4L2_PIX_FMT_Z16) {
                 fprintf(stderr, "The input device %s does not supports Z16 mode.", vd->device_filename);
                 return -1;
+            } else {
+                fprintf(stderr, "The input device %s does not supports %.4s mode.", vd->device_filename, (char *) &vd->format_in);
+                return -1;
             }
         } else {
-            vd->format_in = vd->fmt.fmt.pix.pixelformat;
+            vd->format_in = pixelformat;
         }
     }
 
+    init_crop(vd);
+
+    init_strides(vd);
+
     // set framerate
     memset(&setfps, 0, sizeof(struct v4l2_streamparm));
-    setfps.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    setfps.type = vd->buf_type;
     setfps.parm.capture.timeperframe.numerator = 1;
     setfps.parm.capture.timeperframe.denominator = vd->fps;
 
@@ -261,43 +792,51 @@ int init_v4l2(struct video_device *vd) {
     }
 
 
+    // capture into the application pool when asked to and the driver can
+    if (vd->memory == V4L2_MEMORY_USERPTR && init_userptr(vd) < 0) {
+        fprintf(stdout, "User pointer capture unavailable on device %s, using mmap.\n", vd->device_filename);
+        vd->memory = V4L2_MEMORY_MMAP;
+    }
+
     // request buffers
     memset(&vd->rb, 0, sizeof(struct v4l2_requestbuffers));
     vd->rb.count = NB_BUFFER;
-    vd->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vd->rb.memory = V4L2_MEMORY_MMAP;
+    vd->rb.type = vd->buf_type;
+    vd->rb.memory = vd->memory;
 
     if (xioctl(vd->fd, VIDIOC_REQBUFS, &vd->rb) < 0) {
         fprintf(stderr, "Unable to allocate buffers for device %s.", vd->device_filename);
         return -1;
     }
 
-    // map the buffers
-    for(i = 0; i < NB_BUFFER; i++) {
-        memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
-        vd->buf.index = i;
-        vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        vd->buf.memory = V4L2_MEMORY_MMAP;
+    // map the buffers, every plane of a multiplanar buffer is mapped on its own
+    for(i = 0; i < NB_BUFFER && vd->memory == V4L2_MEMORY_MMAP; i++) {
+        prepare_buffer(vd, &vd->buf, vd->planes, i);
         if (xioctl(vd->fd, VIDIOC_QUERYBUF, &vd->buf)) {
             fprintf(stderr, "Unable to query buffer on device %s.", vd->device_filename);
             return -1;
         }
 
-        vd->mem[i] = mmap(0 /* start anywhere */ ,
-                          vd->buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, vd->fd,
-                          vd->buf.m.offset);
-        if (vd->mem[i] == MAP_FAILED) {
-            fprintf(stderr, "Unable to map buffer on device %s.", vd->device_filename);
-            return -1;
+        for (p = 0; p < vd->num_planes; p++) {
+            if (vd->buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+                vd->mem[i][p] = mmap(0 /* start anywhere */ ,
+                                     vd->planes[p].length, PROT_READ | PROT_WRITE, MAP_SHARED, vd->fd,
+                                     vd->planes[p].m.mem_offset);
+            } else {
+                vd->mem[i][p] = mmap(0 /* start anywhere */ ,
+                                     vd->buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, vd->fd,
+                                     vd->buf.m.offset);
+            }
+            if (vd->mem[i][p] == MAP_FAILED) {
+                fprintf(stderr, "Unable to map buffer on device %s.", vd->device_filename);
+                return -1;
+            }
         }
     }
 
     // Queue the buffers.
     for(i = 0; i < NB_BUFFER; ++i) {
-        memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
-        vd->buf.index = i;
-        vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        vd->buf.memory = V4L2_MEMORY_MMAP;
+        prepare_buffer(vd, &vd->buf, vd->planes, i);
 
         if (xioctl(vd->fd, VIDIOC_QBUF, &vd->buf) < 0) {
             fprintf(stderr, "Unable to query buffer on device %s.", vd->device_filename);
@@ -314,7 +853,7 @@ int init_v4l2(struct video_device *vd) {
 }
 
 static int video_enable(struct video_device *vd) {
-    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int type = vd->buf_type;
     int ret;
 
     fprintf(stdout, "Starting capture on device %s.", vd->device_filename);
@@ -328,7 +867,7 @@ static int video_enable(struct video_device *vd) {
 }
 
 static int video_disable(struct video_device *vd, streaming_state disabledState) {
-    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int type = vd->buf_type;
     int ret;
 
     fprintf(stdout, "Stopping capture on device %s.", vd->device_filename);
@@ -401,44 +940,100 @@ size_t copy_frame(unsigned char *dst, const size_t dst_size, unsigned char *src,
 }
 
 size_t capture_frame(struct video_device *vd) {
-    memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
-    vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vd->buf.memory = V4L2_MEMORY_MMAP;
+    unsigned char *data;
+    size_t bytesused;
+    size_t luma_size;
+    uint64_t stage_start;
 
+    prepare_buffer(vd, &vd->buf, vd->planes, 0);
+
+    stage_start = fm_monotonic_ns();
     if (xioctl(vd->fd, VIDIOC_DQBUF, &vd->buf) < 0) {
         fprintf(stderr, "Unable to dequeue buffer on device %s.", vd->device_filename);
         return -1;
     }
+    hg_stage_end(HG_STAGE_DQBUF, stage_start);
+
+    // Only monotonic driver timestamps can be compared with other clocks on the host
+    if ((vd->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        vd->capture_ns = (uint64_t) vd->buf.timestamp.tv_sec * 1000000000ull + (uint64_t) vd->buf.timestamp.tv_usec * 1000;
+    } else {
+        vd->capture_ns = fm_monotonic_ns();
+    }
 
+    data = plane_data(vd, 0, &bytesused);
+
+    stage_start = fm_monotonic_ns();
     switch(vd->format_in) {
         case V4L2_PIX_FMT_MJPEG:
-            if (vd->buf.bytesused <= MIN_BYTES_USED) {
+            if (bytesused <= MIN_BYTES_USED) {
                 return 0;
             }
 
-            memcpy(vd->framebuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
+            memcpy(vd->framebuffer, data, bytesused);
             break;
 
         case V4L2_PIX_FMT_YUYV:
-            if (vd->buf.bytesused > vd->framebuffer_size)
-                memcpy(vd->framebuffer, vd->mem[vd->buf.index], vd->framebuffer_size);
+        case V4L2_PIX_FMT_UYVY:
+        case V4L2_PIX_FMT_Z16:
+        case V4L2_PIX_FMT_Y16:
+        case V4L2_PIX_FMT_GREY:
+            if (vd->crop_mode == CROP_SOFTWARE) {
+                // Only the rows of the crop band are copied, the view skips the columns
+                size_t offset = vd->crop.top * vd->stride;
+                size_t len = vd->view.size;
+
+                if (offset >= bytesused) {
+                    return 0;
+                }
+                if (offset + len > bytesused) {
+                    len = bytesused - offset;
+                }
+
+                memcpy(vd->framebuffer, data + offset, len);
+                bytesused = len;
+                break;
+            }
+
+            if (bytesused > vd->framebuffer_size)
+                memcpy(vd->framebuffer, data, vd->framebuffer_size);
             else
-                memcpy(vd->framebuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
+                memcpy(vd->framebuffer, data, bytesused);
             break;
 
-    case V4L2_PIX_FMT_Z16:
-            if (vd->buf.bytesused > vd->framebuffer_size)
-                memcpy(vd->framebuffer, vd->mem[vd->buf.index], vd->framebuffer_size);
-            else
-                memcpy(vd->framebuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV12M:
+            if (bytesused > vd->framebuffer_size) {
+                bytesused = vd->framebuffer_size;
+            }
+
+            // A contiguous buffer already has the framebuffer layout
+            if (vd->num_planes == 1) {
+                memcpy(vd->framebuffer, data, bytesused);
+                break;
+            }
+
+            luma_size = vd->stride * vd->height;
+            if (bytesused > luma_size) {
+                bytesused = luma_size;
+            }
+            memcpy(vd->framebuffer, data, bytesused);
+
+            data = plane_data(vd, 1, &luma_size);
+            if (luma_size > vd->framebuffer_size - vd->stride * vd->height) {
+                luma_size = vd->framebuffer_size - vd->stride * vd->height;
+            }
+            memcpy(vd->framebuffer + vd->stride * vd->height, data, luma_size);
+            bytesused += luma_size;
             break;
 
         default:
             return -1;
             break;
     }
+    hg_stage_end(HG_STAGE_COPY, stage_start);
 
-    return vd->buf.bytesused;
+    return bytesused;
 }
 
 int requeue_device_buffer(struct video_device *vd) {
@@ -450,6 +1045,52 @@ int requeue_device_buffer(struct video_device *vd) {
     return 0;
 }
 
+/* Requeue a buffer that was held after later frames were captured */
+int requeue_device_buffer_index(struct video_device *vd, unsigned int index) {
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+
+    prepare_buffer(vd, &buf, planes, index);
+
+    if (xioctl(vd->fd, VIDIOC_QBUF, &buf) < 0) {
+        fprintf(stderr, "Unable to requeue buffer %u on device %s.", index, vd->device_filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * param vd : streaming device
+ * param fds : NB_BUFFER * num_planes entries, buffer major
+ * returns : 0 if every plane of every buffer was exported as a dmabuf fd
+ */
+int export_device_buffers(struct video_device *vd, int *fds) {
+    struct v4l2_exportbuffer expbuf;
+    unsigned int k;
+
+    for (k = 0; k < NB_BUFFER * vd->num_planes; k++) {
+        memset(&expbuf, 0, sizeof(struct v4l2_exportbuffer));
+        expbuf.type = vd->buf_type;
+        expbuf.index = k / vd->num_planes;
+        expbuf.plane = k % vd->num_planes;
+        expbuf.flags = O_RDONLY | O_CLOEXEC;
+
+        if (xioctl(vd->fd, VIDIOC_EXPBUF, &expbuf) < 0) {
+            fprintf(stderr, "Unable to export buffer %u on device %s.", expbuf.index, vd->device_filename);
+
+            while (k-- > 0) {
+                close(fds[k]);
+            }
+            return -1;
+        }
+
+        fds[k] = expbuf.fd;
+    }
+
+    return 0;
+}
+
 void destroy_video_device(struct video_device *vd) {
     if (vd->streaming_state == STREAMING_ON) {
         video_disable(vd, STREAMING_OFF);
@@ -459,9 +1100,11 @@ void destroy_video_device(struct video_device *vd) {
         fprintf(stderr, "Failed to close device %s.", vd->device_filename);
     }
 
-    free(vd->framebuffer);
+    free_device_scratch(vd, vd->framebuffer);
     vd->framebuffer = NULL;
 
+    bp_destroy(&vd->pool);
+
     free(vd->device_filename);
     vd->device_filename = NULL;
 
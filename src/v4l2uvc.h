@@ -41,10 +41,15 @@
 #include <sys/select.h>
 #include <linux/videodev2.h>
 
+#include "buffer_pool.h"
+
 #define MAX_DEVICE_FILENAME 32
 
 #define NB_BUFFER 4
 
+// Frame sized scratch buffers reserved in the USERPTR pool besides the capture buffers
+#define POOL_SCRATCH_FRAMES 2
+
 #define IOCTL_RETRY 4
 
 #ifdef DISABLE_LIBV4L2
@@ -81,11 +86,43 @@ enum _streaming_state {
 };
 typedef enum _streaming_state streaming_state;
 
+enum _crop_mode {
+    CROP_NONE = 0,
+    CROP_HARDWARE = 1,
+    CROP_SOFTWARE = 2,
+};
+typedef enum _crop_mode crop_mode;
+
+/* The part of the captured frame the rest of the pipeline works on. With software
+ * cropping this points into the frame buffer at the crop origin, rows keep the
+ * stride of the full frame.
+ */
+struct frame_view {
+    unsigned char *data;
+    size_t size;
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+
+    // Interleaved CbCr plane of NV12 frames, NULL for packed formats
+    unsigned char *chroma;
+    unsigned int chroma_stride;
+};
+
 struct resolution {
     unsigned int width;
     unsigned int height;
     uint32_t pixelformat; // Corresponds to the pixelformat found in struct v4l2_fmtdesc
+    unsigned int max_fps; // 0 when the driver doesn't enumerate frame intervals
+};
+
+enum _negotiate_mode {
+    NEGOTIATE_OFF = 0,
+    NEGOTIATE_RAW = 1, // Only formats the pipeline can process pixel by pixel
+    NEGOTIATE_ANY = 2, // Compressed passthrough allowed
+    NEGOTIATE_YUV422 = 3, // Only packed 4:2:2, which color detection classifies directly
 };
+typedef enum _negotiate_mode negotiate_mode;
 
 struct video_device {
     int fd;
@@ -93,8 +130,14 @@ struct video_device {
     struct v4l2_capability cap;
     struct v4l2_format fmt;
     struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
     struct v4l2_requestbuffers rb;
-    void *mem[NB_BUFFER];
+    enum v4l2_buf_type buf_type;
+    unsigned int num_planes;
+    enum v4l2_memory memory;
+    void *mem[NB_BUFFER][VIDEO_MAX_PLANES];
+    size_t mem_length[VIDEO_MAX_PLANES];
+    bp_pool_t pool;
     unsigned char *framebuffer;
     size_t framebuffer_size;
     streaming_state streaming_state;
@@ -104,6 +147,16 @@ struct video_device {
     int fps;
     int format_in;
     int jpeg_quality;
+    unsigned int stride;
+    unsigned int chroma_stride;
+    negotiate_mode negotiate_mode;
+
+    crop_mode crop_mode;
+    struct v4l2_rect crop;
+    struct frame_view view;
+
+    // CLOCK_MONOTONIC capture time of the last dequeued buffer
+    uint64_t capture_ns;
 
     struct v4l2_fmtdesc *formats;
     unsigned int format_count;
@@ -117,11 +170,18 @@ struct video_device {
 
 int init_v4l2(struct video_device *vd);
 
-struct video_device *create_video_device(char *device, int width, int height, int fps, int format, int jpeg_quality);
+unsigned int format_bytes_per_pixel(uint32_t pixelformat);
+int format_is_planar(uint32_t pixelformat);
+
+struct video_device *create_video_device(char *device, int width, int height, int fps, int format, int jpeg_quality, struct v4l2_rect *p_crop, negotiate_mode negotiate, int userptr);
+void *alloc_device_scratch(struct video_device *vd, size_t size);
+void free_device_scratch(struct video_device *vd, void *ptr);
 void destroy_video_device(struct video_device *vd);
 
 size_t copy_frame(unsigned char *dst, const size_t dst_size, unsigned char *src, const size_t src_size);
 size_t capture_frame(struct video_device *vd);
 int requeue_device_buffer(struct video_device *vd);
+int requeue_device_buffer_index(struct video_device *vd, unsigned int index);
+int export_device_buffers(struct video_device *vd, int *fds);
 
 #endif